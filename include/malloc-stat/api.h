@@ -77,6 +77,7 @@ typedef struct {
     uint64_t deallocated;
     uint64_t in_use;
     uint64_t peak_in_use;
+    uint64_t requested; /* bytes asked by the callers, `allocated` - `requested` is the slack */
 } malloc_stat_vars;
 
 /* calculate the difference */
@@ -88,6 +89,7 @@ typedef struct {
         ,after.deallocated   - before.deallocated \
         ,after.in_use        - before.in_use \
         ,after.peak_in_use   - before.peak_in_use \
+        ,after.requested     - before.requested \
     }
 
 /* test for equality */
@@ -145,6 +147,618 @@ typedef malloc_stat_vars (*malloc_stat_get_stat_fnptr)(malloc_stat_operation op)
     if ( fnptr ) fnptr(fd); \
 } while (0)
 
+/* turn on or turn off the passthrough mode, returns the previous state.
+ * in this mode all the calls are forwarded to the real functions without
+ * any accounting, logging or collecting. the blocks allocated in this mode
+ * are freed correctly after the mode is turned off, but their frees are
+ * still accounted, so like after a reset, the stat is only meaningful
+ * relative to the moment the mode was turned off.
+ */
+#define MALLOC_STAT_SET_PASSTHROUGH(on) ({ \
+    int (*fnptr)(int) = (int (*)(int))dlsym(RTLD_DEFAULT, "malloc_stat_set_passthrough"); \
+    (fnptr ? fnptr(on) : 0); \
+})
+
+/* the collectors are optional analyses working on sampled blocks.
+ * all of them are disabled by default and cost nothing in that case.
+ */
+#define MALLOC_STAT_COLLECT_CHURN   (1u << 0) /* short-lived blocks, pooling candidates */
+#define MALLOC_STAT_COLLECT_REALLOC (1u << 1) /* realloc() growth chains */
+#define MALLOC_STAT_COLLECT_XTHREAD (1u << 2) /* blocks freed by a thread other than the allocating one */
+#define MALLOC_STAT_COLLECT_FALSE_SHARING (1u << 3) /* cache lines shared by blocks of different threads */
+#define MALLOC_STAT_COLLECT_SLACK   (1u << 4) /* usable bytes over the requested ones */
+#define MALLOC_STAT_COLLECT_RESIDENT (1u << 5) /* resident pages of the large blocks, on demand */
+#define MALLOC_STAT_COLLECT_LEAKS   (1u << 6) /* sites whose live bytes keep growing, periodic */
+#define MALLOC_STAT_COLLECT_NUMA    (1u << 7) /* NUMA node of the allocating CPU and of the pages */
+#define MALLOC_STAT_COLLECT_CLASSES (1u << 8) /* size class histogram of all the blocks, not sampled */
+
+/* the size classes used by the collectors and the size class histogram: the class 0 holds the blocks
+ * up to 16 bytes, the class N holds (8 << N, 16 << N] bytes, the last
+ * class holds all the bigger blocks too.
+ */
+#define MALLOC_STAT_SIZE_CLASSES 24
+#define MALLOC_STAT_SIZE_CLASS_LIMIT(n) ((uint64_t)16 << (n))
+
+/* enable the set of collectors, returns the previously enabled set.
+ * a collector enabled again drops its previous results and takes only
+ * the blocks allocated since then.
+ * example:
+ *
+ * MALLOC_STAT_SET_COLLECTORS(MALLOC_STAT_COLLECT_CHURN);
+ */
+#define MALLOC_STAT_SET_COLLECTORS(mask) ({ \
+    uint32_t (*fnptr)(uint32_t) = (uint32_t (*)(uint32_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_set_collectors"); \
+    (fnptr ? fnptr(mask) : 0); \
+})
+
+/* only every N-th allocation of a thread is tracked by the collectors.
+ * the numbers reported by the collectors are scaled back by N.
+ */
+#define MALLOC_STAT_SET_SAMPLE_RATE(n) do { \
+    void (*fnptr)(uint32_t) = dlsym(RTLD_DEFAULT, "malloc_stat_set_sample_rate"); \
+    if ( fnptr ) fnptr(n); \
+} while (0)
+
+/* write the reports of all the enabled collectors into the FD
+ */
+#define MALLOC_STAT_REPORT(fd) do { \
+    void (*fnptr)(int) = dlsym(RTLD_DEFAULT, "malloc_stat_report"); \
+    if ( fnptr ) fnptr(fd); \
+} while (0)
+
+/* the malloc_stat_churn_site struct is used for represent an allocation
+ * site which blocks are mostly freed on the same thread shortly after
+ * allocation, i.e. a good candidate for a pool or a stack buffer.
+ */
+typedef struct {
+    void *site;                  /* return address of the allocating call */
+    uint64_t calls;              /* allocations made by the site */
+    uint64_t short_lived;        /* of them freed within the churn window */
+    uint64_t calls_per_sec;      /* allocation rate since the collector was enabled */
+    uint64_t median_lifetime_ns; /* median lifetime of the freed blocks */
+    uint64_t min_size;           /* the smallest requested size */
+    uint64_t max_size;           /* the biggest requested size */
+    uint64_t avg_size;           /* the average requested size */
+} malloc_stat_churn_site;
+
+/* a block is short-lived when it is freed by the allocating thread within
+ * `ns` nanoseconds or within `events` allocations of that thread.
+ * zero disables the corresponding limit.
+ */
+#define MALLOC_STAT_SET_CHURN_WINDOW(ns, events) do { \
+    void (*fnptr)(uint64_t, uint64_t) = dlsym(RTLD_DEFAULT, "malloc_stat_set_churn_window"); \
+    if ( fnptr ) fnptr(ns, events); \
+} while (0)
+
+/* fills up to `max` flagged sites ordered by the allocation rate,
+ * returns the number of filled items. this and the other getters of the
+ * top sites (realloc chains, cross-thread sites, slack) return 256 sites
+ * at most.
+ */
+#define MALLOC_STAT_GET_CHURN(sites, max) ({ \
+    size_t (*fnptr)(malloc_stat_churn_site *, size_t) = (size_t (*)(malloc_stat_churn_site *, size_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_get_churn"); \
+    (fnptr ? fnptr(sites, max) : 0); \
+})
+
+/* the malloc_stat_realloc_site struct is used for represent an allocation
+ * site which blocks are repeatedly grown by realloc().
+ */
+typedef struct {
+    void *site;              /* return address of the allocating call */
+    uint64_t chains;         /* blocks grown at least once */
+    uint64_t grows;          /* realloc() calls which grew them */
+    uint64_t max_grows;      /* the longest chain */
+    uint64_t copied;         /* bytes copied when the block was moved (estimated) */
+    uint64_t avg_first_size; /* the average size before the first grow */
+    uint64_t avg_final_size; /* the average size when the block was freed */
+} malloc_stat_realloc_site;
+
+/* fills up to `max` sites ordered by the copied bytes,
+ * returns the number of filled items.
+ */
+#define MALLOC_STAT_GET_REALLOC_CHAINS(sites, max) ({ \
+    size_t (*fnptr)(malloc_stat_realloc_site *, size_t) = (size_t (*)(malloc_stat_realloc_site *, size_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_get_realloc_chains"); \
+    (fnptr ? fnptr(sites, max) : 0); \
+})
+
+/* the malloc_stat_xthread_vars struct is used for represent the
+ * cross-thread frees, the most allocators take a slow path for them.
+ */
+typedef struct {
+    uint64_t frees;        /* frees of the sampled blocks */
+    uint64_t remote_frees; /* of them made by a thread other than the allocating one */
+    uint64_t remote_bytes; /* requested bytes of the remote freed blocks */
+    uint64_t class_frees[MALLOC_STAT_SIZE_CLASSES];
+    uint64_t class_remote_frees[MALLOC_STAT_SIZE_CLASSES];
+    uint64_t pairs_dropped; /* remote frees whose thread pair did not fit the pairs table */
+} malloc_stat_xthread_vars;
+
+/* the cross-thread frees of the blocks allocated by the site */
+typedef struct {
+    void *site;
+    uint64_t frees;
+    uint64_t remote_frees;
+    uint64_t remote_bytes;
+    uint64_t class_remote_frees[MALLOC_STAT_SIZE_CLASSES];
+} malloc_stat_xthread_site;
+
+/* the frees made by `free_tid` of the blocks allocated by `alloc_tid` */
+typedef struct {
+    uint32_t alloc_tid;
+    uint32_t free_tid;
+    uint64_t frees;
+    uint64_t bytes;
+} malloc_stat_xthread_pair;
+
+#define MALLOC_STAT_GET_XTHREAD() ({ \
+    malloc_stat_xthread_vars (*fnptr)(void) = (malloc_stat_xthread_vars (*)(void)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_get_xthread"); \
+    (fnptr ? fnptr() : (malloc_stat_xthread_vars){}); \
+})
+
+/* fills up to `max` sites ordered by the remote frees,
+ * returns the number of filled items.
+ */
+#define MALLOC_STAT_GET_XTHREAD_SITES(sites, max) ({ \
+    size_t (*fnptr)(malloc_stat_xthread_site *, size_t) = (size_t (*)(malloc_stat_xthread_site *, size_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_get_xthread_sites"); \
+    (fnptr ? fnptr(sites, max) : 0); \
+})
+
+/* fills up to `max` thread pairs ordered by the frees,
+ * returns the number of filled items.
+ */
+#define MALLOC_STAT_GET_XTHREAD_PAIRS(pairs, max) ({ \
+    size_t (*fnptr)(malloc_stat_xthread_pair *, size_t) = (size_t (*)(malloc_stat_xthread_pair *, size_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_get_xthread_pairs"); \
+    (fnptr ? fnptr(pairs, max) : 0); \
+})
+
+/* the cache lines holding the live blocks allocated by the two sites
+ * on the different threads. the analysis is made on demand.
+ */
+typedef struct {
+    void *site_a;
+    void *site_b;
+    uint64_t lines;
+} malloc_stat_false_sharing;
+
+/* fills up to `max` site pairs ordered by the shared lines,
+ * returns the number of filled items.
+ */
+#define MALLOC_STAT_GET_FALSE_SHARING(pairs, max) ({ \
+    size_t (*fnptr)(malloc_stat_false_sharing *, size_t) = (size_t (*)(malloc_stat_false_sharing *, size_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_get_false_sharing"); \
+    (fnptr ? fnptr(pairs, max) : 0); \
+})
+
+/* the sites wasting the most bytes by rounding the requested sizes up */
+typedef struct {
+    void *site;
+    uint64_t calls;
+    uint64_t requested;
+    uint64_t usable;
+    uint64_t min_size;
+    uint64_t max_size;
+} malloc_stat_slack_site;
+
+/* fills up to `max` sites ordered by the slack, returns the number of filled items */
+#define MALLOC_STAT_GET_SLACK(sites, max) ({ \
+    size_t (*fnptr)(malloc_stat_slack_site *, size_t) = (size_t (*)(malloc_stat_slack_site *, size_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_get_slack"); \
+    (fnptr ? fnptr(sites, max) : 0); \
+})
+
+/* the pages of the live blocks of an allocation site found resident in
+ * the memory by the last resident scan, scaled back by the sample rate.
+ * `virtual_bytes` - `resident_bytes` is never touched since allocated.
+ */
+typedef struct {
+    void *site;
+    uint64_t blocks;
+    uint64_t virtual_bytes;  /* the pages spanned by the blocks */
+    uint64_t resident_bytes; /* of them resident */
+} malloc_stat_resident_site;
+
+/* requests the scan of the live sampled blocks of `min_size` bytes and
+ * more in the background thread, `wait` waits until it is finished.
+ * returns 0 if the collector is not enabled.
+ */
+#define MALLOC_STAT_SCAN_RESIDENT(min_size, wait) ({ \
+    int (*fnptr)(uint64_t, int) = (int (*)(uint64_t, int)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_scan_resident"); \
+    (fnptr ? fnptr(min_size, wait) : 0); \
+})
+
+/* fills the totals and up to `max` sites ordered by the untouched bytes
+ * found by the last finished scan, returns the number of filled items.
+ */
+#define MALLOC_STAT_GET_RESIDENT(total, sites, max) ({ \
+    size_t (*fnptr)(malloc_stat_resident_site *, malloc_stat_resident_site *, size_t) = \
+        (size_t (*)(malloc_stat_resident_site *, malloc_stat_resident_site *, size_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_get_resident"); \
+    (fnptr ? fnptr(total, sites, max) : 0); \
+})
+
+/* a site whose live bytes kept growing over the last window of samples,
+ * scaled back by the sample rate.
+ */
+typedef struct {
+    void *site;
+    uint64_t live_bytes; /* requested bytes of the live blocks at the last sample */
+    uint64_t growth;     /* of them allocated within the window */
+    uint64_t slope;      /* bytes per second, the least squares fit over the window */
+    uint64_t window_ns;  /* the time spanned by the window */
+} malloc_stat_leak_site;
+
+/* sets the interval of the samples of the live bytes per site, 10 seconds
+ * by default. returns the previous interval.
+ */
+#define MALLOC_STAT_SET_LEAK_INTERVAL(ms) ({ \
+    uint64_t (*fnptr)(uint64_t) = (uint64_t (*)(uint64_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_set_leak_interval"); \
+    (fnptr ? fnptr(ms) : 0); \
+})
+
+/* takes a sample of the live bytes per site now, besides the periodic ones,
+ * e.g. to drive the samples by the program itself with a long interval.
+ * returns 0 if MALLOC_STAT_COLLECT_LEAKS is not enabled.
+ */
+#define MALLOC_STAT_SAMPLE_LEAKS() ({ \
+    int (*fnptr)(void) = (int (*)(void)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_sample_leaks"); \
+    (fnptr ? fnptr() : 0); \
+})
+
+/* fills up to `max` sites flagged by the last sample ordered by the slope,
+ * returns the number of filled items.
+ */
+#define MALLOC_STAT_GET_LEAKS(sites, max) ({ \
+    size_t (*fnptr)(malloc_stat_leak_site *, size_t) = (size_t (*)(malloc_stat_leak_site *, size_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_get_leaks"); \
+    (fnptr ? fnptr(sites, max) : 0); \
+})
+
+/* the allocations made on the CPUs of a NUMA node, scaled back by the sample rate */
+#define MALLOC_STAT_NUMA_NODES 64
+
+typedef struct {
+    uint64_t allocations;
+    uint64_t allocated; /* usable bytes */
+} malloc_stat_numa_node;
+
+/* fills an item per online node, at most MALLOC_STAT_NUMA_NODES, returns the number of nodes */
+#define MALLOC_STAT_GET_NUMA_NODES(nodes) ({ \
+    size_t (*fnptr)(malloc_stat_numa_node *) = (size_t (*)(malloc_stat_numa_node *)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_get_numa_nodes"); \
+    (fnptr ? fnptr(nodes) : 0); \
+})
+
+/* the placement of the pages of the live sampled blocks of a thread or of
+ * a site compared to the node of the CPU they were allocated on, scaled
+ * back by the sample rate. the bytes of a block are counted per page.
+ */
+typedef struct {
+    void *site;    /* the allocation site, NULL for a thread */
+    uint32_t tid;  /* the allocating thread, 0 for a site */
+    uint64_t blocks;
+    uint64_t local_bytes;    /* on the node of the allocating CPU */
+    uint64_t remote_bytes;   /* on another node */
+    uint64_t unplaced_bytes; /* never touched, not placed yet */
+} malloc_stat_numa_usage;
+
+/* scans the live sampled blocks, fills the totals and up to `max` threads
+ * ordered by the remote bytes, returns the number of filled items.
+ */
+#define MALLOC_STAT_GET_NUMA_THREADS(total, threads, max) ({ \
+    size_t (*fnptr)(malloc_stat_numa_usage *, malloc_stat_numa_usage *, size_t) = \
+        (size_t (*)(malloc_stat_numa_usage *, malloc_stat_numa_usage *, size_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_get_numa_threads"); \
+    (fnptr ? fnptr(total, threads, max) : 0); \
+})
+
+/* the same per allocation site */
+#define MALLOC_STAT_GET_NUMA_SITES(total, sites, max) ({ \
+    size_t (*fnptr)(malloc_stat_numa_usage *, malloc_stat_numa_usage *, size_t) = \
+        (size_t (*)(malloc_stat_numa_usage *, malloc_stat_numa_usage *, size_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_get_numa_sites"); \
+    (fnptr ? fnptr(total, sites, max) : 0); \
+})
+
+/* the size class histogram of the usable sizes, counted for all the blocks
+ * while MALLOC_STAT_COLLECT_CLASSES is enabled
+ */
+typedef struct {
+    uint64_t allocations;
+    uint64_t deallocations;
+    uint64_t requested; /* bytes asked by the allocations of the class */
+    uint64_t usable;    /* usable bytes of them */
+} malloc_stat_size_class;
+
+/* fills MALLOC_STAT_SIZE_CLASSES items, returns the number of filled items */
+#define MALLOC_STAT_GET_SIZE_CLASSES(classes) ({ \
+    size_t (*fnptr)(malloc_stat_size_class *) = (size_t (*)(malloc_stat_size_class *)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_get_size_classes"); \
+    (fnptr ? fnptr(classes) : 0); \
+})
+
+/* renders the counters, the size class histogram (with MALLOC_STAT_COLLECT_CLASSES) and the top sites in
+ * the Prometheus text format, the same served by the `metrics` option
+ * endpoint. returns the length of the zero-terminated text, truncated
+ * to `size` - 1.
+ */
+#define MALLOC_STAT_GET_METRICS(buf, size) ({ \
+    size_t (*fnptr)(char *, size_t) = (size_t (*)(char *, size_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_get_metrics"); \
+    (fnptr ? fnptr(buf, size) : 0); \
+})
+
+/* the intercepted calls timed by the latency histograms */
+typedef enum {
+     MALLOC_STAT_LATENCY_MALLOC
+    ,MALLOC_STAT_LATENCY_CALLOC
+    ,MALLOC_STAT_LATENCY_REALLOC
+    ,MALLOC_STAT_LATENCY_MEMALIGN
+    ,MALLOC_STAT_LATENCY_POSIX_MEMALIGN
+    ,MALLOC_STAT_LATENCY_ALIGNED_ALLOC
+    ,MALLOC_STAT_LATENCY_VALLOC
+    ,MALLOC_STAT_LATENCY_PVALLOC
+    ,MALLOC_STAT_LATENCY_FREE
+    ,MALLOC_STAT_LATENCY_KINDS
+} malloc_stat_latency_kind;
+
+/* the percentiles of the time spent in the real function, the values
+ * are precise to ~6%, except max_ns.
+ */
+typedef struct {
+    uint64_t calls; /* timed calls */
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+    uint64_t slow_calls; /* calls over the slow calls threshold */
+} malloc_stat_latency;
+
+/* time every N-th intercepted call of a thread, 0 disables the timing.
+ * returns the previous rate.
+ */
+#define MALLOC_STAT_SET_LATENCY_SAMPLE(n) ({ \
+    uint32_t (*fnptr)(uint32_t) = (uint32_t (*)(uint32_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_set_latency_sample"); \
+    (fnptr ? fnptr(n) : 0); \
+})
+
+/* fills MALLOC_STAT_LATENCY_KINDS items indexed by malloc_stat_latency_kind,
+ * returns the number of filled items.
+ */
+#define MALLOC_STAT_GET_LATENCY(latency) ({ \
+    size_t (*fnptr)(malloc_stat_latency *) = (size_t (*)(malloc_stat_latency *)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_get_latency"); \
+    (fnptr ? fnptr(latency) : 0); \
+})
+
+/* the intercepted call slower than the threshold */
+#define MALLOC_STAT_SLOW_FRAMES 16
+
+typedef struct {
+    malloc_stat_latency_kind kind;
+    uint32_t tid;
+    uint64_t size; /* requested, the usable one for free() */
+    uint64_t ns;   /* spent in the real function */
+    uint32_t nframes;
+    void *frames[MALLOC_STAT_SLOW_FRAMES]; /* the backtrace of the caller */
+} malloc_stat_slow_call;
+
+/* time all the intercepted calls and trace the ones slower than `ns`,
+ * 0 disables the tracing. returns the previous threshold.
+ */
+#define MALLOC_STAT_SET_SLOW_THRESHOLD(ns) ({ \
+    uint64_t (*fnptr)(uint64_t) = (uint64_t (*)(uint64_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_set_slow_threshold"); \
+    (fnptr ? fnptr(ns) : 0); \
+})
+
+/* fills up to `max` of the slowest traced calls ordered by the time,
+ * returns the number of filled items.
+ */
+#define MALLOC_STAT_GET_SLOW_CALLS(calls, max) ({ \
+    size_t (*fnptr)(malloc_stat_slow_call *, size_t) = (size_t (*)(malloc_stat_slow_call *, size_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_get_slow_calls"); \
+    (fnptr ? fnptr(calls, max) : 0); \
+})
+
+/* the calls accounted by the module (the executable or a shared object)
+ * holding the return address, the calls made by libc and libstdc++ on
+ * behalf of a module to that module. a free is accounted to the module
+ * which allocated the block, so `in_use` is the live heap of the module.
+ * the module `[unknown]` holds the calls from the code out of any module
+ * and the blocks which could not be tracked, its `in_use` stops at 0.
+ */
+#define MALLOC_STAT_MODULE_PATH 256
+
+typedef struct {
+    void *base; /* the load address, NULL after the module is unloaded */
+    char path[MALLOC_STAT_MODULE_PATH];
+    malloc_stat_vars stat;
+} malloc_stat_module;
+
+/* turn on or turn off the per module accounting, returns the previous state */
+#define MALLOC_STAT_SET_MODULES(on) ({ \
+    int (*fnptr)(int) = (int (*)(int))dlsym(RTLD_DEFAULT, "malloc_stat_set_modules"); \
+    (fnptr ? fnptr(on) : 0); \
+})
+
+/* fills up to `max` modules ordered by the bytes in use,
+ * returns the number of filled items.
+ */
+#define MALLOC_STAT_GET_MODULES(modules, max) ({ \
+    size_t (*fnptr)(malloc_stat_module *, size_t) = (size_t (*)(malloc_stat_module *, size_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_get_modules"); \
+    (fnptr ? fnptr(modules, max) : 0); \
+})
+
+/* the function and the source line of a return address resolved
+ * in-process by the symbols of the module file and its .debug_line.
+ * the call before the address is looked up, as the sites and the frames
+ * of the reports are return addresses.
+ */
+#define MALLOC_STAT_SYMBOL_NAME 256
+
+typedef struct {
+    void *addr;
+    uint64_t offset; /* of the address from the start of the function */
+    uint32_t line;   /* 0 if unknown */
+    char function[MALLOC_STAT_SYMBOL_NAME]; /* empty if unknown */
+    char file[MALLOC_STAT_SYMBOL_NAME];     /* empty if unknown */
+    char module[MALLOC_STAT_MODULE_PATH];   /* empty out of any module */
+} malloc_stat_symbol;
+
+/* turn on or turn off the symbolization of the addresses written by the
+ * reports, returns the previous state.
+ */
+#define MALLOC_STAT_SET_SYMBOLIZE(on) ({ \
+    int (*fnptr)(int) = (int (*)(int))dlsym(RTLD_DEFAULT, "malloc_stat_set_symbolize"); \
+    (fnptr ? fnptr(on) : 0); \
+})
+
+/* resolves the address, returns 0 if its function is not found */
+#define MALLOC_STAT_SYMBOLIZE(addr, sym) ({ \
+    int (*fnptr)(void *, malloc_stat_symbol *) = (int (*)(void *, malloc_stat_symbol *)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_symbolize"); \
+    (fnptr ? fnptr(addr, sym) : 0); \
+})
+
+/* the memory budget: the soft and the hard thresholds of `in_use` of the
+ * process or of a module. a background thread checks them periodically,
+ * so the allocating threads read nothing more. when `in_use` rises to a
+ * threshold the callback is called on that thread, never inside malloc(),
+ * and the threshold is re-armed once `in_use` drops under 15/16 of it.
+ */
+#define MALLOC_STAT_BUDGET_SOFT 0
+#define MALLOC_STAT_BUDGET_HARD 1
+
+#define MALLOC_STAT_BUDGET_DUMP (1u << 0) /* write the summary and the reports when a threshold is reached */
+
+typedef struct {
+    char module[MALLOC_STAT_MODULE_PATH]; /* the path of the module, empty for the process */
+    int level;          /* MALLOC_STAT_BUDGET_SOFT or MALLOC_STAT_BUDGET_HARD */
+    uint64_t threshold;
+    uint64_t in_use;    /* when the threshold was found reached */
+} malloc_stat_budget_event;
+
+typedef void (*malloc_stat_budget_fnptr)(const malloc_stat_budget_event *ev, void *arg);
+
+/* sets the budget of the process (`module` is NULL) or of the module whose
+ * path ends with `module` (eg. "libplugin.so"), the per module accounting
+ * must be enabled for it. a zero threshold is not checked, both zero
+ * remove the budget. `fn` can be NULL. returns 0 on error.
+ * example:
+ *
+ * MALLOC_STAT_SET_BUDGET(NULL, 768 << 20, 960 << 20, MALLOC_STAT_BUDGET_DUMP, on_budget, NULL);
+ */
+#define MALLOC_STAT_SET_BUDGET(module, soft, hard, flags, fn, arg) ({ \
+    int (*fnptr)(const char *, uint64_t, uint64_t, uint32_t, malloc_stat_budget_fnptr, void *) = \
+        (int (*)(const char *, uint64_t, uint64_t, uint32_t, malloc_stat_budget_fnptr, void *)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_set_budget"); \
+    (fnptr ? fnptr(module, soft, hard, flags, fn, arg) : 0); \
+})
+
+/* sets the interval of the checks of the budgets, 100 milliseconds by
+ * default. returns the previous interval.
+ */
+#define MALLOC_STAT_SET_BUDGET_INTERVAL(ms) ({ \
+    uint64_t (*fnptr)(uint64_t) = (uint64_t (*)(uint64_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_set_budget_interval"); \
+    (fnptr ? fnptr(ms) : 0); \
+})
+
+/* the log written by the `log_ring` option is a ring of the memory mapped
+ * segment files `<path>.0` .. `<path>.<count - 1>`, the segment `seq` is
+ * stored in the file `seq % count`. each file starts with this header
+ * followed by `size` bytes of the text log, the valid part is [begin, end).
+ * the segment is written concurrently until `state` becomes
+ * MALLOC_STAT_RING_FINISHED, a reader must re-check `seq` after copying
+ * the data because the slot is reused by the segment `seq + count`.
+ * the valid part of every segment starts with the `head` bytes of the log
+ * header (# PID .. # MAPS), a reader joining the segments skips them but
+ * in the first one.
+ */
+#define MALLOC_STAT_RING_MAGIC   0x31474e4952534d4dull /* "MMSRING1" */
+#define MALLOC_STAT_RING_HEADER  4096 /* the data starts at this offset */
+#define MALLOC_STAT_RING_UNUSED  UINT64_MAX /* `seq` of the never used slot */
+
+#define MALLOC_STAT_RING_WRITING  0
+#define MALLOC_STAT_RING_FINISHED 1
+#define MALLOC_STAT_RING_LAST     2 /* finished, the process finalized the log */
+
+typedef struct {
+    uint64_t magic;
+    uint64_t seq;
+    uint64_t size;
+    uint64_t count;
+    uint64_t begin;
+    uint64_t end;
+    uint64_t committed; /* bytes copied into the segment, including the unused ones */
+    uint32_t state;
+    uint32_t pid;
+    uint64_t head; /* the copy of the log header starting the valid part of each segment */
+} malloc_stat_ring_header;
+
+/* the handling of fork(): by default the child inherits the counters. it
+ * always logs into its own `<log_path>.<pid>` or ring `<log_ring>.<pid>`.
+ */
+#define MALLOC_STAT_FORK_RESET (1u << 0) /* the child starts with the zeroed counters, see MALLOC_STAT_RESET */
+
+/* sets the handling of the following forks, returns the previous one */
+#define MALLOC_STAT_SET_FORK(flags) ({ \
+    uint32_t (*fnptr)(uint32_t) = (uint32_t (*)(uint32_t))dlsym(RTLD_DEFAULT, "malloc_stat_set_fork"); \
+    (fnptr ? fnptr(flags) : 0); \
+})
+
+/* the counters of a process tree published into the POSIX shared memory
+ * `/dev/shm/<name>`, a slot per process. a process claims a free slot or
+ * the one of a process gone, the forked child claims its own one. the slot
+ * is updated under a seqlock: `seq` is odd while it is being written, so a
+ * reader copies it and retries if `seq` was odd or has changed.
+ */
+#define MALLOC_STAT_SHM_MAGIC   0x314d48535453534dull /* "MSSTSHM1" */
+#define MALLOC_STAT_SHM_WORKERS 256
+
+#define MALLOC_STAT_SHM_FREE    0
+#define MALLOC_STAT_SHM_RUNNING 1
+#define MALLOC_STAT_SHM_EXITED  2 /* finalized, the counters are the final ones */
+
+typedef struct {
+    uint32_t pid; /* 0 for a free slot */
+    uint32_t ppid;
+    uint32_t state;
+    uint32_t seq;
+    uint64_t updated_ns; /* CLOCK_MONOTONIC of the last update */
+    malloc_stat_vars stat;
+} malloc_stat_shm_worker;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t workers; /* number of the slots */
+    uint32_t pid;     /* the process which created the area */
+    malloc_stat_shm_worker worker[MALLOC_STAT_SHM_WORKERS];
+} malloc_stat_shm;
+
+/* attaches the process to the shared counters `name` (eg. "/myserver")
+ * publishing them every `interval_ms`, 0 keeps the current interval (1
+ * second by default). returns 0 on error. a NULL `name` publishes the last
+ * counters, marks the slot as exited and detaches the process.
+ */
+#define MALLOC_STAT_SET_SHM(name, interval_ms) ({ \
+    int (*fnptr)(const char *, uint64_t) = (int (*)(const char *, uint64_t)) \
+        dlsym(RTLD_DEFAULT, "malloc_stat_set_shm"); \
+    (fnptr ? fnptr(name, interval_ms) : 0); \
+})
+
 /* just a helpers.
  * example:
  *
@@ -160,6 +774,7 @@ typedef malloc_stat_vars (*malloc_stat_get_stat_fnptr)(malloc_stat_operation op)
          "+==========================================================================+\n" \
          "| allocs  : %-14" PRIu64 "| deallocs: %-14" PRIu64 "| inuse: %-14" PRIu64 "|\n" \
          "| AL bytes: %-14" PRIu64 "| DE bytes: %-14" PRIu64 "| peak : %-14" PRIu64 "|\n" \
+         "| RQ bytes: %-14" PRIu64 "| slack   : %-14" PRIu64 "|                      |\n" \
          "+==========================================================================+\n" \
         ,caption \
         ,stat.allocations \
@@ -168,6 +783,8 @@ typedef malloc_stat_vars (*malloc_stat_get_stat_fnptr)(malloc_stat_operation op)
         ,stat.allocated \
         ,stat.deallocated \
         ,stat.peak_in_use \
+        ,stat.requested \
+        ,stat.allocated - stat.requested \
     );
 
 #define MALLOC_STAT_PRINT(caption, stat) \
@@ -0,0 +1,88 @@
+/*
+ * This file is the part of malloc-stat project.
+ * Alloca/free library with backtrace for not freed areas and byte-exact memory tracking.
+ * Author: niXman, 2022 year
+ * https://github.com/niXman/malloc-stat
+ *
+ * malloc/free micro-benchmark used to compare the overhead of malloc-stat.so
+ * modes against the run without the preload, see `run-bench` target.
+ *
+ * usage: bench [label [ops [repeats]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+/* live blocks kept by the benchmark, the random one is replaced on each step */
+#define BENCH_SLOTS 1024
+
+static uint64_t rnd_state = 88172645463325252ull;
+
+static inline uint64_t rnd() {
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+
+    return rnd_state;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* returns the nanoseconds spent per malloc+free pair */
+static double bench_run(size_t ops) {
+    static void *slots[BENCH_SLOTS];
+    uint64_t start = now_ns();
+
+    for ( size_t i = 0; i < ops; ++i ) {
+        uint64_t r = rnd();
+        size_t idx = r % BENCH_SLOTS;
+        /* log-uniform sizes from 16 bytes up to 4K */
+        size_t size = (size_t)16 << ((r >> 16) % 9);
+        size += (r >> 32) % size;
+
+        free(slots[idx]);
+        slots[idx] = malloc(size);
+        *(volatile char *)slots[idx] = 0;
+    }
+
+    double res = (double)(now_ns() - start) / ops;
+    for ( size_t i = 0; i < BENCH_SLOTS; ++i ) {
+        free(slots[i]);
+        slots[i] = NULL;
+    }
+
+    return res;
+}
+
+static int cmp_double(const void *l, const void *r) {
+    double a = *(const double *)l, b = *(const double *)r;
+
+    return (a > b) - (a < b);
+}
+
+int main(int argc, char **argv) {
+    const char *label = argc > 1 ? argv[1] : "bench";
+    size_t ops = argc > 2 ? strtoull(argv[2], NULL, 10) : 2000000;
+    size_t repeats = argc > 3 ? strtoull(argv[3], NULL, 10) : 7;
+    double res[repeats ? repeats : 1];
+
+    /* warming up */
+    bench_run(ops / 10 + 1);
+
+    for ( size_t i = 0; i < repeats; ++i ) {
+        res[i] = bench_run(ops);
+    }
+    qsort(res, repeats, sizeof(res[0]), cmp_double);
+
+    fprintf(stdout, "%-16s: median %7.2f ns/op, min %7.2f ns/op, max %7.2f ns/op\n"
+        ,label, res[repeats / 2], res[0], res[repeats - 1]);
+
+    return 0;
+}
@@ -0,0 +1,512 @@
+/*
+ * This file is the part of malloc-stat project.
+ * Alloca/free library with backtrace for not freed areas and byte-exact memory tracking.
+ * Author: niXman, 2022 year
+ * https://github.com/niXman/malloc-stat
+ *
+ * the parser of the log produced by malloc-stat.so, shared by the tools.
+ * the format is described in README.md. the line parser works on a line
+ * at a time and never allocates, `log_stream_run()` splits the stream
+ * into chunks parsed by the worker threads and hands them over to the
+ * consumers in the stream order.
+ */
+
+#ifndef __malloc_stat__log_reader_h
+#define __malloc_stat__log_reader_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+typedef enum {
+     LOG_ENTRY_NONE /* not an entry line */
+    ,LOG_ENTRY_MALLOC
+    ,LOG_ENTRY_CALLOC
+    ,LOG_ENTRY_MEMALIGN
+    ,LOG_ENTRY_POSIX_MEMALIGN
+    ,LOG_ENTRY_VALLOC
+    ,LOG_ENTRY_PVALLOC
+    ,LOG_ENTRY_ALIGNED_ALLOC
+    ,LOG_ENTRY_REALLOC_ALLOC
+    ,LOG_ENTRY_REALLOC_INPLACE
+    ,LOG_ENTRY_REALLOC_REALLOC
+    ,LOG_ENTRY_REALLOC_FREE
+    ,LOG_ENTRY_FREE
+    ,LOG_ENTRY_FREE_NULL
+    ,LOG_ENTRY_INIT
+    ,LOG_ENTRY_FINI
+    ,LOG_ENTRY_OTHER /* an entry of the unknown type */
+} log_entry_type;
+
+typedef struct {
+    log_entry_type type;
+    uint64_t size;    /* usable size of the block */
+    uint64_t ptr;     /* address of the block */
+    uint64_t old_ptr; /* previous address for LOG_ENTRY_REALLOC_REALLOC */
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t ts;      /* nanoseconds for `log_format=timed`, 0 otherwise */
+} log_entry;
+
+static const struct {
+    const char *name;
+    size_t len;
+    log_entry_type type;
+} log_entry_names[] = {
+     {"malloc", 6, LOG_ENTRY_MALLOC}
+    ,{"free", 4, LOG_ENTRY_FREE}
+    ,{"calloc", 6, LOG_ENTRY_CALLOC}
+    ,{"realloc-inplace", 15, LOG_ENTRY_REALLOC_INPLACE}
+    ,{"realloc-realloc", 15, LOG_ENTRY_REALLOC_REALLOC}
+    ,{"realloc-alloc", 13, LOG_ENTRY_REALLOC_ALLOC}
+    ,{"realloc-free", 12, LOG_ENTRY_REALLOC_FREE}
+    ,{"free(NULL)", 10, LOG_ENTRY_FREE_NULL}
+    ,{"memalign", 8, LOG_ENTRY_MEMALIGN}
+    ,{"posix_memalign", 14, LOG_ENTRY_POSIX_MEMALIGN}
+    ,{"valloc", 6, LOG_ENTRY_VALLOC}
+    ,{"pvalloc", 7, LOG_ENTRY_PVALLOC}
+    ,{"aligned_alloc", 13, LOG_ENTRY_ALIGNED_ALLOC}
+    ,{"INIT", 4, LOG_ENTRY_INIT}
+    ,{"FINI", 4, LOG_ENTRY_FINI}
+};
+
+/* returns true for the entries allocating a new block */
+static inline int log_entry_is_alloc(log_entry_type type) {
+    return type >= LOG_ENTRY_MALLOC && type <= LOG_ENTRY_REALLOC_ALLOC;
+}
+
+/* returns true for the entries freeing a block */
+static inline int log_entry_is_free(log_entry_type type) {
+    return type == LOG_ENTRY_FREE || type == LOG_ENTRY_REALLOC_FREE;
+}
+
+static inline const char* log_skip_spaces(const char *p, const char *end) {
+    for ( ; p < end && *p == ' '; ++p )
+    {}
+
+    return p;
+}
+
+static inline const char* log_parse_dec(const char *p, const char *end, uint64_t *val) {
+    uint64_t res = 0;
+    for ( p = log_skip_spaces(p, end); p < end && *p >= '0' && *p <= '9'; ++p ) {
+        res = res * 10 + (uint64_t)(*p - '0');
+    }
+    *val = res;
+
+    return p;
+}
+
+/* parses `0x1234`, `(nil)` and `1234` as hexadecimal */
+static inline const char* log_parse_hex(const char *p, const char *end, uint64_t *val) {
+    uint64_t res = 0;
+
+    p = log_skip_spaces(p, end);
+    if ( p < end && *p == '(' ) {
+        for ( ; p < end && *p != ' '; ++p )
+        {}
+        *val = 0;
+
+        return p;
+    }
+    if ( end - p > 1 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X') ) {
+        p += 2;
+    }
+    for ( ; p < end; ++p ) {
+        char c = *p;
+        if ( c >= '0' && c <= '9' ) {
+            res = res << 4 | (uint64_t)(c - '0');
+        } else if ( c >= 'a' && c <= 'f' ) {
+            res = res << 4 | (uint64_t)(c - 'a' + 10);
+        } else if ( c >= 'A' && c <= 'F' ) {
+            res = res << 4 | (uint64_t)(c - 'A' + 10);
+        } else {
+            break;
+        }
+    }
+    *val = res;
+
+    return p;
+}
+
+/* parses the entry line `+ method size ptr pid tid [old ptr] [ns]` without
+ * the trailing newline, returns the type of the entry.
+ */
+static inline log_entry_type log_parse_entry(const char *line, const char *end, log_entry *e) {
+    if ( end - line < 3 || line[0] != '+' || line[1] != ' ' ) {
+        return LOG_ENTRY_NONE;
+    }
+
+    const char *name = line + 2, *p = name;
+    for ( ; p < end && *p != ' '; ++p )
+    {}
+
+    size_t len = (size_t)(p - name);
+    e->type = LOG_ENTRY_OTHER;
+    for ( size_t i = 0; i < sizeof(log_entry_names) / sizeof(log_entry_names[0]); ++i ) {
+        if ( log_entry_names[i].len == len && memcmp(log_entry_names[i].name, name, len) == 0 ) {
+            e->type = log_entry_names[i].type;
+            break;
+        }
+    }
+
+    uint64_t pid = 0, tid = 0;
+    p = log_parse_dec(p, end, &e->size);
+    p = log_parse_hex(p, end, &e->ptr);
+    p = log_parse_dec(p, end, &pid);
+    p = log_parse_dec(p, end, &tid);
+    e->pid = (uint32_t)pid;
+    e->tid = (uint32_t)tid;
+    e->old_ptr = 0;
+    if ( e->type == LOG_ENTRY_REALLOC_REALLOC ) {
+        p = log_parse_hex(p, end, &e->old_ptr);
+    }
+    log_parse_dec(p, end, &e->ts);
+
+    return e->type;
+}
+
+/* parses the backtrace frame line `0x1234`, returns 0 for other lines */
+static inline int log_parse_frame(const char *line, const char *end, uint64_t *addr) {
+    if ( end - line < 3 || line[0] != '0' || line[1] != 'x' ) {
+        return 0;
+    }
+    log_parse_hex(line, end, addr);
+
+    return 1;
+}
+
+/*************************************************************************************************/
+/* the map of the live blocks keyed by address, linear probing with backward shift deletion */
+
+typedef struct {
+    uint64_t addr; /* 0 for the empty entry */
+    uint64_t val;
+    uint64_t size;
+} log_map_entry;
+
+typedef struct {
+    log_map_entry *entries;
+    size_t mask;
+    size_t count;
+} log_map;
+
+static inline size_t log_map_hash(const log_map *m, uint64_t addr) {
+    return (size_t)((addr >> 4) * 0x9E3779B97F4A7C15ull >> 16) & m->mask;
+}
+
+static inline void log_map_init(log_map *m, size_t capacity) {
+    for ( m->mask = 15; m->mask + 1 < capacity * 2; m->mask = m->mask << 1 | 1 )
+    {}
+    m->entries = calloc(m->mask + 1, sizeof(log_map_entry));
+    m->count = 0;
+}
+
+static inline void log_map_free(log_map *m) {
+    free(m->entries);
+    m->entries = NULL;
+    m->mask = m->count = 0;
+}
+
+static inline log_map_entry* log_map_find(const log_map *m, uint64_t addr) {
+    for ( size_t i = log_map_hash(m, addr); m->entries[i].addr; i = (i + 1) & m->mask ) {
+        if ( m->entries[i].addr == addr ) {
+            return &m->entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* returns the existing entry or the new one with zero `val` and `size` */
+static inline log_map_entry* log_map_insert(log_map *m, uint64_t addr) {
+    if ( (m->count + 1) * 2 > m->mask + 1 ) {
+        log_map old = *m;
+        log_map_init(m, old.mask + 1);
+        for ( size_t i = 0; i <= old.mask; ++i ) {
+            if ( old.entries[i].addr ) {
+                *log_map_insert(m, old.entries[i].addr) = old.entries[i];
+            }
+        }
+        log_map_free(&old);
+    }
+
+    size_t i = log_map_hash(m, addr);
+    for ( ; m->entries[i].addr && m->entries[i].addr != addr; i = (i + 1) & m->mask )
+    {}
+    if ( !m->entries[i].addr ) {
+        m->entries[i].addr = addr;
+        m->entries[i].val = m->entries[i].size = 0;
+        ++m->count;
+    }
+
+    return &m->entries[i];
+}
+
+static inline void log_map_remove(log_map *m, log_map_entry *e) {
+    size_t i = (size_t)(e - m->entries), j = i;
+    for ( ;; ) {
+        j = (j + 1) & m->mask;
+        if ( !m->entries[j].addr ) {
+            break;
+        }
+        /* moves the entry back if its home is not in the (i, j] range */
+        size_t home = log_map_hash(m, m->entries[j].addr);
+        if ( (j > i && (home <= i || home > j)) || (j < i && home <= i && home > j) ) {
+            m->entries[i] = m->entries[j];
+            i = j;
+        }
+    }
+    m->entries[i].addr = 0;
+    --m->count;
+}
+
+/*************************************************************************************************/
+/* the parallel stream parser */
+
+/* the size of the chunk read at once, the chunk is cut before its last entry line */
+#define LOG_STREAM_CHUNK (4u << 20)
+
+typedef struct {
+    log_entry e;
+    uint64_t site; /* the first frame of the backtrace, 0 without `bt_depth` */
+} log_op;
+
+typedef struct {
+    uint64_t seq;
+    int state;
+    unsigned pending;   /* the consumers that did not process the batch yet */
+    char *text;         /* the chunk, the lines are complete */
+    size_t len;
+    log_op *ops;        /* the parsed entry lines of the chunk, NONE ones are skipped */
+    size_t nops;
+    size_t ops_cap;
+} log_batch;
+
+/* called for every batch in the stream order, each consumer runs in its own thread */
+typedef void (*log_consumer_fn)(void *arg, const log_batch *batch);
+
+enum { LOG_BATCH_FREE, LOG_BATCH_READ, LOG_BATCH_PARSING, LOG_BATCH_PARSED };
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    log_batch *batches;
+    unsigned nbatches;
+    unsigned nconsumers;
+    uint64_t total;     /* the number of batches read, final when `eof` is set */
+    int eof;
+    log_consumer_fn *fns;
+    void **args;
+} log_stream;
+
+typedef struct {
+    log_stream *stream;
+    unsigned idx;
+} log_stream_consumer;
+
+static inline void log_parse_batch(log_batch *b) {
+    const char *p = b->text, *end = b->text + b->len;
+    log_op *last = NULL;
+
+    b->nops = 0;
+    while ( p < end ) {
+        const char *eol = memchr(p, '\n', end - p);
+        eol = eol ? eol : end;
+        if ( *p == '+' ) {
+            if ( b->nops == b->ops_cap ) {
+                b->ops_cap = b->ops_cap ? b->ops_cap * 2 : 4096;
+                b->ops = realloc(b->ops, b->ops_cap * sizeof(log_op));
+            }
+            last = &b->ops[b->nops];
+            if ( log_parse_entry(p, eol, &last->e) != LOG_ENTRY_NONE ) {
+                last->site = 0;
+                ++b->nops;
+            } else {
+                last = NULL;
+            }
+        } else if ( last && *p == '0' ) {
+            if ( !last->site ) {
+                log_parse_frame(p, eol, &last->site);
+            }
+        } else {
+            last = NULL;
+        }
+        p = eol + 1;
+    }
+}
+
+static inline void* log_stream_worker(void *arg) {
+    log_stream *s = arg;
+
+    pthread_mutex_lock(&s->lock);
+    for ( ;; ) {
+        log_batch *b = NULL;
+        for ( unsigned i = 0; i < s->nbatches && !b; ++i ) {
+            if ( s->batches[i].state == LOG_BATCH_READ ) {
+                b = &s->batches[i];
+            }
+        }
+        if ( !b ) {
+            if ( s->eof ) {
+                break;
+            }
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+        b->state = LOG_BATCH_PARSING;
+        pthread_mutex_unlock(&s->lock);
+
+        log_parse_batch(b);
+
+        pthread_mutex_lock(&s->lock);
+        b->state = LOG_BATCH_PARSED;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+static inline void* log_stream_consumer_thread(void *arg) {
+    log_stream_consumer *c = arg;
+    log_stream *s = c->stream;
+
+    for ( uint64_t seq = 0; ; ++seq ) {
+        log_batch *b = &s->batches[seq % s->nbatches];
+
+        pthread_mutex_lock(&s->lock);
+        int done = 0;
+        while ( !(b->seq == seq && b->state == LOG_BATCH_PARSED) && !(done = s->eof && seq == s->total) ) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        pthread_mutex_unlock(&s->lock);
+        if ( done ) {
+            break;
+        }
+
+        s->fns[c->idx](s->args[c->idx], b);
+
+        pthread_mutex_lock(&s->lock);
+        if ( --b->pending == 0 ) {
+            b->state = LOG_BATCH_FREE;
+            pthread_cond_broadcast(&s->cond);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    return NULL;
+}
+
+/* reads the whole `fd` and calls every consumer for every batch in the stream order.
+ * the memory is bounded by the number of the batches in flight.
+ * returns 0 on success, errno on the read error.
+ */
+static inline int log_stream_run(int fd, unsigned workers, log_consumer_fn *fns, void **args, unsigned nconsumers) {
+    log_stream s = {
+         .lock = PTHREAD_MUTEX_INITIALIZER
+        ,.cond = PTHREAD_COND_INITIALIZER
+        ,.nbatches = (workers ? workers : 1) * 2 + 2
+        ,.nconsumers = nconsumers
+        ,.fns = fns
+        ,.args = args
+    };
+    pthread_t worker_threads[workers ? workers : 1], consumer_threads[nconsumers];
+    log_stream_consumer consumers[nconsumers];
+    char *carry = malloc(LOG_STREAM_CHUNK);
+    size_t carried = 0;
+    int res = 0;
+
+    workers = workers ? workers : 1;
+    s.batches = calloc(s.nbatches, sizeof(log_batch));
+    for ( unsigned i = 0; i < s.nbatches; ++i ) {
+        s.batches[i].text = malloc(LOG_STREAM_CHUNK);
+        s.batches[i].seq = UINT64_MAX;
+    }
+    for ( unsigned i = 0; i < workers; ++i ) {
+        pthread_create(&worker_threads[i], NULL, log_stream_worker, &s);
+    }
+    for ( unsigned i = 0; i < nconsumers; ++i ) {
+        consumers[i].stream = &s;
+        consumers[i].idx = i;
+        pthread_create(&consumer_threads[i], NULL, log_stream_consumer_thread, &consumers[i]);
+    }
+
+    for ( uint64_t seq = 0; ; ++seq ) {
+        log_batch *b = &s.batches[seq % s.nbatches];
+
+        pthread_mutex_lock(&s.lock);
+        while ( b->state != LOG_BATCH_FREE ) {
+            pthread_cond_wait(&s.cond, &s.lock);
+        }
+        pthread_mutex_unlock(&s.lock);
+
+        memcpy(b->text, carry, carried);
+        size_t len = carried;
+        ssize_t rd = 1;
+        while ( len < LOG_STREAM_CHUNK && rd > 0 ) {
+            rd = read(fd, b->text + len, LOG_STREAM_CHUNK - len);
+            if ( rd > 0 ) {
+                len += (size_t)rd;
+            } else if ( rd < 0 && errno == EINTR ) {
+                rd = 1;
+            } else if ( rd < 0 ) {
+                res = errno;
+            }
+        }
+
+        /* cuts the chunk before its last entry line so the backtrace lines stay with their entry */
+        size_t cut = len;
+        if ( rd > 0 ) {
+            for ( cut = len; cut > 0 && !(b->text[cut - 1] == '\n' && cut < len && b->text[cut] == '+'); --cut )
+            {}
+            if ( cut == 0 ) {
+                /* no entry line in the whole chunk, cuts at the last line */
+                for ( cut = len; cut > 0 && b->text[cut - 1] != '\n'; --cut )
+                {}
+                cut = cut ? cut : len;
+            }
+        }
+        carried = len - cut;
+        memcpy(carry, b->text + cut, carried);
+
+        pthread_mutex_lock(&s.lock);
+        if ( cut ) {
+            b->len = cut;
+            b->seq = seq;
+            b->pending = s.nconsumers;
+            b->state = s.nconsumers ? LOG_BATCH_READ : LOG_BATCH_FREE;
+            s.total = seq + 1;
+        }
+        if ( rd <= 0 && !carried ) {
+            s.eof = 1;
+        }
+        pthread_cond_broadcast(&s.cond);
+        pthread_mutex_unlock(&s.lock);
+
+        if ( s.eof ) {
+            break;
+        }
+    }
+
+    for ( unsigned i = 0; i < workers; ++i ) {
+        pthread_join(worker_threads[i], NULL);
+    }
+    for ( unsigned i = 0; i < nconsumers; ++i ) {
+        pthread_join(consumer_threads[i], NULL);
+    }
+    for ( unsigned i = 0; i < s.nbatches; ++i ) {
+        free(s.batches[i].text);
+        free(s.batches[i].ops);
+    }
+    free(s.batches);
+    free(carry);
+
+    return res;
+}
+
+#endif // __malloc_stat__log_reader_h
@@ -0,0 +1,413 @@
+/*
+ * This file is the part of malloc-stat project.
+ * Alloca/free library with backtrace for not freed areas and byte-exact memory tracking.
+ * Author: niXman, 2022 year
+ * https://github.com/niXman/malloc-stat
+ *
+ * streaming analyzer of the log produced by malloc-stat.so. reads the log
+ * from a file, a pipe or a local TCP socket, parses it by the chunks on all
+ * the cores and reports the summary counters, the live heap and the leaks
+ * grouped by the allocation site.
+ *
+ * usage: malloc-stat-analyze [-j workers] [-p pid] [-n sites] [-l port | trace.log | -]
+ *   -j workers  parsing threads, the number of CPUs by default
+ *   -p pid      analyze the process `pid` of the log, the first one by default
+ *   -n sites    the number of the leaking sites to print, 20 by default
+ *   -l port     accept the log on the localhost TCP `port`
+ */
+
+#include "log-reader.h"
+
+#include <malloc-stat/api.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define ANALYZE_PATH_MAX 4096
+
+typedef struct {
+    uint64_t begin;
+    uint64_t end;
+    uint64_t offset;
+    char *path;
+} analyze_module;
+
+typedef struct {
+    uint64_t site;
+    uint64_t blocks;
+    uint64_t bytes;
+} analyze_leak;
+
+typedef struct {
+    uint32_t pid;
+    uint64_t entries;
+    uint64_t other_pids;  /* the entries of the other processes, skipped */
+    uint64_t calls[LOG_ENTRY_OTHER + 1];
+    uint64_t allocated;
+    uint64_t deallocated;
+    uint64_t in_use;
+    uint64_t peak;
+    uint64_t unknown_frees; /* the blocks allocated before the log was opened */
+    int fini;
+
+    /* the live blocks: address -> allocation site and size */
+    log_map live;
+
+    /* the header */
+    int in_header;
+    int in_maps;
+    char exe[ANALYZE_PATH_MAX];
+    analyze_module *modules;
+    size_t nmodules;
+    size_t modules_cap;
+} analyze_state;
+
+static analyze_state state;
+
+/*************************************************************************************************/
+/* the header */
+
+static void header_line(analyze_state *s, const char *line, const char *end) {
+    size_t len = (size_t)(end - line);
+
+    if ( len > 6 && memcmp(line, "# EXE ", 6) == 0 ) {
+        len = len - 6 < sizeof(s->exe) - 1 ? len - 6 : sizeof(s->exe) - 1;
+        memcpy(s->exe, line + 6, len);
+        s->exe[len] = 0;
+        s->in_maps = 0;
+    } else if ( len >= 6 && memcmp(line, "# MAPS", 6) == 0 ) {
+        s->in_maps = 1;
+    } else if ( line[0] == '#' ) {
+        s->in_maps = 0;
+    } else if ( s->in_maps ) {
+        /* 55d0c4a2e000-55d0c4a30000 r-xp 00002000 fe:00 1234   /usr/bin/prog */
+        uint64_t begin, finish, offset, inode;
+        const char *p = log_parse_hex(line, end, &begin);
+        if ( p >= end || *p != '-' ) {
+            return;
+        }
+        p = log_parse_hex(p + 1, end, &finish);
+        p = log_skip_spaces(p, end);
+        if ( end - p < 4 || p[2] != 'x' ) {
+            return; /* the frames are in the executable mappings only */
+        }
+        p = log_parse_hex(p + 4, end, &offset);
+        p = log_skip_spaces(p, end);
+        for ( ; p < end && *p != ' '; ++p ) /* device */
+        {}
+        p = log_parse_dec(p, end, &inode);
+        p = log_skip_spaces(p, end);
+        if ( p == end ) {
+            return;
+        }
+
+        if ( s->nmodules == s->modules_cap ) {
+            s->modules_cap = s->modules_cap ? s->modules_cap * 2 : 64;
+            s->modules = realloc(s->modules, s->modules_cap * sizeof(analyze_module));
+        }
+        analyze_module *m = &s->modules[s->nmodules++];
+        m->begin = begin;
+        m->end = finish;
+        m->offset = offset;
+        m->path = strndup(p, (size_t)(end - p));
+    }
+}
+
+/* the maps are sorted by the address already */
+static const analyze_module* module_find(const analyze_state *s, uint64_t addr) {
+    size_t lo = 0, hi = s->nmodules;
+    while ( lo < hi ) {
+        size_t mid = (lo + hi) / 2;
+        if ( addr < s->modules[mid].begin ) {
+            hi = mid;
+        } else if ( addr >= s->modules[mid].end ) {
+            lo = mid + 1;
+        } else {
+            return &s->modules[mid];
+        }
+    }
+
+    return NULL;
+}
+
+/* `module+0xoffset` usable with `addr2line -e module offset` */
+static void symbolize(const analyze_state *s, uint64_t addr, char *buf, size_t size) {
+    const analyze_module *m = module_find(s, addr);
+
+    if ( !addr ) {
+        snprintf(buf, size, "unknown (no backtrace, use bt_depth)");
+    } else if ( !m ) {
+        snprintf(buf, size, "0x%" PRIx64, addr);
+    } else {
+        snprintf(buf, size, "0x%" PRIx64 " %s%s+0x%" PRIx64
+            ,addr
+            ,strcmp(m->path, s->exe) == 0 ? "[exe] " : ""
+            ,m->path
+            ,addr - m->begin + m->offset);
+    }
+}
+
+/*************************************************************************************************/
+/* the entries */
+
+static void block_alloc(analyze_state *s, const log_op *op, uint64_t ptr) {
+    log_map_entry *b = log_map_find(&s->live, ptr);
+    if ( b ) {
+        /* the previous block at this address was freed outside of the log */
+        s->in_use -= b->size;
+    }
+    b = log_map_insert(&s->live, ptr);
+    b->val = op->site;
+    b->size = op->e.size;
+    s->allocated += op->e.size;
+    s->in_use += op->e.size;
+    if ( s->in_use > s->peak ) {
+        s->peak = s->in_use;
+    }
+}
+
+static void block_free(analyze_state *s, uint64_t ptr) {
+    log_map_entry *b = log_map_find(&s->live, ptr);
+    if ( !b ) {
+        s->unknown_frees++;
+
+        return;
+    }
+    s->deallocated += b->size;
+    s->in_use -= b->size;
+    log_map_remove(&s->live, b);
+}
+
+static void analyze_consume(void *arg, const log_batch *batch) {
+    analyze_state *s = arg;
+
+    if ( s->in_header ) {
+        const char *p = batch->text, *end = batch->text + batch->len;
+        while ( p < end && *p != '+' ) {
+            const char *eol = memchr(p, '\n', end - p);
+            eol = eol ? eol : end;
+            header_line(s, p, eol);
+            p = eol + 1;
+        }
+        s->in_header = p >= end;
+    }
+
+    for ( size_t i = 0; i < batch->nops; ++i ) {
+        const log_op *op = &batch->ops[i];
+        const log_entry *e = &op->e;
+
+        /* `+ FINI` has no pid */
+        if ( e->type == LOG_ENTRY_FINI ) {
+            s->fini = 1;
+            continue;
+        }
+        if ( !s->pid ) {
+            s->pid = e->pid;
+        }
+        if ( e->pid != s->pid ) {
+            s->other_pids++;
+            continue;
+        }
+        s->entries++;
+        s->calls[e->type]++;
+
+        if ( log_entry_is_alloc(e->type) ) {
+            if ( e->ptr ) {
+                block_alloc(s, op, e->ptr);
+            }
+        } else if ( log_entry_is_free(e->type) ) {
+            block_free(s, e->ptr);
+        } else if ( e->type == LOG_ENTRY_REALLOC_INPLACE || e->type == LOG_ENTRY_REALLOC_REALLOC ) {
+            if ( !e->ptr ) {
+                continue; /* failed */
+            }
+            uint64_t old = e->type == LOG_ENTRY_REALLOC_INPLACE ? e->ptr : e->old_ptr;
+            log_map_entry *b = log_map_find(&s->live, old);
+            /* the block keeps the site of its first allocation */
+            log_op moved = *op;
+            if ( b ) {
+                moved.site = b->val ? b->val : op->site;
+                s->deallocated += b->size;
+                s->in_use -= b->size;
+                log_map_remove(&s->live, b);
+            }
+            block_alloc(s, &moved, e->ptr);
+        }
+    }
+}
+
+/*************************************************************************************************/
+/* report */
+
+static int leak_cmp(const void *l, const void *r) {
+    const analyze_leak *a = l, *b = r;
+
+    return (a->bytes < b->bytes) - (a->bytes > b->bytes);
+}
+
+static uint32_t size_class(uint64_t size) {
+    if ( size <= 16 ) {
+        return 0;
+    }
+    uint32_t c = 64 - __builtin_clzll(size - 1) - 4;
+
+    return c < MALLOC_STAT_SIZE_CLASSES ? c : MALLOC_STAT_SIZE_CLASSES - 1;
+}
+
+static void report(analyze_state *s, size_t max_sites) {
+    static const char *names[LOG_ENTRY_OTHER + 1] = {
+         [LOG_ENTRY_MALLOC] = "malloc", [LOG_ENTRY_CALLOC] = "calloc", [LOG_ENTRY_MEMALIGN] = "memalign"
+        ,[LOG_ENTRY_POSIX_MEMALIGN] = "posix_memalign", [LOG_ENTRY_VALLOC] = "valloc"
+        ,[LOG_ENTRY_PVALLOC] = "pvalloc", [LOG_ENTRY_ALIGNED_ALLOC] = "aligned_alloc"
+        ,[LOG_ENTRY_REALLOC_ALLOC] = "realloc-alloc", [LOG_ENTRY_REALLOC_INPLACE] = "realloc-inplace"
+        ,[LOG_ENTRY_REALLOC_REALLOC] = "realloc-realloc", [LOG_ENTRY_REALLOC_FREE] = "realloc-free"
+        ,[LOG_ENTRY_FREE] = "free", [LOG_ENTRY_FREE_NULL] = "free(NULL)"
+    };
+
+    fprintf(stdout, "# SUMMARY pid %u exe %s entries %" PRIu64 " other-pids %" PRIu64 "%s\n"
+        ,s->pid, s->exe[0] ? s->exe : "?", s->entries, s->other_pids, s->fini ? "" : " (no FINI, the log is truncated)");
+    fprintf(stdout, "# SUMMARY allocated %" PRIu64 " deallocated %" PRIu64 " in-use %" PRIu64 " peak %" PRIu64
+        " unknown-frees %" PRIu64 "\n"
+        ,s->allocated, s->deallocated, s->in_use, s->peak, s->unknown_frees);
+    for ( int i = 0; i <= LOG_ENTRY_OTHER; ++i ) {
+        if ( names[i] && s->calls[i] ) {
+            fprintf(stdout, "# CALLS %s %" PRIu64 "\n", names[i], s->calls[i]);
+        }
+    }
+
+    /* the live heap by the size class and by the site */
+    uint64_t class_blocks[MALLOC_STAT_SIZE_CLASSES] = {0}, class_bytes[MALLOC_STAT_SIZE_CLASSES] = {0};
+    log_map sites;
+    log_map_init(&sites, 1024);
+    for ( size_t i = 0; i <= s->live.mask; ++i ) {
+        const log_map_entry *b = &s->live.entries[i];
+        if ( !b->addr ) {
+            continue;
+        }
+        uint32_t c = size_class(b->size);
+        class_blocks[c]++;
+        class_bytes[c] += b->size;
+        /* the site 0 is kept under the key 1 as zero is the empty key */
+        log_map_entry *site = log_map_insert(&sites, b->val ? b->val : 1);
+        site->val++;
+        site->size += b->size;
+    }
+
+    fprintf(stdout, "# LIVE blocks %zu bytes %" PRIu64 "\n", s->live.count, s->in_use);
+    for ( uint32_t c = 0; c < MALLOC_STAT_SIZE_CLASSES; ++c ) {
+        if ( class_blocks[c] ) {
+            fprintf(stdout, "# LIVE class %" PRIu64 " blocks %" PRIu64 " bytes %" PRIu64 "\n"
+                ,MALLOC_STAT_SIZE_CLASS_LIMIT(c), class_blocks[c], class_bytes[c]);
+        }
+    }
+
+    analyze_leak *leaks = malloc((sites.count ? sites.count : 1) * sizeof(analyze_leak));
+    size_t nleaks = 0;
+    for ( size_t i = 0; i <= sites.mask; ++i ) {
+        if ( sites.entries[i].addr ) {
+            leaks[nleaks].site = sites.entries[i].addr == 1 ? 0 : sites.entries[i].addr;
+            leaks[nleaks].blocks = sites.entries[i].val;
+            leaks[nleaks].bytes = sites.entries[i].size;
+            ++nleaks;
+        }
+    }
+    qsort(leaks, nleaks, sizeof(analyze_leak), leak_cmp);
+
+    fprintf(stdout, "# LEAKS sites %zu blocks %zu bytes %" PRIu64 "\n", nleaks, s->live.count, s->in_use);
+    for ( size_t i = 0; i < nleaks && i < max_sites; ++i ) {
+        char sym[ANALYZE_PATH_MAX + 64];
+        symbolize(s, leaks[i].site, sym, sizeof(sym));
+        fprintf(stdout, "# LEAK blocks %" PRIu64 " bytes %" PRIu64 " site %s\n"
+            ,leaks[i].blocks, leaks[i].bytes, sym);
+    }
+
+    free(leaks);
+    log_map_free(&sites);
+}
+
+/*************************************************************************************************/
+
+static int tcp_accept(const char *port) {
+    struct sockaddr_in addr = {
+         .sin_family = AF_INET
+        ,.sin_port = htons((uint16_t)strtoul(port, NULL, 10))
+        ,.sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    int one = 1, fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if ( fd == -1
+        || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1
+        || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+        || listen(fd, 1) == -1 )
+    {
+        fprintf(stderr, "malloc-stat-analyze: can't listen on localhost:%s\n", port);
+
+        return -1;
+    }
+    fprintf(stderr, "malloc-stat-analyze: listening on localhost:%s\n", port);
+
+    int conn = accept(fd, NULL, NULL);
+    close(fd);
+
+    return conn;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: malloc-stat-analyze [-j workers] [-p pid] [-n sites] [-l port | trace.log | -]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned workers = cpus > 0 ? (unsigned)cpus : 1;
+    size_t max_sites = 20;
+    const char *port = NULL;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "j:p:n:l:")) != -1 ) {
+        switch ( opt ) {
+            case 'j': workers = (unsigned)strtoul(optarg, NULL, 10); break;
+            case 'p': state.pid = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'n': max_sites = strtoull(optarg, NULL, 10); break;
+            case 'l': port = optarg; break;
+            default: usage();
+        }
+    }
+    if ( optind + 1 < argc || (port && optind < argc) ) {
+        usage();
+    }
+
+    int fd = STDIN_FILENO;
+    if ( port ) {
+        fd = tcp_accept(port);
+    } else if ( optind < argc && strcmp(argv[optind], "-") != 0 ) {
+        fd = open(argv[optind], O_RDONLY);
+    }
+    if ( fd == -1 ) {
+        fprintf(stderr, "malloc-stat-analyze: can't open the log\n");
+
+        return EXIT_FAILURE;
+    }
+
+    state.in_header = 1;
+    log_map_init(&state.live, 1 << 16);
+
+    log_consumer_fn fn = analyze_consume;
+    void *arg = &state;
+    int err = log_stream_run(fd, workers, &fn, &arg, 1);
+    if ( err ) {
+        fprintf(stderr, "malloc-stat-analyze: read error: %s\n", strerror(err));
+    }
+
+    report(&state, max_sites);
+
+    return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,608 @@
+/*
+ * This file is the part of malloc-stat project.
+ * Alloca/free library with backtrace for not freed areas and byte-exact memory tracking.
+ * Author: niXman, 2022 year
+ * https://github.com/niXman/malloc-stat
+ *
+ * replays the allocation sequence recorded by malloc-stat.so against the
+ * allocator linked or preloaded into this process, each recorded thread
+ * being replayed by its own thread. reports the throughput, the latency
+ * percentiles, the peak RSS and the fragmentation.
+ *
+ * usage: malloc-stat-replay [-n] [-p pid] [-i usec] trace.log
+ *   -n       do not touch the pages of the allocated blocks
+ *   -p pid   replay the process `pid` of the trace, the first one by default
+ *   -i usec  RSS sampling interval, 1000 by default
+ */
+
+#include "log-reader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* alignment used to replay memalign(), posix_memalign() and aligned_alloc()
+ * because the log does not record the requested one
+ */
+#define REPLAY_ALIGNMENT 64
+
+/* log-linear latency histogram: exact up to 64ns, 32 sub-buckets per power of two */
+#define REPLAY_HIST_SUB_BITS 5
+#define REPLAY_HIST_LINEAR   (2u << REPLAY_HIST_SUB_BITS)
+#define REPLAY_HIST_BUCKETS  (REPLAY_HIST_LINEAR + (64 - REPLAY_HIST_SUB_BITS - 1) * (1u << REPLAY_HIST_SUB_BITS))
+
+/* the threads of the trace above this limit are not replayed */
+#define REPLAY_MAX_THREADS 1024
+
+#define REPLAY_NO_IDX UINT32_MAX
+
+enum {
+     REPLAY_MALLOC
+    ,REPLAY_CALLOC
+    ,REPLAY_MEMALIGN
+    ,REPLAY_REALLOC
+    ,REPLAY_FREE
+    ,REPLAY_KINDS
+};
+
+static const char *replay_kind_names[REPLAY_KINDS] = {
+    "malloc", "calloc", "memalign", "realloc", "free"
+};
+
+typedef struct {
+    uint8_t kind;
+    uint8_t page_align; /* valloc() and pvalloc() */
+    uint32_t slot;      /* the block produced or consumed by the op */
+    uint32_t old_slot;  /* the block consumed by a moving realloc() */
+    uint32_t dep;       /* the previous op on the same block, made by another thread */
+    uint32_t dep_old;   /* the same for `old_slot` */
+    uint64_t size;
+} replay_op;
+
+typedef struct {
+    pthread_t handle;
+    uint32_t tid;       /* thread id in the trace */
+    uint32_t nops;
+    uint32_t *ops;      /* indexes of the ops of this thread, in the trace order */
+    uint64_t hist[REPLAY_KINDS][REPLAY_HIST_BUCKETS];
+    uint64_t calls[REPLAY_KINDS];
+    uint64_t failed;
+} replay_thread;
+
+static replay_op *ops;
+static uint32_t nops;
+static uint8_t *ops_done;        /* set when the op is replayed */
+static uint32_t *ops_thread;     /* the replay thread of the op */
+static void **slots;             /* the replayed block of each trace block */
+static uint32_t nslots;
+static uint64_t peak_live;       /* the peak of the live bytes in the trace order */
+static replay_thread *threads;
+static uint32_t nthreads;
+static int touch_pages = 1;
+
+static volatile int replay_started;
+static volatile int replay_finished;
+
+static size_t page_size;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* the memory of the tool itself is mmap'ed so as to not affect the replayed allocator */
+static void* replay_map(size_t size) {
+    void *ptr = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE
+        ,MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if ( ptr == MAP_FAILED ) {
+        fprintf(stderr, "malloc-stat-replay: can't map %zu bytes\n", size);
+        exit(EXIT_FAILURE);
+    }
+
+    return ptr;
+}
+
+static size_t rss_bytes() {
+    char buf[128];
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if ( fd == -1 ) {
+        return 0;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if ( len <= 0 ) {
+        return 0;
+    }
+
+    uint64_t pages = 0;
+    const char *p = log_parse_dec(buf, buf + len, &pages);
+    log_parse_dec(p, buf + len, &pages);
+
+    return pages * page_size;
+}
+
+/*************************************************************************************************/
+/* trace loading */
+
+/* maps the addresses of the trace to the slots, linear probing with backward shift deletion */
+typedef struct {
+    uint64_t addr;
+    uint32_t slot;
+    uint32_t last; /* the last op on the slot */
+    uint64_t size;
+} addr_entry;
+
+static addr_entry *addrs;
+static size_t addrs_mask;
+
+static inline size_t addr_hash(uint64_t addr) {
+    return (size_t)((addr >> 4) * 0x9E3779B97F4A7C15ull) & addrs_mask;
+}
+
+static addr_entry* addr_find(uint64_t addr) {
+    for ( size_t i = addr_hash(addr); addrs[i].addr; i = (i + 1) & addrs_mask ) {
+        if ( addrs[i].addr == addr ) {
+            return &addrs[i];
+        }
+    }
+
+    return NULL;
+}
+
+static addr_entry* addr_insert(uint64_t addr) {
+    size_t i = addr_hash(addr);
+    for ( ; addrs[i].addr && addrs[i].addr != addr; i = (i + 1) & addrs_mask )
+    {}
+    addrs[i].addr = addr;
+
+    return &addrs[i];
+}
+
+static void addr_remove(addr_entry *e) {
+    size_t i = (size_t)(e - addrs), j = i;
+    for ( ;; ) {
+        j = (j + 1) & addrs_mask;
+        if ( !addrs[j].addr ) {
+            break;
+        }
+        /* moves the entry back if its home is not in the (i, j] range */
+        size_t home = addr_hash(addrs[j].addr);
+        if ( (j > i && (home <= i || home > j)) || (j < i && home <= i && home > j) ) {
+            addrs[i] = addrs[j];
+            i = j;
+        }
+    }
+    addrs[i].addr = 0;
+}
+
+static uint32_t thread_index(uint32_t tid) {
+    for ( uint32_t i = 0; i < nthreads; ++i ) {
+        if ( threads[i].tid == tid ) {
+            return i;
+        }
+    }
+    if ( nthreads == REPLAY_MAX_THREADS ) {
+        fprintf(stderr, "malloc-stat-replay: too many threads, tid %u is skipped\n", tid);
+
+        return REPLAY_NO_IDX;
+    }
+    threads[nthreads].tid = tid;
+
+    return nthreads++;
+}
+
+/* returns the dependency of the op `idx` on the previous op made by another thread */
+static inline uint32_t op_dep(uint32_t last, uint32_t idx) {
+    return last != REPLAY_NO_IDX && ops_thread[last] != ops_thread[idx] ? last : REPLAY_NO_IDX;
+}
+
+static void load_trace(const char *path, uint32_t pid) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if ( fd == -1 || fstat(fd, &st) == -1 ) {
+        fprintf(stderr, "malloc-stat-replay: can't open \"%s\"\n", path);
+        exit(EXIT_FAILURE);
+    }
+    const char *data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+    if ( data == MAP_FAILED ) {
+        fprintf(stderr, "malloc-stat-replay: can't map \"%s\"\n", path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+    const char *end = data + st.st_size;
+    size_t lines = 1;
+    for ( const char *p = data; (p = memchr(p, '\n', end - p)); ++p ) {
+        ++lines;
+    }
+
+    ops = replay_map(lines * sizeof(*ops));
+    ops_thread = replay_map(lines * sizeof(*ops_thread));
+    threads = replay_map(REPLAY_MAX_THREADS * sizeof(*threads));
+    for ( addrs_mask = 1023; addrs_mask < lines * 2; addrs_mask = addrs_mask << 1 | 1 )
+    {}
+    addrs = replay_map((addrs_mask + 1) * sizeof(*addrs));
+
+    log_entry e;
+    uint64_t live = 0;
+    for ( const char *line = data; line < end; ) {
+        const char *eol = memchr(line, '\n', end - line);
+        eol = eol ? eol : end;
+        log_entry_type type = log_parse_entry(line, eol, &e);
+        line = eol + 1;
+
+        if ( type == LOG_ENTRY_NONE || type == LOG_ENTRY_OTHER || type == LOG_ENTRY_FREE_NULL
+            || type == LOG_ENTRY_INIT || type == LOG_ENTRY_FINI )
+        {
+            continue;
+        }
+        if ( !pid ) {
+            pid = e.pid;
+        }
+        if ( e.pid != pid ) {
+            continue;
+        }
+        uint32_t idx = nops, thread = thread_index(e.tid);
+        if ( thread == REPLAY_NO_IDX ) {
+            continue;
+        }
+        replay_op *op = &ops[idx];
+        memset(op, 0, sizeof(*op));
+        op->size = e.size;
+        op->dep = op->dep_old = REPLAY_NO_IDX;
+        op->old_slot = REPLAY_NO_IDX;
+        ops_thread[idx] = thread;
+
+        addr_entry *a;
+        if ( log_entry_is_alloc(type) ) {
+            if ( !e.ptr ) {
+                continue;
+            }
+            op->kind = type == LOG_ENTRY_MALLOC ? REPLAY_MALLOC
+                : type == LOG_ENTRY_CALLOC ? REPLAY_CALLOC
+                : type == LOG_ENTRY_REALLOC_ALLOC ? REPLAY_REALLOC
+                : REPLAY_MEMALIGN;
+            op->page_align = type == LOG_ENTRY_VALLOC || type == LOG_ENTRY_PVALLOC;
+            /* the previous block at this address was freed outside of the trace */
+            a = addr_insert(e.ptr);
+            a->slot = nslots++;
+            a->last = idx;
+            a->size = e.size;
+            live += e.size;
+        } else if ( log_entry_is_free(type) ) {
+            if ( !(a = addr_find(e.ptr)) ) {
+                continue; /* allocated before the trace started */
+            }
+            op->kind = REPLAY_FREE;
+            op->slot = a->slot;
+            op->dep = op_dep(a->last, idx);
+            live -= a->size;
+            addr_remove(a);
+            a = NULL;
+        } else if ( type == LOG_ENTRY_REALLOC_INPLACE ) {
+            if ( !(a = addr_find(e.ptr)) ) {
+                continue;
+            }
+            op->kind = REPLAY_REALLOC;
+            op->old_slot = a->slot;
+            op->dep_old = op_dep(a->last, idx);
+            a->last = idx;
+            live += e.size - a->size;
+            a->size = e.size;
+        } else { /* LOG_ENTRY_REALLOC_REALLOC */
+            if ( !e.ptr || !(a = addr_find(e.old_ptr)) ) {
+                continue; /* failed or the block allocated before the trace started */
+            }
+            op->kind = REPLAY_REALLOC;
+            op->old_slot = a->slot;
+            op->dep_old = op_dep(a->last, idx);
+            live -= a->size;
+            addr_remove(a);
+            a = addr_insert(e.ptr);
+            a->slot = op->old_slot;
+            a->last = idx;
+            a->size = e.size;
+            live += e.size;
+        }
+        if ( a ) {
+            op->slot = a->slot;
+        }
+
+        if ( live > peak_live ) {
+            peak_live = live;
+        }
+        threads[ops_thread[idx]].nops++;
+        ++nops;
+    }
+
+    munmap((void *)data, st.st_size);
+    munmap(addrs, (addrs_mask + 1) * sizeof(*addrs));
+
+    uint32_t *thread_ops = replay_map((size_t)nops * sizeof(uint32_t)), *pos = thread_ops;
+    for ( uint32_t i = 0; i < nthreads; ++i ) {
+        threads[i].ops = pos;
+        pos += threads[i].nops;
+        threads[i].nops = 0;
+    }
+    for ( uint32_t i = 0; i < nops; ++i ) {
+        replay_thread *t = &threads[ops_thread[i]];
+        t->ops[t->nops++] = i;
+    }
+
+    ops_done = replay_map(nops);
+    slots = replay_map((size_t)nslots * sizeof(void *));
+    /* the tool's own pages must be resident before the baseline RSS is taken */
+    memset(ops_done, 0, nops);
+    memset(slots, 0, (size_t)nslots * sizeof(void *));
+}
+
+/*************************************************************************************************/
+/* replay */
+
+static inline uint32_t hist_bucket(uint64_t ns) {
+    if ( ns < REPLAY_HIST_LINEAR ) {
+        return (uint32_t)ns;
+    }
+    uint32_t exp = 63 - __builtin_clzll(ns);
+
+    return REPLAY_HIST_LINEAR
+        + (exp - REPLAY_HIST_SUB_BITS - 1) * (1u << REPLAY_HIST_SUB_BITS)
+        + (uint32_t)((ns >> (exp - REPLAY_HIST_SUB_BITS)) & ((1u << REPLAY_HIST_SUB_BITS) - 1));
+}
+
+/* returns the upper bound of the bucket */
+static uint64_t hist_value(uint32_t bucket) {
+    if ( bucket < REPLAY_HIST_LINEAR ) {
+        return bucket;
+    }
+    uint32_t exp = (bucket - REPLAY_HIST_LINEAR) / (1u << REPLAY_HIST_SUB_BITS) + REPLAY_HIST_SUB_BITS + 1;
+    uint64_t sub = (bucket - REPLAY_HIST_LINEAR) % (1u << REPLAY_HIST_SUB_BITS);
+
+    return ((1ull << REPLAY_HIST_SUB_BITS | sub) + 1) << (exp - REPLAY_HIST_SUB_BITS);
+}
+
+static inline void wait_op(uint32_t idx) {
+    if ( idx == REPLAY_NO_IDX ) {
+        return;
+    }
+    for ( unsigned spins = 0; !__atomic_load_n(&ops_done[idx], __ATOMIC_ACQUIRE); ++spins ) {
+        if ( spins > 64 ) {
+            sched_yield();
+        }
+    }
+}
+
+static inline void touch(void *ptr, size_t size) {
+    for ( size_t off = 0; off < size; off += page_size ) {
+        ((volatile char *)ptr)[off] = 0;
+    }
+}
+
+static void* replay_thread_fn(void *arg) {
+    replay_thread *t = arg;
+
+    while ( !__atomic_load_n(&replay_started, __ATOMIC_ACQUIRE) ) {
+        sched_yield();
+    }
+
+    for ( uint32_t i = 0; i < t->nops; ++i ) {
+        uint32_t idx = t->ops[i];
+        replay_op *op = &ops[idx];
+        void *ptr = NULL;
+
+        wait_op(op->dep);
+        wait_op(op->dep_old);
+
+        uint64_t start = now_ns();
+        switch ( op->kind ) {
+            case REPLAY_MALLOC:
+                ptr = malloc(op->size);
+                break;
+            case REPLAY_CALLOC:
+                ptr = calloc(1, op->size);
+                break;
+            case REPLAY_MEMALIGN:
+                if ( posix_memalign(&ptr, op->page_align ? page_size : REPLAY_ALIGNMENT, op->size) ) {
+                    ptr = NULL;
+                }
+                break;
+            case REPLAY_REALLOC:
+                ptr = realloc(op->old_slot == REPLAY_NO_IDX ? NULL : slots[op->old_slot], op->size);
+                break;
+            case REPLAY_FREE:
+                free(slots[op->slot]);
+                break;
+        }
+        uint64_t elapsed = now_ns() - start;
+
+        t->hist[op->kind][hist_bucket(elapsed)]++;
+        t->calls[op->kind]++;
+
+        if ( op->kind == REPLAY_FREE ) {
+            slots[op->slot] = NULL;
+        } else if ( ptr ) {
+            if ( touch_pages && op->kind != REPLAY_CALLOC ) {
+                touch(ptr, op->size);
+            }
+            slots[op->slot] = ptr;
+        } else {
+            /* keeps the old block on the failed realloc() */
+            t->failed++;
+        }
+
+        __atomic_store_n(&ops_done[idx], 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/*************************************************************************************************/
+/* RSS sampling */
+
+typedef struct {
+    uint64_t interval_ns;
+    size_t baseline;
+    size_t peak;
+} rss_sampler;
+
+static void rss_sample(rss_sampler *s) {
+    size_t rss = rss_bytes();
+    if ( rss > s->peak ) {
+        s->peak = rss;
+    }
+}
+
+static void* rss_sampler_fn(void *arg) {
+    rss_sampler *s = arg;
+    struct timespec ts = {
+         .tv_sec = s->interval_ns / 1000000000u
+        ,.tv_nsec = s->interval_ns % 1000000000u
+    };
+
+    while ( !__atomic_load_n(&replay_finished, __ATOMIC_ACQUIRE) ) {
+        rss_sample(s);
+        nanosleep(&ts, NULL);
+    }
+
+    return NULL;
+}
+
+/*************************************************************************************************/
+/* report */
+
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t calls, double pct) {
+    uint64_t rank = (uint64_t)(calls * pct / 100.0), seen = 0;
+    rank = rank < calls ? rank : calls - 1;
+    for ( uint32_t i = 0; i < REPLAY_HIST_BUCKETS; ++i ) {
+        seen += hist[i];
+        if ( seen > rank ) {
+            return hist_value(i);
+        }
+    }
+
+    return 0;
+}
+
+static void report_latency(const char *name, const uint64_t *hist, uint64_t calls) {
+    if ( !calls ) {
+        return;
+    }
+    fprintf(stdout, "  %-9s: %12" PRIu64 " calls, p50 %6" PRIu64 " ns, p90 %6" PRIu64
+        " ns, p99 %6" PRIu64 " ns, p99.9 %7" PRIu64 " ns, max %9" PRIu64 " ns\n"
+        ,name
+        ,calls
+        ,hist_percentile(hist, calls, 50.0)
+        ,hist_percentile(hist, calls, 90.0)
+        ,hist_percentile(hist, calls, 99.0)
+        ,hist_percentile(hist, calls, 99.9)
+        ,hist_percentile(hist, calls, 100.0)
+    );
+}
+
+static void report(const rss_sampler *s, uint64_t elapsed) {
+    static uint64_t hist[REPLAY_KINDS + 1][REPLAY_HIST_BUCKETS];
+    uint64_t calls[REPLAY_KINDS + 1] = {0}, failed = 0;
+
+    for ( uint32_t i = 0; i < nthreads; ++i ) {
+        for ( uint32_t k = 0; k < REPLAY_KINDS; ++k ) {
+            for ( uint32_t b = 0; b < REPLAY_HIST_BUCKETS; ++b ) {
+                hist[k][b] += threads[i].hist[k][b];
+                hist[REPLAY_KINDS][b] += threads[i].hist[k][b];
+            }
+            calls[k] += threads[i].calls[k];
+            calls[REPLAY_KINDS] += threads[i].calls[k];
+        }
+        failed += threads[i].failed;
+    }
+
+    size_t used = s->peak > s->baseline ? s->peak - s->baseline : 0;
+    /* the part of the peak footprint that never held the live data */
+    double frag = used > peak_live ? 100.0 * (1.0 - (double)peak_live / used) : 0.0;
+
+    fprintf(stdout, "ops       : %u in %u threads, %u blocks, %" PRIu64 " failed\n"
+        ,nops, nthreads, nslots, failed);
+    fprintf(stdout, "elapsed   : %.3f ms, %.0f ops/s\n"
+        ,elapsed / 1e6, elapsed ? nops * 1e9 / elapsed : 0.0);
+    fprintf(stdout, "peak rss  : %zu bytes over the baseline of %zu bytes\n", used, s->baseline);
+    fprintf(stdout, "peak live : %" PRIu64 " bytes\n", peak_live);
+    fprintf(stdout, "frag      : %.2f%% of the peak rss over the peak live\n", frag);
+    fprintf(stdout, "latency   :\n");
+    for ( uint32_t k = 0; k < REPLAY_KINDS; ++k ) {
+        report_latency(replay_kind_names[k], hist[k], calls[k]);
+    }
+    report_latency("all", hist[REPLAY_KINDS], calls[REPLAY_KINDS]);
+}
+
+/*************************************************************************************************/
+
+static void usage() {
+    fprintf(stderr, "usage: malloc-stat-replay [-n] [-p pid] [-i usec] trace.log\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    rss_sampler sampler = {.interval_ns = 1000000};
+    uint32_t pid = 0;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "np:i:")) != -1 ) {
+        switch ( opt ) {
+            case 'n': touch_pages = 0; break;
+            case 'p': pid = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'i': sampler.interval_ns = strtoull(optarg, NULL, 10) * 1000u; break;
+            default: usage();
+        }
+    }
+    if ( optind + 1 != argc ) {
+        usage();
+    }
+
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+    load_trace(argv[optind], pid);
+    if ( !nops ) {
+        fprintf(stderr, "malloc-stat-replay: no entries in \"%s\"\n", argv[optind]);
+
+        return EXIT_FAILURE;
+    }
+
+    for ( uint32_t i = 0; i < nthreads; ++i ) {
+        /* the histograms must be resident before the baseline RSS is taken */
+        memset(threads[i].hist, 0, sizeof(threads[i].hist));
+        if ( pthread_create(&threads[i].handle, NULL, replay_thread_fn, &threads[i]) ) {
+            fprintf(stderr, "malloc-stat-replay: can't create the thread\n");
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    pthread_t sampler_handle;
+    sampler.baseline = sampler.peak = rss_bytes();
+    pthread_create(&sampler_handle, NULL, rss_sampler_fn, &sampler);
+
+    uint64_t start = now_ns();
+    __atomic_store_n(&replay_started, 1, __ATOMIC_RELEASE);
+    for ( uint32_t i = 0; i < nthreads; ++i ) {
+        pthread_join(threads[i].handle, NULL);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    __atomic_store_n(&replay_finished, 1, __ATOMIC_RELEASE);
+    pthread_join(sampler_handle, NULL);
+    rss_sample(&sampler);
+
+    report(&sampler, elapsed);
+
+    return EXIT_SUCCESS;
+}
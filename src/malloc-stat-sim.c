@@ -0,0 +1,679 @@
+/*
+ * This file is the part of malloc-stat project.
+ * Alloca/free library with backtrace for not freed areas and byte-exact memory tracking.
+ * Author: niXman, 2022 year
+ * https://github.com/niXman/malloc-stat
+ *
+ * feeds a recorded trace into the models of the allocators and reports the
+ * internal and external fragmentation, the page footprint over time and the
+ * peak committed memory of each one. the trace is parsed by the worker
+ * threads, every model runs in its own thread.
+ *
+ * usage: malloc-stat-sim [-j workers] [-p pid] [-f ops] [trace.log | -]
+ *   -j workers  parsing threads, the number of CPUs by default
+ *   -p pid      simulate the process `pid` of the trace, the first one by default
+ *   -f ops      print the committed memory of the models every `ops` entries
+ */
+
+#include "log-reader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define SIM_PAGE 4096u
+#define SIM_PAGE_ROUND(n) (((n) + SIM_PAGE - 1) & ~(uint64_t)(SIM_PAGE - 1))
+
+/* the handle of a block served by mmap() directly, the rest of the bits is its size */
+#define SIM_LARGE (1ull << 63)
+
+typedef struct {
+    uint64_t requested;      /* the live bytes of the trace */
+    uint64_t allocated;      /* the live bytes including the size class rounding and headers */
+    uint64_t committed;      /* the pages held by the allocator */
+    uint64_t peak_committed;
+    uint64_t requested_at_peak;
+    uint64_t allocated_at_peak;
+    uint64_t peak_requested;
+    uint64_t ops;
+    uint64_t *footprint;     /* the committed bytes every `footprint_every` ops */
+    uint64_t *footprint_ts;
+    size_t nfootprint;
+    size_t footprint_cap;
+} sim_stats;
+
+typedef struct {
+    const char *name;
+    void (*init)(void **state);
+    /* returns the handle of the block, updates `allocated` and `committed` */
+    uint64_t (*alloc)(void *state, sim_stats *st, uint64_t size);
+    void (*free)(void *state, sim_stats *st, uint64_t handle);
+} sim_model_ops;
+
+typedef struct {
+    const sim_model_ops *ops;
+    void *state;
+    sim_stats st;
+    log_map blocks; /* trace address -> handle and requested size */
+} sim_model;
+
+static uint32_t sim_pid;
+static uint64_t footprint_every;
+
+/*************************************************************************************************/
+/* size class allocator with slabs, the jemalloc-like and the simple slab models */
+
+typedef struct {
+    uint32_t size;
+    uint32_t slab_bytes;
+    uint32_t nregs;
+    uint32_t partial; /* the head of the slabs having the free regions */
+} sim_class;
+
+typedef struct {
+    uint32_t cls;
+    uint32_t nfree;
+    uint32_t prev;
+    uint32_t next;
+    uint16_t *free_regs;
+} sim_slab;
+
+#define SIM_NO_SLAB UINT32_MAX
+
+typedef struct {
+    sim_class classes[64];
+    uint32_t nclasses;
+    uint32_t max_small;
+    uint8_t *lookup;      /* (size + 7) / 8 -> class */
+    sim_slab *slabs;
+    uint32_t nslabs;
+    uint32_t slabs_cap;
+    uint32_t *free_ids;
+    uint32_t nfree_ids;
+    /* rounds the large sizes up to the size class */
+    uint64_t (*large_round)(uint64_t size);
+} sim_slabs;
+
+static void slabs_setup(sim_slabs *s) {
+    s->max_small = s->classes[s->nclasses - 1].size;
+    s->lookup = malloc(s->max_small / 8 + 1);
+    for ( uint32_t i = 0, c = 0; i <= s->max_small / 8; ++i ) {
+        for ( ; s->classes[c].size < i * 8; ++c )
+        {}
+        s->lookup[i] = (uint8_t)c;
+    }
+    for ( uint32_t i = 0; i < s->nclasses; ++i ) {
+        s->classes[i].nregs = s->classes[i].slab_bytes / s->classes[i].size;
+        s->classes[i].partial = SIM_NO_SLAB;
+    }
+}
+
+static void slab_unlink(sim_slabs *s, sim_slab *slab) {
+    if ( slab->prev != SIM_NO_SLAB ) {
+        s->slabs[slab->prev].next = slab->next;
+    } else {
+        s->classes[slab->cls].partial = slab->next;
+    }
+    if ( slab->next != SIM_NO_SLAB ) {
+        s->slabs[slab->next].prev = slab->prev;
+    }
+}
+
+static void slab_link(sim_slabs *s, uint32_t id) {
+    sim_slab *slab = &s->slabs[id];
+    uint32_t *head = &s->classes[slab->cls].partial;
+
+    slab->prev = SIM_NO_SLAB;
+    slab->next = *head;
+    if ( *head != SIM_NO_SLAB ) {
+        s->slabs[*head].prev = id;
+    }
+    *head = id;
+}
+
+static uint32_t slab_create(sim_slabs *s, sim_stats *st, uint32_t cls) {
+    uint32_t id;
+    if ( s->nfree_ids ) {
+        id = s->free_ids[--s->nfree_ids];
+    } else {
+        if ( s->nslabs == s->slabs_cap ) {
+            s->slabs_cap = s->slabs_cap ? s->slabs_cap * 2 : 1024;
+            s->slabs = realloc(s->slabs, s->slabs_cap * sizeof(sim_slab));
+            s->free_ids = realloc(s->free_ids, s->slabs_cap * sizeof(uint32_t));
+        }
+        id = s->nslabs++;
+        s->slabs[id].free_regs = NULL;
+    }
+
+    sim_slab *slab = &s->slabs[id];
+    const sim_class *c = &s->classes[cls];
+    slab->cls = cls;
+    slab->nfree = c->nregs;
+    slab->free_regs = realloc(slab->free_regs, c->nregs * sizeof(uint16_t));
+    /* the lowest region is served first */
+    for ( uint32_t i = 0; i < c->nregs; ++i ) {
+        slab->free_regs[i] = (uint16_t)(c->nregs - 1 - i);
+    }
+    slab_link(s, id);
+    st->committed += c->slab_bytes;
+
+    return id;
+}
+
+static uint64_t slabs_alloc(void *state, sim_stats *st, uint64_t size) {
+    sim_slabs *s = state;
+
+    if ( size > s->max_small ) {
+        uint64_t bytes = SIM_PAGE_ROUND(s->large_round(size));
+        st->allocated += bytes;
+        st->committed += bytes;
+
+        return SIM_LARGE | bytes;
+    }
+
+    uint32_t cls = s->lookup[(size + 7) / 8];
+    uint32_t id = s->classes[cls].partial;
+    if ( id == SIM_NO_SLAB ) {
+        id = slab_create(s, st, cls);
+    }
+
+    sim_slab *slab = &s->slabs[id];
+    uint16_t reg = slab->free_regs[--slab->nfree];
+    if ( !slab->nfree ) {
+        slab_unlink(s, slab);
+    }
+    st->allocated += s->classes[cls].size;
+
+    return (uint64_t)id << 16 | reg;
+}
+
+static void slabs_free(void *state, sim_stats *st, uint64_t handle) {
+    sim_slabs *s = state;
+
+    if ( handle & SIM_LARGE ) {
+        st->allocated -= handle & ~SIM_LARGE;
+        st->committed -= handle & ~SIM_LARGE;
+
+        return;
+    }
+
+    uint32_t id = (uint32_t)(handle >> 16);
+    sim_slab *slab = &s->slabs[id];
+    const sim_class *c = &s->classes[slab->cls];
+
+    st->allocated -= c->size;
+    if ( !slab->nfree ) {
+        slab_link(s, id);
+    }
+    slab->free_regs[slab->nfree++] = (uint16_t)(handle & 0xffff);
+    /* the empty slab is returned at once, like jemalloc with the zero decay time */
+    if ( slab->nfree == c->nregs ) {
+        slab_unlink(s, slab);
+        st->committed -= c->slab_bytes;
+        s->free_ids[s->nfree_ids++] = id;
+    }
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+    while ( b ) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+/* jemalloc: four size classes per doubling, the large ones are rounded the same way */
+static uint64_t jemalloc_round(uint64_t size) {
+    uint32_t lg = 63 - __builtin_clzll(size - 1);
+    uint64_t delta = 1ull << (lg - 2);
+
+    return (size + delta - 1) & ~(delta - 1);
+}
+
+static void jemalloc_init(void **state) {
+    sim_slabs *s = calloc(1, sizeof(sim_slabs));
+
+    s->classes[s->nclasses++] = (sim_class){.size = 8};
+    for ( uint32_t size = 16; size <= 14336; ) {
+        s->classes[s->nclasses++] = (sim_class){.size = size};
+        uint32_t lg = 31 - __builtin_clz(size);
+        size += size < 128 ? 16 : (1u << lg) / 4;
+    }
+    /* the slab is the least common multiple of the class and the page */
+    for ( uint32_t i = 0; i < s->nclasses; ++i ) {
+        uint64_t size = s->classes[i].size;
+        s->classes[i].slab_bytes = (uint32_t)(size / gcd(size, SIM_PAGE) * SIM_PAGE);
+    }
+    s->large_round = jemalloc_round;
+    slabs_setup(s);
+
+    *state = s;
+}
+
+static uint64_t slab_round(uint64_t size) {
+    return size;
+}
+
+/* power of two classes from 16 bytes to 4K in 64K slabs */
+static void slab_init(void **state) {
+    sim_slabs *s = calloc(1, sizeof(sim_slabs));
+
+    for ( uint32_t size = 16; size <= 4096; size *= 2 ) {
+        s->classes[s->nclasses++] = (sim_class){.size = size, .slab_bytes = 64 * 1024};
+    }
+    s->large_round = slab_round;
+    slabs_setup(s);
+
+    *state = s;
+}
+
+/*************************************************************************************************/
+/* glibc-like model: boundary tag chunks with coalescing in a single arena, segregated
+ * bins with the best fit, the top chunk trimmed over the threshold and mmap() for the
+ * large blocks. tcache and fastbins are not modeled.
+ */
+
+#define GLIBC_MIN_CHUNK      32u
+#define GLIBC_MMAP_THRESHOLD (128u * 1024u)
+#define GLIBC_TRIM_THRESHOLD (128u * 1024u)
+#define GLIBC_BINS           128
+/* the offsets of the heap start above zero as zero is the empty key of the maps */
+#define GLIBC_HEAP_BASE      0x10000u
+#define GLIBC_NO_CHUNK       UINT32_MAX
+/* the best fit search in a large bin looks at this many chunks */
+#define GLIBC_FIT_SCAN       64
+
+typedef struct {
+    uint64_t off;
+    uint64_t size;
+    uint32_t prev;
+    uint32_t next;
+    uint32_t bin;
+} glibc_chunk;
+
+typedef struct {
+    glibc_chunk *chunks; /* the free chunks */
+    uint32_t nchunks;
+    uint32_t chunks_cap;
+    uint32_t *free_ids;
+    uint32_t nfree_ids;
+    uint32_t bins[GLIBC_BINS];
+    uint64_t nonempty[GLIBC_BINS / 64];
+    log_map starts;      /* offset -> free chunk */
+    log_map ends;        /* end offset -> free chunk */
+    uint64_t top;        /* the start of the top chunk */
+    uint64_t heap_end;   /* the end of the committed heap */
+} sim_glibc;
+
+static uint32_t glibc_bin(uint64_t size) {
+    if ( size < 1024 ) {
+        return (uint32_t)(size >> 4);
+    }
+    uint32_t lg = 63 - __builtin_clzll(size);
+    uint32_t bin = 64 + (lg - 10) * 4 + (uint32_t)((size >> (lg - 2)) & 3);
+
+    return bin < GLIBC_BINS ? bin : GLIBC_BINS - 1;
+}
+
+static void glibc_insert(sim_glibc *g, uint64_t off, uint64_t size) {
+    uint32_t id;
+    if ( g->nfree_ids ) {
+        id = g->free_ids[--g->nfree_ids];
+    } else {
+        if ( g->nchunks == g->chunks_cap ) {
+            g->chunks_cap = g->chunks_cap ? g->chunks_cap * 2 : 1024;
+            g->chunks = realloc(g->chunks, g->chunks_cap * sizeof(glibc_chunk));
+            g->free_ids = realloc(g->free_ids, g->chunks_cap * sizeof(uint32_t));
+        }
+        id = g->nchunks++;
+    }
+
+    glibc_chunk *c = &g->chunks[id];
+    c->off = off;
+    c->size = size;
+    c->bin = glibc_bin(size);
+    c->prev = GLIBC_NO_CHUNK;
+    c->next = g->bins[c->bin];
+    if ( c->next != GLIBC_NO_CHUNK ) {
+        g->chunks[c->next].prev = id;
+    }
+    g->bins[c->bin] = id;
+    g->nonempty[c->bin / 64] |= 1ull << (c->bin % 64);
+
+    log_map_insert(&g->starts, off)->val = id;
+    log_map_insert(&g->ends, off + size)->val = id;
+}
+
+static void glibc_remove(sim_glibc *g, uint32_t id) {
+    glibc_chunk *c = &g->chunks[id];
+
+    if ( c->prev != GLIBC_NO_CHUNK ) {
+        g->chunks[c->prev].next = c->next;
+    } else {
+        g->bins[c->bin] = c->next;
+        if ( c->next == GLIBC_NO_CHUNK ) {
+            g->nonempty[c->bin / 64] &= ~(1ull << (c->bin % 64));
+        }
+    }
+    if ( c->next != GLIBC_NO_CHUNK ) {
+        g->chunks[c->next].prev = c->prev;
+    }
+
+    log_map_remove(&g->starts, log_map_find(&g->starts, c->off));
+    log_map_remove(&g->ends, log_map_find(&g->ends, c->off + c->size));
+    g->free_ids[g->nfree_ids++] = id;
+}
+
+/* returns the free chunk fitting `size` or GLIBC_NO_CHUNK */
+static uint32_t glibc_fit(sim_glibc *g, uint64_t size) {
+    uint32_t bin = glibc_bin(size);
+
+    if ( bin >= 64 ) {
+        uint32_t best = GLIBC_NO_CHUNK, scanned = 0;
+        for ( uint32_t id = g->bins[bin]; id != GLIBC_NO_CHUNK && scanned < GLIBC_FIT_SCAN; id = g->chunks[id].next, ++scanned ) {
+            if ( g->chunks[id].size >= size && (best == GLIBC_NO_CHUNK || g->chunks[id].size < g->chunks[best].size) ) {
+                best = id;
+            }
+        }
+        if ( best != GLIBC_NO_CHUNK ) {
+            return best;
+        }
+        ++bin;
+    } else if ( g->bins[bin] != GLIBC_NO_CHUNK ) {
+        return g->bins[bin];
+    } else {
+        ++bin;
+    }
+
+    /* any chunk of the greater bins fits */
+    for ( ; bin < GLIBC_BINS; bin = (bin | 63) + 1 ) {
+        uint64_t bits = g->nonempty[bin / 64] & (~0ull << (bin % 64));
+        if ( bits ) {
+            return g->bins[(bin & ~63u) + __builtin_ctzll(bits)];
+        }
+    }
+
+    return GLIBC_NO_CHUNK;
+}
+
+static void glibc_init(void **state) {
+    sim_glibc *g = calloc(1, sizeof(sim_glibc));
+
+    for ( uint32_t i = 0; i < GLIBC_BINS; ++i ) {
+        g->bins[i] = GLIBC_NO_CHUNK;
+    }
+    log_map_init(&g->starts, 1024);
+    log_map_init(&g->ends, 1024);
+    g->top = g->heap_end = GLIBC_HEAP_BASE;
+
+    *state = g;
+}
+
+static uint64_t glibc_alloc(void *state, sim_stats *st, uint64_t size) {
+    sim_glibc *g = state;
+    uint64_t need = (size + 8 + 15) & ~15ull;
+    need = need < GLIBC_MIN_CHUNK ? GLIBC_MIN_CHUNK : need;
+
+    if ( need >= GLIBC_MMAP_THRESHOLD ) {
+        uint64_t bytes = SIM_PAGE_ROUND(size + 16);
+        st->allocated += bytes;
+        st->committed += bytes;
+
+        return SIM_LARGE | bytes;
+    }
+
+    uint64_t off;
+    uint32_t id = glibc_fit(g, need);
+    if ( id != GLIBC_NO_CHUNK ) {
+        off = g->chunks[id].off;
+        uint64_t rest = g->chunks[id].size - need;
+        glibc_remove(g, id);
+        if ( rest >= GLIBC_MIN_CHUNK ) {
+            glibc_insert(g, off + need, rest);
+        } else {
+            need += rest;
+        }
+    } else {
+        off = g->top;
+        g->top += need;
+        if ( g->top > g->heap_end ) {
+            uint64_t end = SIM_PAGE_ROUND(g->top);
+            st->committed += end - g->heap_end;
+            g->heap_end = end;
+        }
+    }
+    st->allocated += need;
+
+    return off << 20 | need;
+}
+
+static void glibc_free(void *state, sim_stats *st, uint64_t handle) {
+    sim_glibc *g = state;
+
+    if ( handle & SIM_LARGE ) {
+        st->allocated -= handle & ~SIM_LARGE;
+        st->committed -= handle & ~SIM_LARGE;
+
+        return;
+    }
+
+    uint64_t off = handle >> 20, size = handle & ((1u << 20) - 1);
+    st->allocated -= size;
+
+    log_map_entry *e;
+    if ( (e = log_map_find(&g->ends, off)) ) {
+        uint32_t id = (uint32_t)e->val;
+        off = g->chunks[id].off;
+        size += g->chunks[id].size;
+        glibc_remove(g, id);
+    }
+    if ( off + size == g->top ) {
+        g->top = off;
+        if ( g->heap_end - g->top >= GLIBC_TRIM_THRESHOLD ) {
+            uint64_t end = SIM_PAGE_ROUND(g->top);
+            st->committed -= g->heap_end - end;
+            g->heap_end = end;
+        }
+
+        return;
+    }
+    if ( (e = log_map_find(&g->starts, off + size)) ) {
+        uint32_t id = (uint32_t)e->val;
+        size += g->chunks[id].size;
+        glibc_remove(g, id);
+    }
+    glibc_insert(g, off, size);
+}
+
+/*************************************************************************************************/
+
+static const sim_model_ops sim_models[] = {
+     {"glibc", glibc_init, glibc_alloc, glibc_free}
+    ,{"jemalloc", jemalloc_init, slabs_alloc, slabs_free}
+    ,{"slab", slab_init, slabs_alloc, slabs_free}
+};
+
+#define SIM_MODELS (sizeof(sim_models) / sizeof(sim_models[0]))
+
+static void sim_forget(sim_model *m, log_map_entry *b) {
+    m->ops->free(m->state, &m->st, b->val);
+    m->st.requested -= b->size;
+    log_map_remove(&m->blocks, b);
+}
+
+static void sim_alloc(sim_model *m, uint64_t ptr, uint64_t size) {
+    log_map_entry *b = log_map_find(&m->blocks, ptr);
+    if ( b ) {
+        /* the previous block at this address was freed outside of the trace */
+        sim_forget(m, b);
+    }
+    b = log_map_insert(&m->blocks, ptr);
+    b->val = m->ops->alloc(m->state, &m->st, size);
+    b->size = size;
+    m->st.requested += size;
+}
+
+static void sim_step(sim_model *m, const log_entry *e) {
+    log_map_entry *b;
+
+    if ( log_entry_is_alloc(e->type) ) {
+        if ( e->ptr ) {
+            sim_alloc(m, e->ptr, e->size);
+        }
+    } else if ( log_entry_is_free(e->type) ) {
+        if ( (b = log_map_find(&m->blocks, e->ptr)) ) {
+            sim_forget(m, b);
+        }
+    } else if ( e->type == LOG_ENTRY_REALLOC_INPLACE ) {
+        if ( (b = log_map_find(&m->blocks, e->ptr)) ) {
+            sim_forget(m, b);
+            sim_alloc(m, e->ptr, e->size);
+        }
+    } else if ( e->type == LOG_ENTRY_REALLOC_REALLOC ) {
+        if ( e->ptr && (b = log_map_find(&m->blocks, e->old_ptr)) ) {
+            sim_forget(m, b);
+            sim_alloc(m, e->ptr, e->size);
+        }
+    } else {
+        return;
+    }
+
+    sim_stats *st = &m->st;
+    if ( st->committed > st->peak_committed ) {
+        st->peak_committed = st->committed;
+        st->requested_at_peak = st->requested;
+        st->allocated_at_peak = st->allocated;
+    }
+    if ( st->requested > st->peak_requested ) {
+        st->peak_requested = st->requested;
+    }
+    if ( ++st->ops % footprint_every == 0 ) {
+        if ( st->nfootprint == st->footprint_cap ) {
+            st->footprint_cap = st->footprint_cap ? st->footprint_cap * 2 : 1024;
+            st->footprint = realloc(st->footprint, st->footprint_cap * sizeof(uint64_t));
+            st->footprint_ts = realloc(st->footprint_ts, st->footprint_cap * sizeof(uint64_t));
+        }
+        st->footprint[st->nfootprint] = st->committed;
+        st->footprint_ts[st->nfootprint++] = e->ts;
+    }
+}
+
+static void sim_consume(void *arg, const log_batch *batch) {
+    sim_model *m = arg;
+
+    for ( size_t i = 0; i < batch->nops; ++i ) {
+        const log_entry *e = &batch->ops[i].e;
+        uint32_t pid = __atomic_load_n(&sim_pid, __ATOMIC_RELAXED);
+        if ( !pid ) {
+            /* every model sees the same stream, so all of them pick the same first process */
+            __atomic_compare_exchange_n(&sim_pid, &pid, e->pid, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            pid = __atomic_load_n(&sim_pid, __ATOMIC_RELAXED);
+        }
+        if ( e->pid == pid ) {
+            sim_step(m, e);
+        }
+    }
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+static void report(sim_model *models) {
+    fprintf(stdout, "ops      : %" PRIu64 ", peak requested %" PRIu64 " bytes\n"
+        ,models[0].st.ops, models[0].st.peak_requested);
+    fprintf(stdout, "%-9s: %16s %16s %16s %9s %9s %16s\n"
+        ,"model", "peak committed", "allocated", "requested", "internal", "external", "final committed");
+    for ( size_t i = 0; i < SIM_MODELS; ++i ) {
+        const sim_stats *st = &models[i].st;
+        /* both fragmentations are taken at the peak of the committed memory */
+        fprintf(stdout, "%-9s: %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %8.2f%% %8.2f%% %16" PRIu64 "\n"
+            ,models[i].ops->name
+            ,st->peak_committed
+            ,st->allocated_at_peak
+            ,st->requested_at_peak
+            ,percent(st->allocated_at_peak - st->requested_at_peak, st->allocated_at_peak)
+            ,percent(st->peak_committed - st->allocated_at_peak, st->peak_committed)
+            ,st->committed
+        );
+    }
+
+    if ( !models[0].st.nfootprint ) {
+        return;
+    }
+    fprintf(stdout, "footprint:\n%16s %16s", "ops", "ns");
+    for ( size_t i = 0; i < SIM_MODELS; ++i ) {
+        fprintf(stdout, " %16s", models[i].ops->name);
+    }
+    fprintf(stdout, "\n");
+    for ( size_t n = 0; n < models[0].st.nfootprint; ++n ) {
+        fprintf(stdout, "%16" PRIu64 " %16" PRIu64
+            ,(n + 1) * footprint_every
+            ,models[0].st.footprint_ts[n] - models[0].st.footprint_ts[0]);
+        for ( size_t i = 0; i < SIM_MODELS; ++i ) {
+            fprintf(stdout, " %16" PRIu64, models[i].st.footprint[n]);
+        }
+        fprintf(stdout, "\n");
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "usage: malloc-stat-sim [-j workers] [-p pid] [-f ops] [trace.log | -]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned workers = cpus > 0 ? (unsigned)cpus : 1;
+    int opt;
+
+    footprint_every = UINT64_MAX;
+    while ( (opt = getopt(argc, argv, "j:p:f:")) != -1 ) {
+        switch ( opt ) {
+            case 'j': workers = (unsigned)strtoul(optarg, NULL, 10); break;
+            case 'p': sim_pid = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'f': footprint_every = strtoull(optarg, NULL, 10); break;
+            default: usage();
+        }
+    }
+    if ( optind + 1 < argc ) {
+        usage();
+    }
+    footprint_every = footprint_every ? footprint_every : UINT64_MAX;
+
+    int fd = STDIN_FILENO;
+    if ( optind < argc && strcmp(argv[optind], "-") != 0 && (fd = open(argv[optind], O_RDONLY)) == -1 ) {
+        fprintf(stderr, "malloc-stat-sim: can't open \"%s\"\n", argv[optind]);
+
+        return EXIT_FAILURE;
+    }
+
+    sim_model models[SIM_MODELS];
+    log_consumer_fn fns[SIM_MODELS];
+    void *args[SIM_MODELS];
+    for ( size_t i = 0; i < SIM_MODELS; ++i ) {
+        memset(&models[i], 0, sizeof(models[i]));
+        models[i].ops = &sim_models[i];
+        models[i].ops->init(&models[i].state);
+        log_map_init(&models[i].blocks, 1 << 16);
+        fns[i] = sim_consume;
+        args[i] = &models[i];
+    }
+
+    int err = log_stream_run(fd, workers, fns, args, SIM_MODELS);
+    if ( err ) {
+        fprintf(stderr, "malloc-stat-sim: read error: %s\n", strerror(err));
+
+        return EXIT_FAILURE;
+    }
+
+    report(models);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,199 @@
+/*
+ * This file is the part of malloc-stat project.
+ * Alloca/free library with backtrace for not freed areas and byte-exact memory tracking.
+ * Author: niXman, 2022 year
+ * https://github.com/niXman/malloc-stat
+ *
+ * reader of the log ring written by the `log_ring` option of malloc-stat.so.
+ * prints the finished segments in order to stdout starting from the oldest
+ * one still in the ring, so it can be piped into the other tools. the copy
+ * of the log header starting each segment is printed only once.
+ *
+ * usage: malloc-stat-tail [-f] [-i msec] ring
+ *   -f       follow the log until the process finalizes it or exits
+ *   -i msec  the polling interval of the follow mode, 100 by default
+ *   ring     the path given to `log_ring`, the segments are `ring.0` .. `ring.N`
+ */
+
+#include <malloc-stat/api.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+static malloc_stat_ring_header *segments[64];
+static uint64_t count = 0;
+static uint64_t size = 0;
+static uint64_t head_len = 0;
+
+static malloc_stat_ring_header *map_segment(const char *ring, uint64_t i) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%" PRIu64, ring, i);
+
+    int fd = open(path, O_RDONLY);
+    if ( fd == -1 ) {
+        fprintf(stderr, "malloc-stat-tail: can't open %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    malloc_stat_ring_header head;
+    if ( pread(fd, &head, sizeof(head), 0) != sizeof(head) || head.magic != MALLOC_STAT_RING_MAGIC ) {
+        fprintf(stderr, "malloc-stat-tail: %s is not a log ring segment\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if ( !count ) {
+        count = head.count;
+        size = head.size;
+        head_len = head.head;
+    }
+    if ( head.count != count || head.size != size || count > sizeof(segments) / sizeof(segments[0]) ) {
+        fprintf(stderr, "malloc-stat-tail: %s does not match the ring\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    void *p = mmap(NULL, MALLOC_STAT_RING_HEADER + size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( p == MAP_FAILED ) {
+        fprintf(stderr, "malloc-stat-tail: can't map %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return (malloc_stat_ring_header *)p;
+}
+
+/* the oldest segment still in the ring */
+static uint64_t oldest_segment(void) {
+    uint64_t res = MALLOC_STAT_RING_UNUSED;
+    for ( uint64_t i = 0; i < count; ++i ) {
+        uint64_t seq = __atomic_load_n(&segments[i]->seq, __ATOMIC_ACQUIRE);
+        if ( seq < res ) {
+            res = seq;
+        }
+    }
+
+    return res == MALLOC_STAT_RING_UNUSED ? 0 : res;
+}
+
+static void write_all(const char *buf, size_t len) {
+    while ( len ) {
+        ssize_t w = write(STDOUT_FILENO, buf, len);
+        if ( w == -1 && errno == EINTR ) {
+            continue;
+        }
+        if ( w <= 0 ) {
+            exit(EXIT_FAILURE);
+        }
+        buf += w;
+        len -= w;
+    }
+}
+
+/* copies the finished segment `seq`, returns -1 if it was overwritten meanwhile */
+static ssize_t copy_segment(malloc_stat_ring_header *h, uint64_t seq, char *buf) {
+    uint64_t begin = h->begin, end = h->end;
+    if ( end > size ) {
+        end = size;
+    }
+    if ( begin > end ) {
+        begin = end;
+    }
+    memcpy(buf, (const char *)h + MALLOC_STAT_RING_HEADER + begin, end - begin);
+
+    /* the writer reusing the slot marks it as writing before touching it */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if ( __atomic_load_n(&h->state, __ATOMIC_RELAXED) == MALLOC_STAT_RING_WRITING
+        || __atomic_load_n(&h->seq, __ATOMIC_RELAXED) != seq )
+    {
+        return -1;
+    }
+
+    return end - begin;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: malloc-stat-tail [-f] [-i msec] ring\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    int follow = 0;
+    unsigned interval = 100;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "fi:")) != -1 ) {
+        switch ( opt ) {
+            case 'f': follow = 1; break;
+            case 'i': interval = (unsigned)strtoul(optarg, NULL, 10); break;
+            default: usage();
+        }
+    }
+    if ( optind + 1 != argc ) {
+        usage();
+    }
+
+    segments[0] = map_segment(argv[optind], 0);
+    for ( uint64_t i = 1; i < count; ++i ) {
+        segments[i] = map_segment(argv[optind], i);
+    }
+
+    char *buf = malloc(size);
+    if ( !buf ) {
+        fprintf(stderr, "malloc-stat-tail: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    uint64_t next = oldest_segment();
+    uint64_t skip = 0;
+    for ( ;; ) {
+        malloc_stat_ring_header *h = segments[next % count];
+        uint64_t seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+        uint32_t state = __atomic_load_n(&h->state, __ATOMIC_ACQUIRE);
+
+        if ( seq == next && state != MALLOC_STAT_RING_WRITING ) {
+            /* retried if the slot is being reused meanwhile */
+            ssize_t len = copy_segment(h, seq, buf);
+            if ( len != -1 ) {
+                /* the header was printed with the first segment */
+                if ( (uint64_t)len < skip ) {
+                    skip = len;
+                }
+                write_all(buf + skip, len - skip);
+                skip = head_len;
+                if ( state == MALLOC_STAT_RING_LAST ) {
+                    break;
+                }
+                ++next;
+            }
+            continue;
+        }
+
+        if ( seq != MALLOC_STAT_RING_UNUSED && seq > next ) {
+            uint64_t oldest = oldest_segment();
+            fprintf(stderr, "malloc-stat-tail: segments %" PRIu64 "..%" PRIu64 " were overwritten\n"
+                ,next, oldest - 1);
+            next = oldest;
+            continue;
+        }
+
+        if ( !follow ) {
+            break;
+        }
+        if ( kill((pid_t)segments[0]->pid, 0) == -1 && errno == ESRCH ) {
+            fprintf(stderr, "malloc-stat-tail: the process %u exited without finishing the log\n"
+                ,segments[0]->pid);
+            return EXIT_FAILURE;
+        }
+        usleep(interval * 1000);
+    }
+
+    free(buf);
+
+    return EXIT_SUCCESS;
+}
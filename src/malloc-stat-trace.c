@@ -0,0 +1,333 @@
+/*
+ * This file is the part of malloc-stat project.
+ * Alloca/free library with backtrace for not freed areas and byte-exact memory tracking.
+ * Author: niXman, 2022 year
+ * https://github.com/niXman/malloc-stat
+ *
+ * converter of the log produced by malloc-stat.so into the Chrome trace
+ * event JSON, opened by chrome://tracing and https://ui.perfetto.dev.
+ * the events are written while the log is read, so the memory is bounded
+ * by the live blocks and the threads of the program.
+ *
+ * usage: malloc-stat-trace [-j workers] [-p pid] [-i usec] [-l bytes] [trace.log | -]
+ *   -j workers  parsing threads, the number of CPUs by default
+ *   -p pid      convert the process `pid` of the log, the first one by default
+ *   -i usec     the interval of the counter tracks, 1000 by default
+ *   -l bytes    the blocks of `bytes` and more are marked by an instant event, 1M by default
+ */
+
+#include "log-reader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define TRACE_PATH_MAX 4096
+
+typedef struct {
+    uint32_t tid;
+    uint64_t calls;  /* the allocations of the current interval */
+    uint64_t bytes;
+    int active;      /* the rate of the previous interval was not zero */
+} trace_thread;
+
+typedef struct {
+    uint32_t pid;
+    uint64_t interval;    /* nanoseconds */
+    uint64_t large;
+    uint64_t entries;
+    uint64_t in_use;
+    uint64_t events;      /* the events written, to put the separators */
+
+    /* the interval being accumulated, [begin, begin + interval) */
+    uint64_t begin;
+    int started;
+
+    log_map live;         /* address -> size */
+    log_map tids;         /* tid -> index of `threads` */
+    trace_thread *threads;
+    size_t nthreads;
+    size_t threads_cap;
+
+    int in_header;
+    char exe[TRACE_PATH_MAX];
+} trace_state;
+
+static trace_state state;
+
+/*************************************************************************************************/
+/* the events */
+
+static void event_begin(trace_state *s) {
+    fputs(s->events++ ? ",\n" : "[\n", stdout);
+}
+
+static void json_string(const char *str) {
+    fputc('"', stdout);
+    for ( const char *p = str; *p; ++p ) {
+        if ( *p == '"' || *p == '\\' ) {
+            fputc('\\', stdout);
+        }
+        if ( (unsigned char)*p >= 0x20 ) {
+            fputc(*p, stdout);
+        }
+    }
+    fputc('"', stdout);
+}
+
+/* the timestamps of the format are microseconds */
+static void json_ts(uint64_t ns) {
+    fprintf(stdout, "%" PRIu64 ".%03u", ns / 1000, (unsigned)(ns % 1000));
+}
+
+static void process_name(trace_state *s) {
+    event_begin(s);
+    fprintf(stdout, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":", s->pid);
+    json_string(s->exe[0] ? s->exe : "?");
+    fputs("}}", stdout);
+}
+
+static void counter(trace_state *s, uint64_t ns, const char *name, uint32_t tid, const char *arg, uint64_t val) {
+    event_begin(s);
+    fputs("{\"name\":\"", stdout);
+    fputs(name, stdout);
+    if ( tid ) {
+        fprintf(stdout, " tid %u", tid);
+    }
+    fprintf(stdout, "\",\"ph\":\"C\",\"pid\":%u,\"ts\":", s->pid);
+    json_ts(ns);
+    fprintf(stdout, ",\"args\":{\"%s\":%" PRIu64 "}}", arg, val);
+}
+
+static void instant(trace_state *s, const log_op *op, const char *name) {
+    event_begin(s);
+    fprintf(stdout, "{\"name\":\"%s\",\"cat\":\"large\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%u,\"tid\":%u,\"ts\":"
+        ,name, s->pid, op->e.tid);
+    json_ts(op->e.ts);
+    fprintf(stdout, ",\"args\":{\"size\":%" PRIu64 ",\"ptr\":\"0x%" PRIx64 "\"", op->e.size, op->e.ptr);
+    if ( op->site ) {
+        fprintf(stdout, ",\"site\":\"0x%" PRIx64 "\"", op->site);
+    }
+    fputs("}}", stdout);
+}
+
+/* writes the counters of the interval and starts the one holding `ns` */
+static void interval_flush(trace_state *s, uint64_t ns) {
+    uint64_t end = s->begin + s->interval;
+
+    counter(s, end, "in_use", 0, "bytes", s->in_use);
+    for ( size_t i = 0; i < s->nthreads; ++i ) {
+        trace_thread *t = &s->threads[i];
+        if ( !t->calls && !t->active ) {
+            continue;
+        }
+        /* the rate of the interval is shown from its beginning, the zero closes a burst */
+        counter(s, s->begin, "alloc bytes/s", t->tid, "bytes", t->bytes * 1000000000ull / s->interval);
+        counter(s, s->begin, "alloc calls/s", t->tid, "calls", t->calls * 1000000000ull / s->interval);
+        t->active = t->calls != 0;
+        t->calls = t->bytes = 0;
+    }
+
+    s->begin = end;
+    if ( ns >= end + s->interval ) {
+        /* an idle gap, the zeros of the closed bursts are written at its beginning */
+        for ( size_t i = 0; i < s->nthreads; ++i ) {
+            trace_thread *t = &s->threads[i];
+            if ( t->active ) {
+                counter(s, end, "alloc bytes/s", t->tid, "bytes", 0);
+                counter(s, end, "alloc calls/s", t->tid, "calls", 0);
+                t->active = 0;
+            }
+        }
+        s->begin = ns - ns % s->interval;
+    }
+}
+
+static trace_thread* thread_find(trace_state *s, uint32_t tid) {
+    /* the key is shifted as the map hashes the addresses without the low bits */
+    log_map_entry *m = log_map_insert(&s->tids, ((uint64_t)tid + 1) << 4);
+    if ( !m->size ) {
+        if ( s->nthreads == s->threads_cap ) {
+            s->threads_cap = s->threads_cap ? s->threads_cap * 2 : 64;
+            s->threads = realloc(s->threads, s->threads_cap * sizeof(trace_thread));
+        }
+        m->val = s->nthreads++;
+        m->size = 1;
+        memset(&s->threads[m->val], 0, sizeof(trace_thread));
+        s->threads[m->val].tid = tid;
+    }
+
+    return &s->threads[m->val];
+}
+
+static void block_alloc(trace_state *s, const log_op *op, const char *name) {
+    log_map_entry *b = log_map_find(&s->live, op->e.ptr);
+    if ( b ) {
+        /* the previous block at this address was freed outside of the log */
+        s->in_use -= b->size;
+    }
+    b = log_map_insert(&s->live, op->e.ptr);
+    b->size = op->e.size;
+    s->in_use += op->e.size;
+
+    trace_thread *t = thread_find(s, op->e.tid);
+    t->calls++;
+    t->bytes += op->e.size;
+
+    if ( op->e.size >= s->large ) {
+        instant(s, op, name);
+    }
+}
+
+static void block_free(trace_state *s, const log_op *op, uint64_t ptr, const char *name) {
+    log_map_entry *b = log_map_find(&s->live, ptr);
+    if ( !b ) {
+        return; /* allocated before the log was opened */
+    }
+    if ( name && b->size >= s->large ) {
+        log_op freed = *op;
+        freed.e.size = b->size;
+        instant(s, &freed, name);
+    }
+    s->in_use -= b->size;
+    log_map_remove(&s->live, b);
+}
+
+static void trace_consume(void *arg, const log_batch *batch) {
+    trace_state *s = arg;
+
+    if ( s->in_header ) {
+        const char *p = batch->text, *end = batch->text + batch->len;
+        while ( p < end && *p != '+' ) {
+            const char *eol = memchr(p, '\n', end - p);
+            eol = eol ? eol : end;
+            size_t len = (size_t)(eol - p);
+            if ( len > 6 && memcmp(p, "# EXE ", 6) == 0 ) {
+                len = len - 6 < sizeof(s->exe) - 1 ? len - 6 : sizeof(s->exe) - 1;
+                memcpy(s->exe, p + 6, len);
+                s->exe[len] = 0;
+            }
+            p = eol + 1;
+        }
+        s->in_header = p >= end;
+    }
+
+    for ( size_t i = 0; i < batch->nops; ++i ) {
+        log_op op = batch->ops[i];
+        log_entry *e = &op.e;
+
+        /* `+ INIT` and `+ FINI` have no pid */
+        if ( e->type == LOG_ENTRY_INIT || e->type == LOG_ENTRY_FINI || e->type == LOG_ENTRY_OTHER ) {
+            continue;
+        }
+        if ( !s->pid ) {
+            s->pid = e->pid;
+        }
+        if ( e->pid != s->pid ) {
+            continue;
+        }
+        /* without `log_format=timed` the entry number is the time in microseconds */
+        if ( !e->ts ) {
+            e->ts = s->entries * 1000;
+        }
+        s->entries++;
+
+        if ( !s->started ) {
+            process_name(s);
+            s->begin = e->ts - e->ts % s->interval;
+            s->started = 1;
+        }
+        while ( e->ts >= s->begin + s->interval ) {
+            interval_flush(s, e->ts);
+        }
+
+        switch ( e->type ) {
+            case LOG_ENTRY_MALLOC: block_alloc(s, &op, "malloc"); break;
+            case LOG_ENTRY_CALLOC: block_alloc(s, &op, "calloc"); break;
+            case LOG_ENTRY_MEMALIGN: block_alloc(s, &op, "memalign"); break;
+            case LOG_ENTRY_POSIX_MEMALIGN: block_alloc(s, &op, "posix_memalign"); break;
+            case LOG_ENTRY_VALLOC: block_alloc(s, &op, "valloc"); break;
+            case LOG_ENTRY_PVALLOC: block_alloc(s, &op, "pvalloc"); break;
+            case LOG_ENTRY_ALIGNED_ALLOC: block_alloc(s, &op, "aligned_alloc"); break;
+            case LOG_ENTRY_REALLOC_ALLOC: block_alloc(s, &op, "realloc"); break;
+            case LOG_ENTRY_FREE: block_free(s, &op, e->ptr, "free"); break;
+            case LOG_ENTRY_REALLOC_FREE: block_free(s, &op, e->ptr, "realloc-free"); break;
+            case LOG_ENTRY_REALLOC_INPLACE:
+            case LOG_ENTRY_REALLOC_REALLOC:
+                if ( e->ptr ) {
+                    block_free(s, &op, e->type == LOG_ENTRY_REALLOC_INPLACE ? e->ptr : e->old_ptr, NULL);
+                    block_alloc(s, &op, "realloc");
+                }
+                break;
+            default: break;
+        }
+    }
+
+    fflush(stdout);
+}
+
+/*************************************************************************************************/
+
+static void usage() {
+    fprintf(stderr, "usage: malloc-stat-trace [-j workers] [-p pid] [-i usec] [-l bytes] [trace.log | -]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned workers = cpus > 0 ? (unsigned)cpus : 1;
+    int opt;
+
+    state.interval = 1000000;
+    state.large = 1 << 20;
+    while ( (opt = getopt(argc, argv, "j:p:i:l:")) != -1 ) {
+        switch ( opt ) {
+            case 'j': workers = (unsigned)strtoul(optarg, NULL, 10); break;
+            case 'p': state.pid = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'i': state.interval = strtoull(optarg, NULL, 10) * 1000; break;
+            case 'l': state.large = strtoull(optarg, NULL, 10); break;
+            default: usage();
+        }
+    }
+    if ( optind + 1 < argc || !state.interval ) {
+        usage();
+    }
+
+    int fd = STDIN_FILENO;
+    if ( optind < argc && strcmp(argv[optind], "-") != 0 ) {
+        fd = open(argv[optind], O_RDONLY);
+    }
+    if ( fd == -1 ) {
+        fprintf(stderr, "malloc-stat-trace: can't open the log\n");
+
+        return EXIT_FAILURE;
+    }
+
+    state.in_header = 1;
+    log_map_init(&state.live, 1 << 16);
+    log_map_init(&state.tids, 64);
+
+    log_consumer_fn fn = trace_consume;
+    void *arg = &state;
+    int err = log_stream_run(fd, workers, &fn, &arg, 1);
+    if ( err ) {
+        fprintf(stderr, "malloc-stat-trace: read error: %s\n", strerror(err));
+    }
+
+    if ( state.started ) {
+        /* closes the last interval and the bursts still open */
+        interval_flush(&state, state.begin + state.interval);
+        interval_flush(&state, state.begin + state.interval);
+    }
+    fputs(state.events ? "\n]\n" : "[]\n", stdout);
+
+    free(state.threads);
+    log_map_free(&state.tids);
+    log_map_free(&state.live);
+
+    return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,146 @@
+/*
+ * This file is the part of malloc-stat project.
+ * Alloca/free library with backtrace for not freed areas and byte-exact memory tracking.
+ * Author: niXman, 2022 year
+ * https://github.com/niXman/malloc-stat
+ *
+ * reader of the shared counters published by the `shm` option of malloc-stat.so.
+ * prints the counters of each process of the tree and their total, e.g. of
+ * the workers of a pre-fork server.
+ *
+ * usage: malloc-stat-workers [-a] [-i msec] name
+ *   -a       print the exited processes too, they are not in the total
+ *   -i msec  print the counters every msec until interrupted
+ *   name     the name given to `shm`, e.g. /myserver
+ */
+
+#include <malloc-stat/api.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+/* copies the slot, retried while it is being written */
+static void read_worker(const malloc_stat_shm_worker *w, malloc_stat_shm_worker *out) {
+    for ( ;; ) {
+        uint32_t seq = __atomic_load_n(&w->seq, __ATOMIC_ACQUIRE);
+        if ( seq & 1 ) {
+            continue;
+        }
+        memcpy(out, w, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ( __atomic_load_n(&w->seq, __ATOMIC_RELAXED) == seq ) {
+            return;
+        }
+    }
+}
+
+static const char *state_name(const malloc_stat_shm_worker *w) {
+    if ( w->state == MALLOC_STAT_SHM_EXITED ) {
+        return "exited";
+    }
+    /* the process killed before it finalized the counters */
+    if ( kill((pid_t)w->pid, 0) == -1 && errno == ESRCH ) {
+        return "gone";
+    }
+
+    return "running";
+}
+
+static void print_row(const char *pid, const char *ppid, const char *state, const malloc_stat_vars *v) {
+    printf("%8s %8s %-8s %14" PRIu64 " %14" PRIu64 " %14" PRIu64 " %14" PRIu64 " %14" PRIu64 "\n"
+        ,pid, ppid, state, v->allocations, v->deallocations, v->allocated, v->in_use, v->peak_in_use);
+}
+
+static void print_workers(const malloc_stat_shm *area, int all) {
+    malloc_stat_vars total = {0};
+    char pid[16], ppid[16];
+
+    printf("%8s %8s %-8s %14s %14s %14s %14s %14s\n"
+        ,"pid", "ppid", "state", "allocs", "deallocs", "allocated", "in_use", "peak");
+    for ( uint32_t i = 0; i < MALLOC_STAT_SHM_WORKERS; ++i ) {
+        malloc_stat_shm_worker w;
+        read_worker(&area->worker[i], &w);
+        if ( !w.pid ) {
+            continue;
+        }
+
+        const char *state = state_name(&w);
+        bool running = !strcmp(state, "running");
+        if ( !running && !all ) {
+            continue;
+        }
+        snprintf(pid, sizeof(pid), "%u", w.pid);
+        snprintf(ppid, sizeof(ppid), "%u", w.ppid);
+        print_row(pid, ppid, state, &w.stat);
+
+        if ( running ) {
+            total.allocations += w.stat.allocations;
+            total.deallocations += w.stat.deallocations;
+            total.allocated += w.stat.allocated;
+            total.in_use += w.stat.in_use;
+            total.peak_in_use += w.stat.peak_in_use;
+        }
+    }
+    print_row("total", "", "", &total);
+}
+
+static void usage() {
+    fprintf(stderr, "usage: malloc-stat-workers [-a] [-i msec] name\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    int all = 0;
+    unsigned interval = 0;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "ai:")) != -1 ) {
+        switch ( opt ) {
+            case 'a': all = 1; break;
+            case 'i': interval = (unsigned)strtoul(optarg, NULL, 10); break;
+            default: usage();
+        }
+    }
+    if ( optind + 1 != argc ) {
+        usage();
+    }
+
+    int fd = shm_open(argv[optind], O_RDONLY, 0);
+    if ( fd == -1 ) {
+        fprintf(stderr, "malloc-stat-workers: can't open %s: %s\n", argv[optind], strerror(errno));
+        return EXIT_FAILURE;
+    }
+    void *p = mmap(NULL, sizeof(malloc_stat_shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( p == MAP_FAILED ) {
+        fprintf(stderr, "malloc-stat-workers: can't map %s: %s\n", argv[optind], strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    const malloc_stat_shm *area = (const malloc_stat_shm *)p;
+    if ( __atomic_load_n(&area->magic, __ATOMIC_ACQUIRE) != MALLOC_STAT_SHM_MAGIC ) {
+        fprintf(stderr, "malloc-stat-workers: %s is not the shared counters\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    for ( ;; ) {
+        print_workers(area, all);
+        if ( !interval ) {
+            break;
+        }
+        fflush(stdout);
+        usleep(interval * 1000);
+        printf("\n");
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -60,8 +60,10 @@
 #endif
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -69,6 +71,19 @@
 #include <errno.h>
 #include <malloc.h>
 #include <dlfcn.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <execinfo.h>
+#include <link.h>
 
 #include <malloc-stat/api.h>
 
@@ -77,6 +92,68 @@
 #define LOG_BUFSIZE 4096
 /** FD where output is written to. */
 #define LOG_MALLOC_TRACE_FD 1022
+/** Default number of slots in the table of sampled live blocks. Must be a power of two. */
+#define MALLOC_STAT_BLOCKS_SIZE (1u << 18)
+/** Default number of slots in the table of allocation sites. Must be a power of two. */
+#define MALLOC_STAT_SITES_SIZE 4096
+/** Environment variable holding the runtime options. */
+#define MALLOC_STAT_OPTIONS_ENV "MALLOC_STAT_OPTIONS"
+/** How many slots are probed in the tables before giving up. */
+#define MALLOC_STAT_PROBE_LIMIT 32
+/** Blocks freed on the allocating thread within this many nanoseconds are short-lived. */
+#define MALLOC_STAT_CHURN_WINDOW_NS 10000
+/** ...or within this many allocations made by that thread (0 means unused). */
+#define MALLOC_STAT_CHURN_WINDOW_EVENTS 0
+/** Cache line size used to detect the false sharing. */
+#define MALLOC_STAT_CACHE_LINE 64
+/** The blocks of this many bytes and more are scanned for the resident pages by default. */
+#define MALLOC_STAT_RESIDENT_MIN (1024 * 1024)
+/** Number of the sites with the most untouched bytes kept by the resident scan. */
+#define MALLOC_STAT_RESIDENT_SITES 32
+/** Size of the table of the threads aggregated by the NUMA placement scan. Must be a power of two. */
+#define MALLOC_STAT_NUMA_THREADS 1024
+/** Number of the threads and of the sites with the most remote bytes written by the report. */
+#define MALLOC_STAT_NUMA_REPORT 32
+/** Default milliseconds between the samples of the live bytes per site taken by the leak trend collector. */
+#define MALLOC_STAT_LEAK_INTERVAL_MS 10000
+/** Number of the last samples of a site the leak trend is computed over. */
+#define MALLOC_STAT_LEAK_WINDOW 32
+/** Number of the growing sites kept by the leak trend collector. */
+#define MALLOC_STAT_LEAK_SITES 32
+/** Maximum number of the memory budgets watched at once. */
+#define MALLOC_STAT_BUDGETS 16
+/** Default milliseconds between the checks of the memory budgets. */
+#define MALLOC_STAT_BUDGET_INTERVAL_MS 100
+/** Default milliseconds between the publications of the counters into the shared memory. */
+#define MALLOC_STAT_SHM_INTERVAL_MS 1000
+/** Maximum bytes of the metrics served by the endpoint. */
+#define MALLOC_STAT_METRICS_BUFSIZE (64 * 1024)
+/** Maximum number of the sites returned by a getter of the top sites, a larger `max` is capped. */
+#define MALLOC_STAT_TOP_SITES 256
+/** Number of the top allocation sites exported by the metrics. */
+#define MALLOC_STAT_METRICS_SITES 10
+/** Default bytes of the data of a log ring segment. */
+#define MALLOC_STAT_RING_SIZE (16 * 1024 * 1024)
+/** Default number of the log ring segment files. */
+#define MALLOC_STAT_RING_SEGMENTS 4
+/** Maximum number of the log ring segment files. */
+#define MALLOC_STAT_RING_MAX_SEGMENTS 64
+/** Number of the shards of the latency histograms, the threads are spread over them. */
+#define MALLOC_STAT_LATENCY_SHARDS 16
+/** Number of the slowest calls kept by the slow calls tracer. */
+#define MALLOC_STAT_SLOW_CALLS 64
+/** Maximum number of the modules accounted separately, the rest is accounted as unknown. */
+#define MALLOC_STAT_MODULES 256
+/** Default number of slots in the table of the live blocks of the per module accounting. Must be a power of two. */
+#define MALLOC_STAT_MODULE_BLOCKS (1u << 20)
+/** Number of the frames looked through for the caller of a C/C++ runtime library. */
+#define MALLOC_STAT_MODULE_FRAMES 8
+/** Number of the modules with the most bytes in use written by the report. */
+#define MALLOC_STAT_MODULES_REPORT 32
+/** Maximum number of the modules whose symbols are loaded by the symbolizer. */
+#define MALLOC_STAT_SYMBOL_MODULES 128
+/** Number of the resolved addresses cached by the symbolizer. Must be a power of two. */
+#define MALLOC_STAT_SYMBOL_CACHE 4096
 
 /* init constants */
 #define LOG_MALLOC_INIT_NULL    0xFAB321
@@ -94,6 +171,8 @@ static int   (*real_posix_memalign)(void **memptr, size_t alignment, size_t size
 static void *(*real_valloc)(size_t size) = NULL;
 static void *(*real_pvalloc)(size_t size) = NULL;
 static void *(*real_aligned_alloc)(size_t alignment, size_t size) = NULL;
+static void *(*real_dlopen)(const char *file, int mode) = NULL;
+static int   (*real_dlclose)(void *handle) = NULL;
 
 /* DL resolving */
 #define DL_RESOLVE(fn) \
@@ -105,40 +184,118 @@ static void *(*real_aligned_alloc)(size_t alignment, size_t size) = NULL;
 /* Flag that stores initialization state */
 static sig_atomic_t init_done = LOG_MALLOC_INIT_NULL;
 
+/* in the passthrough mode all the calls are forwarded to the real functions
+ * as is, without any accounting. it's set only after the real functions
+ * are resolved.
+ */
+static volatile sig_atomic_t passthrough = 0;
+
+/* the same for the calls of the own threads of the library only.
+ * the library is always preloaded, so the static TLS is available.
+ */
+static __thread int thread_passthrough __attribute__((tls_model("initial-exec"))) = 0;
+
+#define MALLOC_STAT_PASSTHROUGH(call) \
+    if ( passthrough || thread_passthrough ) { \
+        return call; \
+    }
+
 /* output is disabled because the lineno does not exist */
 static int memlog_enabled = false;
 
 /* log output fd */
 static int memlog_fd = LOG_MALLOC_TRACE_FD;
 
+/* the file set by the `log_path` option */
+static char log_path[256];
+
+/* memlog_fd routing the log into the mmap-ed ring set up by the `log_ring` option */
+#define MALLOC_STAT_RING_FD (-2)
+/* the fd collecting the log header copied at the start of each ring segment */
+#define MALLOC_STAT_RING_HEAD_FD (-3)
+
+/* log entries format */
+#define MALLOC_STAT_LOG_TEXT  0 /* + method size ptr pid tid */
+#define MALLOC_STAT_LOG_TIMED 1 /* + method size ptr pid tid ns */
+static int memlog_format = MALLOC_STAT_LOG_TEXT;
+
+/* frames of the backtrace written after each log entry, 0 for none */
+static int backtrace_depth = 0;
+
 /* On this thread we are currently writing a trace event so prevent self-recursion */
 static __thread int in_trace = 0;
 
-#define MALLOC_STAT_TRACE(caption, ptr, size) { \
+/* the process and the thread ids are cached to avoid the syscalls,
+ * both are reset in the child after fork()
+ */
+static pid_t process_pid = 0;
+static __thread pid_t thread_tid = 0;
+
+static inline pid_t process_id(void) {
+    if ( !process_pid ) {
+        process_pid = getpid();
+    }
+
+    return process_pid;
+}
+
+static inline pid_t thread_id(void) {
+    if ( !thread_tid ) {
+        thread_tid = gettid();
+    }
+
+    return thread_tid;
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+#define MALLOC_STAT_TRACE(caption, ptr, size) \
+    MALLOC_STAT_TRACE_MOVE(caption, ptr, size, NULL)
+
+/* `old` is the previous address of the block moved by realloc() */
+#define MALLOC_STAT_TRACE_MOVE(caption, ptr, size, old) { \
     if ( !in_trace ) { \
         in_trace = 1; \
-        log_mem(caption, ptr, size); \
+        log_mem(caption, ptr, size, old); \
         in_trace = 0; \
     } \
 }
 
 #define MALLOC_STAT_WRITE_LOG(ptr, size) \
-    (memlog_enabled ? write(memlog_fd, buf, size) : 0)
+    (memlog_enabled ? log_write(memlog_fd, buf, size) : 0)
 
-static inline void log_mem(const char *method, void *ptr, size_t size) {
+static ssize_t log_write(int fd, const void *buf, size_t len);
+static int log_backtrace(char *buf, size_t size);
+
+static inline void log_mem(const char *method, void *ptr, size_t size, void *old) {
     /* Prevent preparing the output in memory in case the output is already closed */
     if ( memlog_enabled ) {
         char buf[LOG_BUFSIZE];
         int len = snprintf(
              buf
             ,sizeof(buf)
-            ,"+ %s %zu %p %d %d\n"
+            ,"+ %s %zu %p %d %d"
             ,method
             ,size
             ,ptr
-            ,getpid()
-            ,gettid()
+            ,process_id()
+            ,thread_id()
         );
+        if ( old ) {
+            len += snprintf(buf + len, sizeof(buf) - len, " %p", old);
+        }
+        if ( memlog_format == MALLOC_STAT_LOG_TIMED ) {
+            len += snprintf(buf + len, sizeof(buf) - len, " %" PRIu64, now_ns());
+        }
+        buf[len++] = '\n';
+        if ( backtrace_depth ) {
+            len += log_backtrace(buf + len, sizeof(buf) - len);
+        }
         MALLOC_STAT_WRITE_LOG(buf, len);
     }
 
@@ -155,185 +312,5370 @@ int myStrlen(const char * str) {
     for ( ; *str; ++str, ++ret )
     {}
 
-    return ret;
+    return ret;
+}
+
+/**
+ * Copy data from file to the log.
+ */
+static inline void copyfile(const char *head, const char *path, int outfd) {
+    int fd = -1;
+    char buf[BUFSIZ];
+    ssize_t len = 0;
+    size_t head_len = myStrlen(head);
+    // no warning here, it will be simply missing in log
+    if ( (fd = open(path, 0)) == -1 ) {
+        return;
+    }
+
+    log_write(outfd, head, head_len);
+    // ignoring EINTR here, use SA_RESTART to fix if problem
+    while ( (len = read(fd, buf, sizeof(buf))) > 0 ) {
+        log_write(outfd, buf, len);
+    }
+    close(fd);
+
+    return;
+}
+
+/* During initialization while the real_* pointer are being set up we can not pass malloc calls to the real
+ * malloc.
+ * During this time malloc calls allocate memory in this area.
+ * After initialization is done this buffer is no longer used.
+ */
+#define STATIC_SIZE 1024
+static char static_buffer[STATIC_SIZE];
+static int static_pointer = 0;
+
+/* stat variables */
+static uint64_t total_allocations = 0;
+static uint64_t total_deallocations = 0;
+// static uint64_t simult_allocations = 0; // WIP
+// static uint64_t peak_allocations = 0;
+
+static uint64_t total_allocated = 0;
+static uint64_t total_deallocated = 0;
+static uint64_t total_requested = 0;
+/* a free of a block allocated before the accounting was turned on
+ * (passthrough, reset, the parent of fork=reset) takes it below zero, it's
+ * rebased at zero then so the later allocations are counted. a concurrent
+ * call can still see it negative, so it's read by in_use_bytes() */
+static int64_t simult_in_use = 0;
+static int64_t peak_in_use = 0;
+
+/* the enabled collectors, see the collectors part */
+static uint32_t collectors = 0;
+
+/* the size class histogram of the usable sizes, see size_class(),
+ * counted while MALLOC_STAT_COLLECT_CLASSES is enabled */
+static uint64_t class_allocations[MALLOC_STAT_SIZE_CLASSES];
+static uint64_t class_deallocations[MALLOC_STAT_SIZE_CLASSES];
+static uint64_t class_requested[MALLOC_STAT_SIZE_CLASSES];
+static uint64_t class_usable[MALLOC_STAT_SIZE_CLASSES];
+
+static inline uint32_t size_class(uint64_t size);
+
+/* helpers */
+#ifndef MALLOC_STAT_ATOMICS_DISABLED
+#   define MALLOC_STAT_ATOMIC_LOAD(var) \
+        __atomic_load_n(&var, __ATOMIC_SEQ_CST)
+
+#   define MALLOC_STAT_ATOMIC_STORE(var, val) \
+        __atomic_store_n(&var, val, __ATOMIC_RELAXED)
+
+#   define MALLOC_STAT_INC_ALLOCATIONS() \
+        __atomic_add_fetch(&total_allocations, 1, __ATOMIC_RELAXED)
+
+#   define MALLOC_STAT_INC_DEALLOCATIONS() \
+        __atomic_add_fetch(&total_deallocations, 1, __ATOMIC_RELAXED)
+
+#   define MALLOC_STAT_ADD_ALLOCATED(size, requested) { \
+        __atomic_add_fetch(&total_allocated, size, __ATOMIC_RELAXED); \
+        __atomic_add_fetch(&total_requested, requested, __ATOMIC_RELAXED); \
+        if ( collectors & MALLOC_STAT_COLLECT_CLASSES ) { \
+            uint32_t cls = size_class(size); \
+            __atomic_add_fetch(&class_allocations[cls], 1, __ATOMIC_RELAXED); \
+            __atomic_add_fetch(&class_requested[cls], requested, __ATOMIC_RELAXED); \
+            __atomic_add_fetch(&class_usable[cls], size, __ATOMIC_RELAXED); \
+        } \
+    }
+
+#   define MALLOC_STAT_ADD_DEALLOCATED(size) { \
+        __atomic_add_fetch(&total_deallocated, size, __ATOMIC_RELAXED); \
+        if ( collectors & MALLOC_STAT_COLLECT_CLASSES ) { \
+            __atomic_add_fetch(&class_deallocations[size_class(size)], 1, __ATOMIC_RELAXED); \
+        } \
+    }
+
+#   define MALLOC_STAT_ADD_IN_USE(size) \
+        __atomic_add_fetch(&simult_in_use, (int64_t)(size), __ATOMIC_RELAXED)
+
+#   define MALLOC_STAT_SUB_IN_USE(size) { \
+        int64_t in_use = __atomic_sub_fetch(&simult_in_use, (int64_t)(size), __ATOMIC_RELAXED); \
+        while ( in_use < 0 && !__atomic_compare_exchange_n(&simult_in_use, &in_use, 0 \
+            ,false, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) \
+        {} \
+    }
+
+#   define MALLOC_STAT_UPDATE_PEAK() \
+        for ( int64_t peak = __atomic_load_n(&peak_in_use, __ATOMIC_SEQ_CST) \
+             ,in_use = __atomic_load_n(&simult_in_use, __ATOMIC_SEQ_CST) \
+            ; \
+              peak < in_use \
+            ; \
+              peak = __atomic_load_n(&peak_in_use, __ATOMIC_SEQ_CST) \
+             ,in_use = __atomic_load_n(&simult_in_use, __ATOMIC_SEQ_CST) \
+        ) { \
+            if ( __atomic_compare_exchange_n( \
+                 &peak_in_use \
+                ,&peak \
+                ,in_use \
+                ,false \
+                ,__ATOMIC_SEQ_CST \
+                ,__ATOMIC_RELAXED \
+            ) ) { \
+                break; \
+            }\
+        }
+#else // MALLOC_STAT_ATOMICS_DISABLED
+#   define MALLOC_STAT_ATOMIC_LOAD(var) \
+        var
+
+#   define MALLOC_STAT_ATOMIC_STORE(var, val) \
+        var = val
+
+#   define MALLOC_STAT_INC_ALLOCATIONS() \
+        total_allocations += 1
+
+#   define MALLOC_STAT_INC_DEALLOCATIONS() \
+        total_deallocations += 1
+
+#   define MALLOC_STAT_ADD_ALLOCATED(size, requested) { \
+        total_allocated += size; \
+        total_requested += requested; \
+        if ( collectors & MALLOC_STAT_COLLECT_CLASSES ) { \
+            uint32_t cls = size_class(size); \
+            class_allocations[cls] += 1; \
+            class_requested[cls] += requested; \
+            class_usable[cls] += size; \
+        } \
+    }
+
+#   define MALLOC_STAT_ADD_DEALLOCATED(size) { \
+        total_deallocated += size; \
+        if ( collectors & MALLOC_STAT_COLLECT_CLASSES ) { \
+            class_deallocations[size_class(size)] += 1; \
+        } \
+    }
+
+#   define MALLOC_STAT_ADD_IN_USE(size) \
+        simult_in_use += (int64_t)(size)
+
+#   define MALLOC_STAT_SUB_IN_USE(size) { \
+        simult_in_use -= (int64_t)(size); \
+        if ( simult_in_use < 0 ) { \
+            simult_in_use = 0; \
+        } \
+    }
+
+#   define MALLOC_STAT_UPDATE_PEAK() \
+        peak_in_use = (peak_in_use < simult_in_use) \
+            ? simult_in_use \
+            : peak_in_use
+
+#endif // MALLOC_STAT_ATOMICS_DISABLED
+
+static inline uint64_t in_use_bytes(int64_t val) {
+    return val > 0 ? (uint64_t)val : 0;
+}
+
+/* backtrace part
+ */
+
+#define MALLOC_STAT_BACKTRACE_SIZE 20
+
+typedef struct {
+    int nptrs;
+    void* ptrs[MALLOC_STAT_BACKTRACE_SIZE + 1];
+} backtrace_stack;
+
+/* the address range of this library, its frames are skipped in the backtraces */
+static uintptr_t self_begin = 0;
+static uintptr_t self_end = 0;
+
+/* the address range spanned by the loaded segments of the module */
+static void phdr_range(const struct dl_phdr_info *info, uintptr_t *begin, uintptr_t *end) {
+    *begin = UINTPTR_MAX;
+    *end = 0;
+
+    for ( int i = 0; i < info->dlpi_phnum; ++i ) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        if ( ph->p_type != PT_LOAD ) {
+            continue;
+        }
+
+        uintptr_t b = info->dlpi_addr + ph->p_vaddr;
+        if ( b < *begin ) {
+            *begin = b;
+        }
+        if ( b + ph->p_memsz > *end ) {
+            *end = b + ph->p_memsz;
+        }
+    }
+}
+
+static int self_range_cb(struct dl_phdr_info *info, size_t size, void *data) {
+    (void)size;
+    uintptr_t addr = (uintptr_t)data;
+    uintptr_t begin, end;
+
+    phdr_range(info, &begin, &end);
+    if ( addr < begin || addr >= end ) {
+        return 0;
+    }
+
+    self_begin = begin;
+    self_end = end;
+
+    return 1;
+}
+
+static void self_range_init(void) {
+    dl_iterate_phdr(self_range_cb, (void *)&self_range_init);
+}
+
+/* fills up to `depth` frames of the caller, the frames of this library are skipped */
+static int backtrace_capture(void **out, int depth) {
+    void *frames[MALLOC_STAT_BACKTRACE_SIZE + 8];
+    int nptrs = backtrace(frames, depth + 8);
+    int num = 0, i = 0;
+
+    for ( ; i < nptrs && (uintptr_t)frames[i] >= self_begin && (uintptr_t)frames[i] < self_end; ++i )
+    {}
+    for ( ; i < nptrs && num < depth; ++i ) {
+        out[num++] = frames[i];
+    }
+
+    return num;
+}
+
+/* writes the frames of the caller one per line and the closing `-` line */
+static int log_backtrace(char *buf, size_t size) {
+    void *frames[MALLOC_STAT_BACKTRACE_SIZE];
+    int nptrs = backtrace_capture(frames, backtrace_depth);
+    int len = 0;
+
+    for ( int i = 0; i < nptrs; ++i ) {
+        len += snprintf(buf + len, size - len, "%p\n", frames[i]);
+    }
+    len += snprintf(buf + len, size - len, "-\n");
+
+    return len;
+}
+
+/* symbolizer part
+ *
+ * with the `symbolize` option the addresses written by the reports are
+ * resolved in-process, never on the allocation path. the module holding
+ * an address is found by dl_iterate_phdr(), its file is mmap()ed and the
+ * functions of .symtab (.dynsym of a stripped one) are sorted by the
+ * address, and so are the rows of the line programs of .debug_line when
+ * the file has it. the tables are mmap()ed and the names point into the
+ * mapped file, so nothing is allocated. the resolved addresses are cached
+ * and the modules are kept until dlclose(), so the repeated reports are
+ * cheap. the separate debug files and the compressed sections are not
+ * looked up, the C++ names are not demangled.
+ */
+
+typedef struct {
+    uintptr_t addr; /* relative to the load address */
+    uint64_t size;
+    const char *name;
+} malloc_stat_sym_func;
+
+typedef struct {
+    uintptr_t addr; /* relative to the load address */
+    uint32_t line;  /* 0 for the end of a sequence */
+    uint32_t file;
+} malloc_stat_sym_row;
+
+typedef struct {
+    char path[MALLOC_STAT_MODULE_PATH];
+    uintptr_t base;
+    uintptr_t begin;
+    uintptr_t end;
+    void *map;
+    size_t map_size;
+    malloc_stat_sym_func *funcs;
+    size_t nfuncs;
+    size_t funcs_mapped;
+    malloc_stat_sym_row *rows;
+    size_t nrows;
+    size_t rows_mapped;
+    const char **files;
+    size_t nfiles;
+    size_t files_mapped;
+} malloc_stat_sym_module;
+
+typedef struct {
+    uintptr_t addr; /* 0 for free */
+    uint32_t module; /* 1 + the index, 0 out of any module */
+    uint32_t line;
+    uint64_t offset;
+    const char *function;
+    const char *file;
+} malloc_stat_sym_entry;
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+} malloc_stat_sym_section;
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+} malloc_stat_sym_reader;
+
+/* the DWARF constants used by the line programs */
+enum {
+     DW_FORM_data2 = 0x05
+    ,DW_FORM_data4 = 0x06
+    ,DW_FORM_data8 = 0x07
+    ,DW_FORM_string = 0x08
+    ,DW_FORM_block = 0x09
+    ,DW_FORM_data1 = 0x0b
+    ,DW_FORM_strp = 0x0e
+    ,DW_FORM_udata = 0x0f
+    ,DW_FORM_data16 = 0x1e
+    ,DW_FORM_line_strp = 0x1f
+    ,DW_LNCT_path = 0x1
+    ,DW_LNE_end_sequence = 0x01
+    ,DW_LNE_set_address = 0x02
+    ,DW_LNS_copy = 0x01
+    ,DW_LNS_advance_pc = 0x02
+    ,DW_LNS_advance_line = 0x03
+    ,DW_LNS_set_file = 0x04
+    ,DW_LNS_const_add_pc = 0x08
+    ,DW_LNS_fixed_advance_pc = 0x09
+};
+
+static int symbolize_enabled = 0;
+
+/* the modules and the cache, guarded by sym_mutex */
+static pthread_mutex_t sym_mutex = PTHREAD_MUTEX_INITIALIZER;
+static malloc_stat_sym_module sym_modules[MALLOC_STAT_SYMBOL_MODULES];
+static uint32_t sym_nmodules = 0;
+static malloc_stat_sym_entry *sym_cache = NULL;
+static uint32_t sym_cached = 0;
+/* incremented by dlclose(), the modules are reloaded once it changed */
+static uint32_t sym_generation = 0;
+static uint32_t sym_loaded_generation = 0;
+
+static inline uint32_t ptr_hash(uintptr_t p);
+
+/* grows the mmap()ed array to `num` items of `size` bytes, `mapped` is in bytes */
+static void *sym_reserve(void *p, size_t *mapped, size_t num, size_t size) {
+    if ( num * size <= *mapped ) {
+        return p;
+    }
+    size_t len = *mapped ? *mapped : 64 * 1024;
+    for ( ; len < num * size; len *= 2 )
+    {}
+
+    void *res = p
+        ? mremap(p, *mapped, len, MREMAP_MAYMOVE)
+        : mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( res == MAP_FAILED ) {
+        return NULL;
+    }
+    *mapped = len;
+
+    return res;
+}
+
+/* heapsort, qsort() may call malloc() */
+static void sym_sort(void *base, size_t n, size_t size, bool (*less)(const void *, const void *)) {
+    char *a = (char *)base, t[32];
+
+#define MALLOC_STAT_SYM_SWAP(i, j) \
+    (memcpy(t, a + (i) * size, size), memcpy(a + (i) * size, a + (j) * size, size), memcpy(a + (j) * size, t, size))
+
+    for ( size_t start = n / 2, end = n; end > 1; ) {
+        size_t root;
+        if ( start > 0 ) {
+            root = --start;
+        } else {
+            --end;
+            MALLOC_STAT_SYM_SWAP(0, end);
+            root = 0;
+        }
+
+        for ( size_t child; (child = root * 2 + 1) < end; root = child ) {
+            if ( child + 1 < end && less(a + child * size, a + (child + 1) * size) ) {
+                ++child;
+            }
+            if ( !less(a + root * size, a + child * size) ) {
+                break;
+            }
+            MALLOC_STAT_SYM_SWAP(root, child);
+        }
+    }
+
+#undef MALLOC_STAT_SYM_SWAP
+}
+
+static bool sym_func_less(const void *l, const void *r) {
+    return ((const malloc_stat_sym_func *)l)->addr < ((const malloc_stat_sym_func *)r)->addr;
+}
+
+/* the end of a sequence goes before the row starting the next one at the same address */
+static bool sym_row_less(const void *l, const void *r) {
+    const malloc_stat_sym_row *a = (const malloc_stat_sym_row *)l, *b = (const malloc_stat_sym_row *)r;
+
+    return a->addr < b->addr || (a->addr == b->addr && !a->line && b->line);
+}
+
+static uint64_t sym_fixed(malloc_stat_sym_reader *r, size_t size) {
+    uint8_t v8;
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64 = 0;
+
+    if ( (size_t)(r->end - r->p) < size ) {
+        r->p = r->end;
+        return 0;
+    }
+    switch ( size ) {
+        case 1: memcpy(&v8, r->p, 1); v64 = v8; break;
+        case 2: memcpy(&v16, r->p, 2); v64 = v16; break;
+        case 4: memcpy(&v32, r->p, 4); v64 = v32; break;
+        case 8: memcpy(&v64, r->p, 8); break;
+    }
+    r->p += size;
+
+    return v64;
+}
+
+static uint64_t sym_uleb(malloc_stat_sym_reader *r) {
+    uint64_t res = 0;
+    for ( uint32_t shift = 0; r->p < r->end; shift += 7 ) {
+        uint8_t b = *r->p++;
+        res |= shift < 64 ? (uint64_t)(b & 0x7f) << shift : 0;
+        if ( !(b & 0x80) ) {
+            break;
+        }
+    }
+
+    return res;
+}
+
+static int64_t sym_sleb(malloc_stat_sym_reader *r) {
+    uint64_t res = 0;
+    uint32_t shift = 0;
+    uint8_t b = 0;
+    for ( ; r->p < r->end; ) {
+        b = *r->p++;
+        res |= shift < 64 ? (uint64_t)(b & 0x7f) << shift : 0;
+        shift += 7;
+        if ( !(b & 0x80) ) {
+            break;
+        }
+    }
+    if ( shift < 64 && (b & 0x40) ) {
+        res |= ~(uint64_t)0 << shift;
+    }
+
+    return (int64_t)res;
+}
+
+/* the zero-terminated string at `offset` of the section, NULL if it's out of the section */
+static const char *sym_string(const malloc_stat_sym_section *s, uint64_t offset) {
+    if ( offset >= s->size || !memchr(s->data + offset, 0, s->size - offset) ) {
+        return NULL;
+    }
+
+    return (const char *)s->data + offset;
+}
+
+static const char *sym_inline_string(malloc_stat_sym_reader *r) {
+    const uint8_t *nul = memchr(r->p, 0, r->end - r->p);
+    if ( !nul ) {
+        r->p = r->end;
+        return NULL;
+    }
+    const char *res = (const char *)r->p;
+    r->p = nul + 1;
+
+    return res;
+}
+
+/* reads an attribute of a DWARF 5 directory or file entry */
+static bool sym_form(malloc_stat_sym_reader *r, uint64_t form, bool dwarf64, const malloc_stat_sym_section *line_str
+    ,const malloc_stat_sym_section *str, const char **s)
+{
+    *s = NULL;
+    switch ( form ) {
+        case DW_FORM_string: *s = sym_inline_string(r); break;
+        case DW_FORM_line_strp: *s = sym_string(line_str, sym_fixed(r, dwarf64 ? 8 : 4)); break;
+        case DW_FORM_strp: *s = sym_string(str, sym_fixed(r, dwarf64 ? 8 : 4)); break;
+        case DW_FORM_udata: sym_uleb(r); break;
+        case DW_FORM_data1: sym_fixed(r, 1); break;
+        case DW_FORM_data2: sym_fixed(r, 2); break;
+        case DW_FORM_data4: sym_fixed(r, 4); break;
+        case DW_FORM_data8: sym_fixed(r, 8); break;
+        case DW_FORM_data16: r->p = (size_t)(r->end - r->p) < 16 ? r->end : r->p + 16; break;
+        case DW_FORM_block: {
+            uint64_t len = sym_uleb(r);
+            r->p = (uint64_t)(r->end - r->p) < len ? r->end : r->p + len;
+        } break;
+        default: return false;
+    }
+
+    return r->p < r->end;
+}
+
+static bool sym_add_file(malloc_stat_sym_module *m, const char *name) {
+    void *p = sym_reserve(m->files, &m->files_mapped, m->nfiles + 1, sizeof(m->files[0]));
+    if ( !p ) {
+        return false;
+    }
+    m->files = (const char **)p;
+    m->files[m->nfiles++] = name ? name : "??";
+
+    return true;
+}
+
+/* the directories or the files of a DWARF 5 line program header */
+static bool sym_entries(malloc_stat_sym_module *m, malloc_stat_sym_reader *r, bool dwarf64
+    ,const malloc_stat_sym_section *line_str, const malloc_stat_sym_section *str, bool files)
+{
+    uint64_t formats[16][2];
+    uint32_t nformats = (uint32_t)sym_fixed(r, 1);
+    if ( nformats > 16 ) {
+        return false;
+    }
+    for ( uint32_t i = 0; i < nformats; ++i ) {
+        formats[i][0] = sym_uleb(r);
+        formats[i][1] = sym_uleb(r);
+    }
+
+    for ( uint64_t n = sym_uleb(r); n > 0; --n ) {
+        const char *name = NULL;
+        for ( uint32_t i = 0; i < nformats; ++i ) {
+            const char *s;
+            if ( !sym_form(r, formats[i][1], dwarf64, line_str, str, &s) ) {
+                return false;
+            }
+            name = formats[i][0] == DW_LNCT_path ? s : name;
+        }
+        if ( files && !sym_add_file(m, name) ) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool sym_add_row(malloc_stat_sym_module *m, uintptr_t addr, uint32_t line, uint32_t file) {
+    void *p = sym_reserve(m->rows, &m->rows_mapped, m->nrows + 1, sizeof(m->rows[0]));
+    if ( !p ) {
+        return false;
+    }
+    m->rows = (malloc_stat_sym_row *)p;
+    m->rows[m->nrows].addr = addr;
+    m->rows[m->nrows].line = line;
+    m->rows[m->nrows].file = file;
+    ++m->nrows;
+
+    return true;
+}
+
+/* runs the line program of a unit, DWARF 2 to 5 */
+static bool sym_unit(malloc_stat_sym_module *m, malloc_stat_sym_reader *r, bool dwarf64
+    ,const malloc_stat_sym_section *line_str, const malloc_stat_sym_section *str)
+{
+    uint32_t version = (uint32_t)sym_fixed(r, 2);
+    size_t addr_size = sizeof(void *);
+    if ( version < 2 || version > 5 ) {
+        return false;
+    }
+    if ( version >= 5 ) {
+        addr_size = (size_t)sym_fixed(r, 1);
+        sym_fixed(r, 1); /* segment selector size */
+    }
+    uint64_t header_len = sym_fixed(r, dwarf64 ? 8 : 4);
+    if ( header_len > (uint64_t)(r->end - r->p) ) {
+        return false;
+    }
+    const uint8_t *program = r->p + header_len;
+
+    uint64_t min_inst = sym_fixed(r, 1);
+    if ( version >= 4 ) {
+        sym_fixed(r, 1); /* maximum operations per instruction, VLIW only */
+    }
+    sym_fixed(r, 1); /* default is_stmt */
+    int64_t line_base = (int8_t)sym_fixed(r, 1);
+    uint64_t line_range = sym_fixed(r, 1);
+    uint32_t opcode_base = (uint32_t)sym_fixed(r, 1);
+    if ( !line_range || !opcode_base || (uint64_t)(r->end - r->p) < opcode_base - 1 ) {
+        return false;
+    }
+    const uint8_t *lengths = r->p;
+    r->p += opcode_base - 1;
+
+    /* the file 1 of DWARF 2-4 and the file 0 of DWARF 5 is the first one of the unit */
+    uint32_t first_file = (uint32_t)m->nfiles;
+    uint64_t file_base = version >= 5 ? 0 : 1;
+    if ( version >= 5 ) {
+        if ( !sym_entries(m, r, dwarf64, line_str, str, false) || !sym_entries(m, r, dwarf64, line_str, str, true) ) {
+            return false;
+        }
+    } else {
+        while ( r->p < r->end && *r->p ) {
+            sym_inline_string(r);
+        }
+        ++r->p;
+        while ( r->p < r->end && *r->p ) {
+            if ( !sym_add_file(m, sym_inline_string(r)) ) {
+                return false;
+            }
+            sym_uleb(r); /* directory */
+            sym_uleb(r); /* modification time */
+            sym_uleb(r); /* length */
+        }
+    }
+    uint64_t nfiles = m->nfiles - first_file;
+
+    uintptr_t addr = 0;
+    uint64_t file = 1;
+    int64_t line = 1;
+    for ( r->p = program; r->p < r->end; ) {
+        uint32_t op = (uint32_t)sym_fixed(r, 1);
+        bool emit = false, end_sequence = false;
+
+        if ( op >= opcode_base ) {
+            uint64_t adj = op - opcode_base;
+            addr += (adj / line_range) * min_inst;
+            line += line_base + (int64_t)(adj % line_range);
+            emit = true;
+        } else if ( op == 0 ) {
+            uint64_t len = sym_uleb(r);
+            if ( !len || len > (uint64_t)(r->end - r->p) ) {
+                break;
+            }
+            const uint8_t *next = r->p + len;
+            uint32_t sub = (uint32_t)sym_fixed(r, 1);
+            if ( sub == DW_LNE_end_sequence ) {
+                emit = end_sequence = true;
+            } else if ( sub == DW_LNE_set_address && (len - 1 == 4 || len - 1 == 8) && len - 1 <= addr_size ) {
+                addr = (uintptr_t)sym_fixed(r, len - 1);
+            }
+            r->p = next;
+        } else {
+            switch ( op ) {
+                case DW_LNS_copy: emit = true; break;
+                case DW_LNS_advance_pc: addr += sym_uleb(r) * min_inst; break;
+                case DW_LNS_advance_line: line += sym_sleb(r); break;
+                case DW_LNS_set_file: file = sym_uleb(r); break;
+                case DW_LNS_const_add_pc: addr += ((255 - opcode_base) / line_range) * min_inst; break;
+                case DW_LNS_fixed_advance_pc: addr += sym_fixed(r, 2); break;
+                default: {
+                    for ( uint32_t i = 0; i < lengths[op - 1]; ++i ) {
+                        sym_uleb(r);
+                    }
+                }
+            }
+        }
+
+        if ( emit ) {
+            uint32_t id = file - file_base < nfiles ? first_file + (uint32_t)(file - file_base) : UINT32_MAX;
+            if ( !sym_add_row(m, addr, end_sequence ? 0 : (line > 0 ? (uint32_t)line : 1), id) ) {
+                return false;
+            }
+        }
+        if ( end_sequence ) {
+            addr = 0;
+            file = 1;
+            line = 1;
+        }
+    }
+
+    return true;
+}
+
+static void sym_load_lines(malloc_stat_sym_module *m, const malloc_stat_sym_section *lines
+    ,const malloc_stat_sym_section *line_str, const malloc_stat_sym_section *str)
+{
+    malloc_stat_sym_reader units = {lines->data, lines->data + lines->size};
+
+    while ( units.p < units.end ) {
+        bool dwarf64 = false;
+        uint64_t len = sym_fixed(&units, 4);
+        if ( len == 0xffffffffu ) {
+            len = sym_fixed(&units, 8);
+            dwarf64 = true;
+        }
+        if ( !len || len > (uint64_t)(units.end - units.p) ) {
+            break;
+        }
+        malloc_stat_sym_reader unit = {units.p, units.p + len};
+        units.p += len;
+        sym_unit(m, &unit, dwarf64, line_str, str);
+    }
+
+    sym_sort(m->rows, m->nrows, sizeof(m->rows[0]), sym_row_less);
+}
+
+static bool sym_section(const malloc_stat_sym_module *m, const ElfW(Shdr) *sh, malloc_stat_sym_section *out) {
+    if ( sh->sh_type == SHT_NOBITS || (sh->sh_flags & SHF_COMPRESSED)
+        || sh->sh_offset > m->map_size || sh->sh_size > m->map_size - sh->sh_offset )
+    {
+        return false;
+    }
+    out->data = (const uint8_t *)m->map + sh->sh_offset;
+    out->size = sh->sh_size;
+
+    return true;
+}
+
+static void sym_load_funcs(malloc_stat_sym_module *m, const ElfW(Shdr) *shdrs, uint32_t num, const ElfW(Shdr) *symtab) {
+    malloc_stat_sym_section syms, strs;
+    if ( symtab->sh_link >= num || !sym_section(m, symtab, &syms) || !sym_section(m, &shdrs[symtab->sh_link], &strs) ) {
+        return;
+    }
+
+    for ( size_t i = 0; i < syms.size / sizeof(ElfW(Sym)); ++i ) {
+        const ElfW(Sym) *s = (const ElfW(Sym) *)syms.data + i;
+        uint32_t type = ELF64_ST_TYPE(s->st_info);
+        if ( (type != STT_FUNC && type != STT_GNU_IFUNC) || s->st_shndx == SHN_UNDEF || !s->st_value ) {
+            continue;
+        }
+        const char *name = sym_string(&strs, s->st_name);
+        if ( !name || !name[0] ) {
+            continue;
+        }
+
+        void *p = sym_reserve(m->funcs, &m->funcs_mapped, m->nfuncs + 1, sizeof(m->funcs[0]));
+        if ( !p ) {
+            break;
+        }
+        m->funcs = (malloc_stat_sym_func *)p;
+        m->funcs[m->nfuncs].addr = s->st_value;
+        m->funcs[m->nfuncs].size = s->st_size;
+        m->funcs[m->nfuncs].name = name;
+        ++m->nfuncs;
+    }
+
+    sym_sort(m->funcs, m->nfuncs, sizeof(m->funcs[0]), sym_func_less);
+}
+
+/* maps the file of the module and builds its tables */
+static void sym_load(malloc_stat_sym_module *m) {
+    struct stat st;
+    int fd = open(m->path, O_RDONLY | O_CLOEXEC);
+    if ( fd == -1 ) {
+        return;
+    }
+    if ( fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(ElfW(Ehdr)) ) {
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( map == MAP_FAILED ) {
+        return;
+    }
+    m->map = map;
+    m->map_size = st.st_size;
+
+    const ElfW(Ehdr) *eh = (const ElfW(Ehdr) *)map;
+    if ( memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != (sizeof(void *) == 8 ? ELFCLASS64 : ELFCLASS32)
+        || eh->e_shentsize != sizeof(ElfW(Shdr)) || eh->e_shoff > m->map_size
+        || (size_t)eh->e_shnum * sizeof(ElfW(Shdr)) > m->map_size - eh->e_shoff || eh->e_shstrndx >= eh->e_shnum )
+    {
+        return;
+    }
+    const ElfW(Shdr) *shdrs = (const ElfW(Shdr) *)((const char *)map + eh->e_shoff);
+    malloc_stat_sym_section names, lines = {NULL, 0}, line_str = {NULL, 0}, str = {NULL, 0};
+    if ( !sym_section(m, &shdrs[eh->e_shstrndx], &names) ) {
+        return;
+    }
+
+    const ElfW(Shdr) *symtab = NULL, *dynsym = NULL;
+    for ( uint32_t i = 0; i < eh->e_shnum; ++i ) {
+        const char *name = sym_string(&names, shdrs[i].sh_name);
+        if ( shdrs[i].sh_type == SHT_SYMTAB ) {
+            symtab = &shdrs[i];
+        } else if ( shdrs[i].sh_type == SHT_DYNSYM ) {
+            dynsym = &shdrs[i];
+        } else if ( !name ) {
+            continue;
+        } else if ( strcmp(name, ".debug_line") == 0 ) {
+            sym_section(m, &shdrs[i], &lines);
+        } else if ( strcmp(name, ".debug_line_str") == 0 ) {
+            sym_section(m, &shdrs[i], &line_str);
+        } else if ( strcmp(name, ".debug_str") == 0 ) {
+            sym_section(m, &shdrs[i], &str);
+        }
+    }
+
+    if ( symtab || dynsym ) {
+        sym_load_funcs(m, shdrs, eh->e_shnum, symtab ? symtab : dynsym);
+    }
+    if ( lines.size ) {
+        sym_load_lines(m, &lines, &line_str, &str);
+    }
+}
+
+static int sym_module_cb(struct dl_phdr_info *info, size_t size, void *data) {
+    (void)size;
+    malloc_stat_sym_module *m = (malloc_stat_sym_module *)data;
+    uintptr_t begin, end;
+
+    phdr_range(info, &begin, &end);
+    if ( m->begin < begin || m->begin >= end ) {
+        return 0;
+    }
+    m->base = info->dlpi_addr;
+    m->begin = begin;
+    m->end = end;
+
+    /* the executable is the first one and has no name */
+    if ( info->dlpi_name[0] ) {
+        size_t len = myStrlen(info->dlpi_name);
+        len = len < sizeof(m->path) - 1 ? len : sizeof(m->path) - 1;
+        memcpy(m->path, info->dlpi_name, len);
+        m->path[len] = '\0';
+    } else {
+        ssize_t len = readlink("/proc/self/exe", m->path, sizeof(m->path) - 1);
+        m->path[len > 0 ? len : 0] = '\0';
+    }
+
+    return 1;
+}
+
+static void sym_forget(void) {
+    for ( uint32_t i = 0; i < sym_nmodules; ++i ) {
+        malloc_stat_sym_module *m = &sym_modules[i];
+        if ( m->map ) {
+            munmap(m->map, m->map_size);
+        }
+        if ( m->funcs ) {
+            munmap(m->funcs, m->funcs_mapped);
+        }
+        if ( m->rows ) {
+            munmap(m->rows, m->rows_mapped);
+        }
+        if ( m->files ) {
+            munmap((void *)m->files, m->files_mapped);
+        }
+    }
+    sym_nmodules = 0;
+    if ( sym_cache ) {
+        memset(sym_cache, 0, MALLOC_STAT_SYMBOL_CACHE * sizeof(sym_cache[0]));
+    }
+    sym_cached = 0;
+}
+
+/* the index + 1 of the module holding the address, loads it on the first use, 0 if there is none */
+static uint32_t sym_module(uintptr_t addr) {
+    for ( uint32_t i = 0; i < sym_nmodules; ++i ) {
+        if ( addr >= sym_modules[i].begin && addr < sym_modules[i].end ) {
+            return i + 1;
+        }
+    }
+    if ( sym_nmodules == MALLOC_STAT_SYMBOL_MODULES ) {
+        return 0;
+    }
+
+    malloc_stat_sym_module *m = &sym_modules[sym_nmodules];
+    memset(m, 0, sizeof(*m));
+    m->begin = addr;
+    if ( !dl_iterate_phdr(sym_module_cb, m) ) {
+        return 0;
+    }
+    sym_load(m);
+
+    return ++sym_nmodules;
+}
+
+/* resolves the return address, i.e. the call before it, must be called under sym_mutex */
+static const malloc_stat_sym_entry *sym_resolve(uintptr_t addr) {
+    uint32_t generation = __atomic_load_n(&sym_generation, __ATOMIC_ACQUIRE);
+    if ( generation != sym_loaded_generation ) {
+        sym_forget();
+        sym_loaded_generation = generation;
+    }
+    if ( !sym_cache ) {
+        void *p = mmap(NULL, MALLOC_STAT_SYMBOL_CACHE * sizeof(sym_cache[0])
+            ,PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if ( p == MAP_FAILED ) {
+            return NULL;
+        }
+        sym_cache = (malloc_stat_sym_entry *)p;
+    }
+
+    /* starts over once the cache is 3/4 full */
+    if ( sym_cached >= MALLOC_STAT_SYMBOL_CACHE / 4 * 3 ) {
+        memset(sym_cache, 0, MALLOC_STAT_SYMBOL_CACHE * sizeof(sym_cache[0]));
+        sym_cached = 0;
+    }
+    uint32_t mask = MALLOC_STAT_SYMBOL_CACHE - 1, i = ptr_hash(addr) & mask;
+    for ( ; sym_cache[i].addr && sym_cache[i].addr != addr; i = (i + 1) & mask )
+    {}
+    malloc_stat_sym_entry *e = &sym_cache[i];
+    if ( e->addr ) {
+        return e;
+    }
+
+    e->addr = addr;
+    e->module = sym_module(addr - 1);
+    ++sym_cached;
+    if ( !e->module ) {
+        return e;
+    }
+
+    const malloc_stat_sym_module *m = &sym_modules[e->module - 1];
+    uintptr_t pc = addr - 1 - m->base;
+
+    /* the last function starting at or before the address */
+    size_t lo = 0, hi = m->nfuncs;
+    while ( lo < hi ) {
+        size_t mid = (lo + hi) / 2;
+        if ( m->funcs[mid].addr <= pc ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if ( lo ) {
+        const malloc_stat_sym_func *f = &m->funcs[lo - 1];
+        if ( !f->size || pc < f->addr + f->size ) {
+            e->function = f->name;
+            e->offset = addr - m->base - f->addr;
+        }
+    }
+
+    /* the same for the rows, the end of a sequence covers nothing */
+    lo = 0;
+    hi = m->nrows;
+    while ( lo < hi ) {
+        size_t mid = (lo + hi) / 2;
+        if ( m->rows[mid].addr <= pc ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if ( lo && m->rows[lo - 1].line && m->rows[lo - 1].file < m->nfiles ) {
+        e->file = m->files[m->rows[lo - 1].file];
+        e->line = m->rows[lo - 1].line;
+    }
+
+    return e;
+}
+
+int malloc_stat_set_symbolize(int on) {
+    int prev = symbolize_enabled;
+    symbolize_enabled = on;
+
+    return prev;
+}
+
+int malloc_stat_symbolize(void *addr, malloc_stat_symbol *out) {
+    memset(out, 0, sizeof(*out));
+    out->addr = addr;
+
+    pthread_mutex_lock(&sym_mutex);
+    const malloc_stat_sym_entry *e = sym_resolve((uintptr_t)addr);
+    if ( e && e->module ) {
+        memcpy(out->module, sym_modules[e->module - 1].path, sizeof(out->module));
+    }
+    if ( e && e->function ) {
+        size_t len = myStrlen(e->function);
+        len = len < sizeof(out->function) - 1 ? len : sizeof(out->function) - 1;
+        memcpy(out->function, e->function, len);
+        out->offset = e->offset;
+    }
+    if ( e && e->file ) {
+        size_t len = myStrlen(e->file);
+        len = len < sizeof(out->file) - 1 ? len : sizeof(out->file) - 1;
+        memcpy(out->file, e->file, len);
+        out->line = e->line;
+    }
+    pthread_mutex_unlock(&sym_mutex);
+
+    return out->function[0] != '\0';
+}
+
+/* appends ` at <function>+<offset> <file>:<line>` of the address to the line
+ * of the report, before its newline. returns the new length.
+ */
+static int symbol_append(char *buf, int len, size_t size, void *addr) {
+    if ( !symbolize_enabled || len <= 0 || (size_t)len >= size ) {
+        return len;
+    }
+    bool newline = buf[len - 1] == '\n';
+    len -= newline;
+
+    pthread_mutex_lock(&sym_mutex);
+    const malloc_stat_sym_entry *e = sym_resolve((uintptr_t)addr);
+    if ( e && e->function ) {
+        len += snprintf(buf + len, size - len, " at %s+0x%" PRIx64, e->function, e->offset);
+    }
+    if ( e && e->file && (size_t)len < size ) {
+        len += snprintf(buf + len, size - len, " %s:%u", e->file, e->line);
+    }
+    pthread_mutex_unlock(&sym_mutex);
+
+    len = (size_t)len < size - 1 ? len : (int)size - 2;
+    if ( newline ) {
+        buf[len++] = '\n';
+        buf[len] = '\0';
+    }
+
+    return len;
+}
+
+/* log ring part
+ *
+ * with the `log_ring` option the log is copied into a ring of memory
+ * mapped segment files instead of being written to memlog_fd. a writer
+ * reserves its bytes by an atomic add on the stream position and copies
+ * the entry in, no syscall is made unless it has to wait for a segment.
+ * an entry crossing the segment end is retried in the next segment and
+ * its reserved bytes stay unused, so the segments hold whole entries.
+ * the writer reserving the first byte of a segment opens it, the one
+ * committing the last byte marks it finished. see malloc_stat_ring_header.
+ * each segment starts with a copy of the log header (# PID .. # MAPS), so
+ * the log stays readable when the first segment is overwritten.
+ */
+
+static char ring_path[256];
+static uint64_t ring_size = MALLOC_STAT_RING_SIZE;
+static uint32_t ring_count = MALLOC_STAT_RING_SEGMENTS;
+static malloc_stat_ring_header *ring_segments[MALLOC_STAT_RING_MAX_SEGMENTS];
+
+/* the log header, rendered once by ring_setup() */
+static char *ring_head = NULL;
+static uint64_t ring_head_len = 0;
+/* the entry bytes of a segment, the rest holds the header */
+static uint64_t ring_span = 0;
+
+/* the stream position, the segment `pos / ring_span` at `pos % ring_span` */
+static uint64_t ring_pos __attribute__((aligned(MALLOC_STAT_CACHE_LINE))) = 0;
+/* 1 + the segment finalized by fini, 0 while running */
+static uint64_t ring_last = 0;
+
+static inline malloc_stat_ring_header *ring_segment(uint64_t seq) {
+    return ring_segments[seq % ring_count];
+}
+
+static inline char *ring_data(malloc_stat_ring_header *h) {
+    return (char *)h + MALLOC_STAT_RING_HEADER;
+}
+
+/* the slot is reused by the segment `seq` once the previous one is finished.
+ * the header is put right before the entry at `begin`, the bytes before it
+ * are left unused.
+ */
+static void ring_open(uint64_t seq, uint64_t begin) {
+    malloc_stat_ring_header *h = ring_segment(seq);
+    while ( __atomic_load_n(&h->state, __ATOMIC_ACQUIRE) == MALLOC_STAT_RING_WRITING ) {
+        sched_yield();
+    }
+
+    /* the readers re-check the state after copying the old segment */
+    __atomic_store_n(&h->state, MALLOC_STAT_RING_WRITING, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(ring_data(h) + begin, ring_head, ring_head_len);
+    h->begin = begin;
+    h->end = ring_size;
+    h->committed = begin + ring_head_len;
+    __atomic_store_n(&h->seq, seq, __ATOMIC_RELEASE);
+}
+
+static inline void ring_wait(malloc_stat_ring_header *h, uint64_t seq) {
+    while ( __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE) != seq ) {
+        sched_yield();
+    }
+}
+
+static inline void ring_commit(malloc_stat_ring_header *h, uint64_t len) {
+    if ( __atomic_add_fetch(&h->committed, len, __ATOMIC_ACQ_REL) == ring_size ) {
+        uint32_t state = h->seq + 1 == __atomic_load_n(&ring_last, __ATOMIC_ACQUIRE)
+            ? MALLOC_STAT_RING_LAST
+            : MALLOC_STAT_RING_FINISHED;
+        __atomic_store_n(&h->state, state, __ATOMIC_RELEASE);
+    }
+}
+
+static void ring_write(const char *buf, size_t len) {
+    for ( ;; ) {
+        uint64_t pos = __atomic_fetch_add(&ring_pos, len, __ATOMIC_RELAXED);
+        uint64_t seq = pos / ring_span, off = pos % ring_span;
+        malloc_stat_ring_header *h = ring_segment(seq);
+
+        if ( off + len <= ring_span ) {
+            if ( off == 0 && seq ) {
+                ring_open(seq, 0);
+            }
+            ring_wait(h, seq);
+            memcpy(ring_data(h) + ring_head_len + off, buf, len);
+            ring_commit(h, len);
+
+            return;
+        }
+
+        /* the tail of this segment and the head of the next one are unused */
+        ring_wait(h, seq);
+        h->end = ring_head_len + off;
+        ring_commit(h, ring_span - off);
+        ring_open(seq + 1, off + len - ring_span);
+    }
+}
+
+/* collects the log header, whole lines up to a half of a segment */
+static ssize_t ring_head_append(const void *buf, size_t len) {
+    size_t room = ring_size / 2 - ring_head_len;
+    memcpy(ring_head + ring_head_len, buf, len < room ? len : room);
+    ring_head_len += len < room ? len : room;
+
+    return len;
+}
+
+static void log_header(int fd, pid_t ppid);
+
+static int ring_setup(pid_t ppid) {
+    char path[sizeof(ring_path) + 16];
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    /* the largest entry must fit a segment with room to spare */
+    ring_size = (ring_size < 16 * LOG_BUFSIZE ? 16 * LOG_BUFSIZE : ring_size + page - 1) / page * page;
+    if ( !ring_count || ring_count > MALLOC_STAT_RING_MAX_SEGMENTS ) {
+        ring_count = MALLOC_STAT_RING_SEGMENTS;
+    }
+
+    for ( uint32_t i = 0; i < ring_count; ++i ) {
+        snprintf(path, sizeof(path), "%s.%u", ring_path, i);
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if ( fd == -1 ) {
+            return 0;
+        }
+        if ( ftruncate(fd, MALLOC_STAT_RING_HEADER + ring_size) == -1 ) {
+            close(fd);
+            return 0;
+        }
+        void *p = mmap(NULL, MALLOC_STAT_RING_HEADER + ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if ( p == MAP_FAILED ) {
+            return 0;
+        }
+
+        ring_segments[i] = (malloc_stat_ring_header *)p;
+    }
+
+    ring_head = mmap(NULL, ring_size / 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( ring_head == MAP_FAILED ) {
+        ring_head = NULL;
+        return 0;
+    }
+    ring_head_len = 0;
+    log_header(MALLOC_STAT_RING_HEAD_FD, ppid);
+    while ( ring_head_len && ring_head[ring_head_len - 1] != '\n' ) {
+        --ring_head_len;
+    }
+    ring_span = ring_size - ring_head_len;
+
+    for ( uint32_t i = 0; i < ring_count; ++i ) {
+        malloc_stat_ring_header *h = ring_segments[i];
+        h->seq = MALLOC_STAT_RING_UNUSED;
+        h->size = ring_size;
+        h->count = ring_count;
+        h->state = MALLOC_STAT_RING_FINISHED;
+        h->pid = getpid();
+        h->head = ring_head_len;
+        __atomic_store_n(&h->magic, MALLOC_STAT_RING_MAGIC, __ATOMIC_RELEASE);
+    }
+    ring_open(0, 0);
+
+    return 1;
+}
+
+/* finishes the current segment marking it as the last one */
+static void ring_close(void) {
+    uint64_t pos = __atomic_load_n(&ring_pos, __ATOMIC_RELAXED);
+    while ( !__atomic_compare_exchange_n(&ring_pos, &pos, pos + (ring_span - pos % ring_span)
+        ,false, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+    {}
+
+    uint64_t seq = pos / ring_span, off = pos % ring_span;
+    malloc_stat_ring_header *h = ring_segment(seq);
+    __atomic_store_n(&ring_last, seq + 1, __ATOMIC_RELEASE);
+    if ( off == 0 && seq ) {
+        ring_open(seq, 0);
+    }
+    ring_wait(h, seq);
+    h->end = ring_head_len + off;
+    ring_commit(h, ring_span - off);
+}
+
+static ssize_t log_write(int fd, const void *buf, size_t len) {
+    if ( fd == MALLOC_STAT_RING_FD && ring_segments[0] ) {
+        ring_write(buf, len);
+
+        return len;
+    }
+    if ( fd == MALLOC_STAT_RING_HEAD_FD ) {
+        return ring_head_append(buf, len);
+    }
+
+    return write(fd, buf, len);
+}
+
+/* latency part
+ *
+ * every N-th intercepted call of a thread is timed around the call of the
+ * real function only. the cycles are counted by rdtsc where available and
+ * stored in log-linear histograms with 16 sub-buckets per power of two,
+ * sharded between the threads to keep the counters mostly thread local.
+ * the cycles are converted to nanoseconds on read by the ratio measured
+ * since the timing was enabled, so no calibration is done at the start.
+ */
+
+#define MALLOC_STAT_LATENCY_SUB_BITS 4
+#define MALLOC_STAT_LATENCY_SUB (1u << MALLOC_STAT_LATENCY_SUB_BITS)
+/* up to 2^48 cycles */
+#define MALLOC_STAT_LATENCY_BUCKETS ((48 - MALLOC_STAT_LATENCY_SUB_BITS + 1) * MALLOC_STAT_LATENCY_SUB)
+
+typedef struct {
+    uint64_t max;
+    uint64_t buckets[MALLOC_STAT_LATENCY_BUCKETS];
+} malloc_stat_latency_hist;
+
+static const char *latency_names[MALLOC_STAT_LATENCY_KINDS] = {
+     "malloc", "calloc", "realloc", "memalign", "posix_memalign"
+    ,"aligned_alloc", "valloc", "pvalloc", "free"
+};
+
+/* time every N-th call of a thread, 0 for none */
+static uint32_t latency_rate = 0;
+static __thread uint32_t latency_countdown __attribute__((tls_model("initial-exec"))) = 0;
+/* the current call of the thread is sampled for the histograms */
+static __thread bool latency_pending __attribute__((tls_model("initial-exec"))) = false;
+/* 1 + the shard of the thread, 0 until the first timed call */
+static __thread uint32_t latency_shard __attribute__((tls_model("initial-exec"))) = 0;
+static uint32_t latency_threads = 0;
+
+/* 0 - not mapped, 1 - mapping in progress, 2 - ready */
+static int latency_state = 0;
+static malloc_stat_latency_hist *latency_hists = NULL;
+static uint64_t latency_start_ticks = 0;
+static uint64_t latency_start_ns = 0;
+
+static inline uint64_t latency_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+static inline bool latency_sampled(void) {
+    if ( latency_countdown > 1 ) {
+        --latency_countdown;
+
+        return false;
+    }
+    latency_countdown = latency_rate;
+    latency_pending = true;
+
+    return true;
+}
+
+/* the slow calls threshold, 0 for none, and the slow calls counters, see the slow calls part */
+static uint64_t slow_ticks = 0;
+static uint64_t slow_counts[MALLOC_STAT_LATENCY_KINDS];
+
+/* the ticks before the call, 0 when the call is not timed.
+ * all the calls are timed while the slow calls are traced.
+ */
+#define MALLOC_STAT_LATENCY_BEGIN() \
+    ((latency_rate && latency_sampled()) || slow_ticks ? latency_ticks() : 0)
+
+#define MALLOC_STAT_LATENCY_END(kind, start, size) \
+    if ( start ) { \
+        latency_end(kind, latency_ticks() - start, size); \
+    }
+
+static inline uint32_t latency_bucket(uint64_t ticks) {
+    if ( ticks < MALLOC_STAT_LATENCY_SUB ) {
+        return ticks;
+    }
+
+    uint32_t shift = 63 - __builtin_clzll(ticks) - MALLOC_STAT_LATENCY_SUB_BITS;
+    uint32_t bucket = (shift + 1) * MALLOC_STAT_LATENCY_SUB + ((ticks >> shift) & (MALLOC_STAT_LATENCY_SUB - 1));
+
+    return bucket < MALLOC_STAT_LATENCY_BUCKETS ? bucket : MALLOC_STAT_LATENCY_BUCKETS - 1;
+}
+
+/* the middle of the bucket */
+static uint64_t latency_bucket_value(uint32_t bucket) {
+    if ( bucket < MALLOC_STAT_LATENCY_SUB ) {
+        return bucket;
+    }
+
+    uint32_t shift = bucket / MALLOC_STAT_LATENCY_SUB - 1;
+    uint64_t low = (uint64_t)(MALLOC_STAT_LATENCY_SUB + bucket % MALLOC_STAT_LATENCY_SUB) << shift;
+
+    return low + ((uint64_t)1 << shift) / 2;
+}
+
+static void latency_record(uint32_t kind, uint64_t ticks) {
+    if ( __atomic_load_n(&latency_state, __ATOMIC_ACQUIRE) != 2 ) {
+        return;
+    }
+    if ( !latency_shard ) {
+        latency_shard = 1 + __atomic_fetch_add(&latency_threads, 1, __ATOMIC_RELAXED) % MALLOC_STAT_LATENCY_SHARDS;
+    }
+
+    malloc_stat_latency_hist *h = &latency_hists[(latency_shard - 1) * MALLOC_STAT_LATENCY_KINDS + kind];
+    __atomic_add_fetch(&h->buckets[latency_bucket(ticks)], 1, __ATOMIC_RELAXED);
+    for ( uint64_t cur = __atomic_load_n(&h->max, __ATOMIC_RELAXED); ticks > cur; ) {
+        if ( __atomic_compare_exchange_n(&h->max, &cur, ticks, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+            break;
+        }
+    }
+}
+
+static int latency_init(void) {
+    int state = 0;
+    if ( __atomic_compare_exchange_n(&latency_state, &state, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+        void *p = mmap(NULL, MALLOC_STAT_LATENCY_SHARDS * MALLOC_STAT_LATENCY_KINDS * sizeof(malloc_stat_latency_hist)
+            ,PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if ( p == MAP_FAILED ) {
+            __atomic_store_n(&latency_state, 0, __ATOMIC_RELEASE);
+
+            return 0;
+        }
+        latency_hists = (malloc_stat_latency_hist *)p;
+        latency_start_ticks = latency_ticks();
+        latency_start_ns = now_ns();
+        __atomic_store_n(&latency_state, 2, __ATOMIC_RELEASE);
+    }
+    while ( (state = __atomic_load_n(&latency_state, __ATOMIC_ACQUIRE)) == 1 ) {
+        sched_yield();
+    }
+
+    return state == 2;
+}
+
+static void latency_reset(void) {
+    memset(latency_hists, 0, MALLOC_STAT_LATENCY_SHARDS * MALLOC_STAT_LATENCY_KINDS * sizeof(malloc_stat_latency_hist));
+}
+
+uint32_t malloc_stat_set_latency_sample(uint32_t n) {
+    uint32_t prev = latency_rate;
+    if ( n && !latency_init() ) {
+        return prev;
+    }
+    latency_rate = n;
+
+    return prev;
+}
+
+size_t malloc_stat_get_latency(malloc_stat_latency *out) {
+    static const uint32_t permille[] = {500, 900, 990, 999};
+    uint64_t hist[MALLOC_STAT_LATENCY_BUCKETS];
+
+    memset(out, 0, MALLOC_STAT_LATENCY_KINDS * sizeof(*out));
+    for ( uint32_t k = 0; k < MALLOC_STAT_LATENCY_KINDS; ++k ) {
+        out[k].slow_calls = MALLOC_STAT_ATOMIC_LOAD(slow_counts[k]);
+    }
+    if ( __atomic_load_n(&latency_state, __ATOMIC_ACQUIRE) != 2 ) {
+        return MALLOC_STAT_LATENCY_KINDS;
+    }
+
+    /* the nanoseconds per tick since the timing was enabled */
+    uint64_t ticks = latency_ticks() - latency_start_ticks;
+    double ratio = ticks ? (double)(now_ns() - latency_start_ns) / ticks : 1.0;
+
+    for ( uint32_t k = 0; k < MALLOC_STAT_LATENCY_KINDS; ++k ) {
+        uint64_t calls = 0, max = 0;
+        memset(hist, 0, sizeof(hist));
+        for ( uint32_t s = 0; s < MALLOC_STAT_LATENCY_SHARDS; ++s ) {
+            const malloc_stat_latency_hist *h = &latency_hists[s * MALLOC_STAT_LATENCY_KINDS + k];
+            for ( uint32_t b = 0; b < MALLOC_STAT_LATENCY_BUCKETS; ++b ) {
+                uint64_t n = __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+                hist[b] += n;
+                calls += n;
+            }
+            uint64_t m = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+            max = m > max ? m : max;
+        }
+
+        uint64_t values[4] = {0, 0, 0, 0};
+        uint64_t cum = 0;
+        uint32_t p = 0;
+        for ( uint32_t b = 0; b < MALLOC_STAT_LATENCY_BUCKETS && p < 4; ++b ) {
+            cum += hist[b];
+            for ( ; p < 4 && cum && cum * 1000 >= calls * permille[p]; ++p ) {
+                uint64_t v = latency_bucket_value(b);
+                values[p] = v < max ? v : max;
+            }
+        }
+
+        out[k].calls = calls;
+        out[k].p50_ns = values[0] * ratio;
+        out[k].p90_ns = values[1] * ratio;
+        out[k].p99_ns = values[2] * ratio;
+        out[k].p999_ns = values[3] * ratio;
+        out[k].max_ns = max * ratio;
+    }
+
+    return MALLOC_STAT_LATENCY_KINDS;
+}
+
+static void latency_report(int fd) {
+    char buf[LOG_BUFSIZE];
+    malloc_stat_latency latency[MALLOC_STAT_LATENCY_KINDS];
+    malloc_stat_get_latency(latency);
+
+    for ( uint32_t k = 0; k < MALLOC_STAT_LATENCY_KINDS; ++k ) {
+        if ( !latency[k].calls ) {
+            continue;
+        }
+        int s = snprintf(buf, sizeof(buf)
+            ,"# LATENCY %s calls %" PRIu64 " p50 %" PRIu64 " p90 %" PRIu64 " p99 %" PRIu64
+             " p99.9 %" PRIu64 " max %" PRIu64 " ns\n"
+            ,latency_names[k], latency[k].calls, latency[k].p50_ns, latency[k].p90_ns
+            ,latency[k].p99_ns, latency[k].p999_ns, latency[k].max_ns
+        );
+        log_write(fd, buf, s);
+    }
+}
+
+/* slow calls part
+ *
+ * while the threshold is set all the intercepted calls are timed, the ones
+ * slower than it are counted and, unless made by the library itself,
+ * traced: the backtrace of the caller is taken, the call is logged as the
+ * `# SLOW` line and the slowest calls are kept for the report. the
+ * backtraces are taken on the slow calls only, so the cost of the mode is
+ * the timing. the threshold is converted to ticks by the tick rate
+ * measured once, for 1ms, when it is set for the first time.
+ */
+
+static uint64_t slow_threshold_ns = 0;
+static double slow_ns_per_tick = 0;
+
+/* the slowest calls, guarded by the spinlock since they are rare */
+static malloc_stat_slow_call slow_calls[MALLOC_STAT_SLOW_CALLS];
+static uint32_t slow_num = 0;
+static int slow_lock = 0;
+
+static double ticks_calibrate(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t ticks = latency_ticks(), start = now_ns(), ns;
+    while ( (ns = now_ns()) - start < 1000000 )
+    {}
+
+    return (double)(ns - start) / (latency_ticks() - ticks);
+#else
+    return 1.0;
+#endif
+}
+
+static int slow_format(char *buf, size_t size, const malloc_stat_slow_call *c) {
+    int len = snprintf(buf, size
+        ,"# SLOW %s size %" PRIu64 " pid %d tid %u ns %" PRIu64 " at"
+        ,latency_names[c->kind], c->size, process_id(), c->tid, c->ns
+    );
+    for ( uint32_t i = 0; i < c->nframes; ++i ) {
+        len += snprintf(buf + len, size - len, " %p", c->frames[i]);
+    }
+    len += snprintf(buf + len, size - len, "\n");
+
+    return len;
+}
+
+static void slow_trace(uint32_t kind, uint64_t ticks, uint64_t size) {
+    __atomic_add_fetch(&slow_counts[kind], 1, __ATOMIC_RELAXED);
+    if ( in_trace ) {
+        return;
+    }
+    in_trace = 1;
+
+    malloc_stat_slow_call c;
+    c.kind = (malloc_stat_latency_kind)kind;
+    c.tid = thread_id();
+    c.size = size;
+    c.ns = ticks * slow_ns_per_tick;
+    c.nframes = backtrace_capture(c.frames, MALLOC_STAT_SLOW_FRAMES);
+
+    if ( memlog_enabled ) {
+        char buf[LOG_BUFSIZE];
+        int len = slow_format(buf, sizeof(buf), &c);
+        log_write(memlog_fd, buf, len);
+    }
+
+    while ( __atomic_exchange_n(&slow_lock, 1, __ATOMIC_ACQUIRE) ) {
+        sched_yield();
+    }
+    uint32_t pos = slow_num;
+    if ( slow_num < MALLOC_STAT_SLOW_CALLS ) {
+        ++slow_num;
+    } else {
+        /* replaces the fastest kept call */
+        pos = 0;
+        for ( uint32_t i = 1; i < slow_num; ++i ) {
+            pos = slow_calls[i].ns < slow_calls[pos].ns ? i : pos;
+        }
+        pos = slow_calls[pos].ns < c.ns ? pos : MALLOC_STAT_SLOW_CALLS;
+    }
+    if ( pos < MALLOC_STAT_SLOW_CALLS ) {
+        slow_calls[pos] = c;
+    }
+    __atomic_store_n(&slow_lock, 0, __ATOMIC_RELEASE);
+
+    in_trace = 0;
+}
+
+static inline void latency_end(uint32_t kind, uint64_t ticks, uint64_t size) {
+    if ( latency_pending ) {
+        latency_pending = false;
+        latency_record(kind, ticks);
+    }
+    if ( slow_ticks && ticks >= slow_ticks ) {
+        slow_trace(kind, ticks, size);
+    }
+}
+
+static void slow_reset(void) {
+    while ( __atomic_exchange_n(&slow_lock, 1, __ATOMIC_ACQUIRE) ) {
+        sched_yield();
+    }
+    for ( uint32_t k = 0; k < MALLOC_STAT_LATENCY_KINDS; ++k ) {
+        MALLOC_STAT_ATOMIC_STORE(slow_counts[k], 0);
+    }
+    slow_num = 0;
+    __atomic_store_n(&slow_lock, 0, __ATOMIC_RELEASE);
+}
+
+uint64_t malloc_stat_set_slow_threshold(uint64_t ns) {
+    uint64_t prev = slow_threshold_ns;
+
+    /* backtrace() can't be called before the real functions are resolved */
+    if ( init_done != LOG_MALLOC_INIT_DONE ) {
+        return prev;
+    }
+    if ( ns && !slow_ns_per_tick ) {
+        /* the first call of backtrace() loads libgcc_s which calls malloc() */
+        void *frames[1];
+        int trace = in_trace;
+        in_trace = 1;
+        backtrace(frames, 1);
+        in_trace = trace;
+
+        slow_ns_per_tick = ticks_calibrate();
+    }
+
+    slow_threshold_ns = ns;
+    slow_ticks = ns ? (uint64_t)(ns / slow_ns_per_tick) + 1 : 0;
+
+    return prev;
+}
+
+size_t malloc_stat_get_slow_calls(malloc_stat_slow_call *out, size_t max) {
+    size_t num = 0;
+
+    while ( __atomic_exchange_n(&slow_lock, 1, __ATOMIC_ACQUIRE) ) {
+        sched_yield();
+    }
+    for ( uint32_t i = 0; i < slow_num; ++i ) {
+        /* insertion into the output ordered by the time */
+        size_t pos = num;
+        for ( ; pos > 0 && out[pos - 1].ns < slow_calls[i].ns; --pos ) {
+            if ( pos < max ) {
+                out[pos] = out[pos - 1];
+            }
+        }
+        if ( pos < max ) {
+            out[pos] = slow_calls[i];
+            if ( num < max ) {
+                ++num;
+            }
+        }
+    }
+    __atomic_store_n(&slow_lock, 0, __ATOMIC_RELEASE);
+
+    return num;
+}
+
+static void slow_report(int fd) {
+    char buf[LOG_BUFSIZE];
+    malloc_stat_slow_call top[MALLOC_STAT_SLOW_CALLS];
+    size_t num = malloc_stat_get_slow_calls(top, MALLOC_STAT_SLOW_CALLS);
+
+    int s = snprintf(buf, sizeof(buf), "# SLOW threshold %" PRIu64 " ns calls", slow_threshold_ns);
+    for ( uint32_t k = 0; k < MALLOC_STAT_LATENCY_KINDS; ++k ) {
+        uint64_t calls = MALLOC_STAT_ATOMIC_LOAD(slow_counts[k]);
+        if ( calls ) {
+            s += snprintf(buf + s, sizeof(buf) - s, " %s:%" PRIu64, latency_names[k], calls);
+        }
+    }
+    s += snprintf(buf + s, sizeof(buf) - s, "\n");
+    log_write(fd, buf, s);
+
+    for ( size_t i = 0; i < num; ++i ) {
+        s = slow_format(buf, sizeof(buf), &top[i]);
+        log_write(fd, buf, s);
+
+        /* the frames are resolved by the report only, the calls are logged on the allocation path */
+        for ( uint32_t k = 0; symbolize_enabled && k < top[i].nframes; ++k ) {
+            s = snprintf(buf, sizeof(buf), "# SLOW frame %p\n", top[i].frames[k]);
+            s = symbol_append(buf, s, sizeof(buf), top[i].frames[k]);
+            log_write(fd, buf, s);
+        }
+    }
+}
+
+/* the keys of the lock-free tables of the blocks */
+#define MALLOC_STAT_SLOT_EMPTY ((uintptr_t)0)
+#define MALLOC_STAT_SLOT_TOMB  ((uintptr_t)1)
+#define MALLOC_STAT_SLOT_BUSY  ((uintptr_t)2)
+#define MALLOC_STAT_NO_SLOT    UINT32_MAX
+
+static inline uint32_t ptr_hash(uintptr_t p) {
+    p ^= p >> 33;
+    p *= 0xff51afd7ed558ccdull;
+    p ^= p >> 33;
+
+    return (uint32_t)p;
+}
+
+/* modules part
+ *
+ * every call is attributed to the module (the executable or a shared
+ * object) holding its return address. the address is looked up in the
+ * table of the module ranges sorted by the address, built by
+ * dl_iterate_phdr() and guarded by a sequence counter, and each thread
+ * caches the range of its last hit.
+ *
+ * the C and C++ runtime libraries (libc, libstdc++, ...) allocate on
+ * behalf of their callers, e.g. operator new and strdup(), so a call
+ * coming from one of them is attributed to the first module out of them
+ * on the stack, which takes a backtrace. the slot of the allocating
+ * module is stored for every live block in a lock-free table like the
+ * blocks table of the collectors, and the free is accounted to it. a
+ * block not stored, the table being full, is accounted to `[unknown]`
+ * for both, and so are the frees of the blocks allocated before the
+ * accounting was turned on.
+ *
+ * the loader is never called on the allocation path. dlopen() and
+ * dlclose() are wrapped to rebuild the table, which bumps the sequence
+ * counter. a miss asks _dl_find_object(), which does not take the loader
+ * lock, for the modules not in the table yet, e.g. the ones whose
+ * constructors allocate inside dlopen() or the ones loaded by libc
+ * itself. the table is collected aside and only copied under the
+ * sequence counter, so the lookups never wait for the loader lock. a
+ * thread also caches its last address out of any module until the table
+ * is rebuilt.
+ */
+
+typedef struct {
+    uint64_t allocations;
+    uint64_t allocated;
+    uint64_t requested;
+    uint64_t deallocations;
+    uint64_t deallocated;
+    int64_t in_use; /* the blocks allocated before a reset make it negative */
+    int64_t peak_in_use;
+} __attribute__((aligned(MALLOC_STAT_CACHE_LINE))) malloc_stat_module_vars;
+
+typedef struct {
+    uintptr_t begin;
+    uintptr_t end;
+    uint32_t slot;
+} malloc_stat_module_range;
+
+static int modules_enabled = 0;
+
+/* the slot 0 holds the calls from the addresses out of any module */
+static char module_paths[MALLOC_STAT_MODULES][MALLOC_STAT_MODULE_PATH];
+static uintptr_t module_bases[MALLOC_STAT_MODULES];
+static malloc_stat_module_vars module_vars[MALLOC_STAT_MODULES];
+static uint32_t module_slots = 0;
+/* the slot is of a runtime library, its calls are attributed to its caller */
+static bool module_runtime[MALLOC_STAT_MODULES];
+
+/* the slot of the allocating module of each live block, mapped when the
+ * accounting is turned on for the first time */
+static uint32_t module_blocks_size = MALLOC_STAT_MODULE_BLOCKS;
+static uintptr_t *module_block_keys = NULL;
+static uint16_t *module_block_slots = NULL;
+static uint64_t module_blocks_dropped = 0;
+
+/* odd while the ranges are being copied */
+static uint64_t module_seq = 0;
+static malloc_stat_module_range module_ranges[MALLOC_STAT_MODULES];
+static uint32_t module_nranges = 0;
+/* guards the slots and the copying, never held across the loader calls */
+static int module_lock = 0;
+/* the refreshes started and the last one copied, an older one is dropped */
+static uint64_t module_refreshes = 0;
+static uint64_t module_published = 0;
+static char module_exe[MALLOC_STAT_MODULE_PATH];
+
+/* the range of the last hit of the thread, valid while module_seq is not changed */
+static __thread uintptr_t module_cache_begin __attribute__((tls_model("initial-exec"))) = 0;
+static __thread uintptr_t module_cache_end __attribute__((tls_model("initial-exec"))) = 0;
+static __thread uint32_t module_cache_slot __attribute__((tls_model("initial-exec"))) = 0;
+static __thread uint64_t module_cache_seq __attribute__((tls_model("initial-exec"))) = 0;
+/* the last address of the thread out of any module, valid while module_seq is not changed */
+static __thread uintptr_t module_miss_addr __attribute__((tls_model("initial-exec"))) = 0;
+static __thread uint64_t module_miss_seq __attribute__((tls_model("initial-exec"))) = 1;
+
+/* the ranges collected by dl_iterate_phdr() before they are copied into the table */
+typedef struct {
+    malloc_stat_module_range ranges[MALLOC_STAT_MODULES];
+    uintptr_t bases[MALLOC_STAT_MODULES];
+    uint32_t nranges;
+} malloc_stat_module_scratch;
+
+static inline void module_lock_acquire(void) {
+    while ( __atomic_exchange_n(&module_lock, 1, __ATOMIC_ACQUIRE) ) {
+        sched_yield();
+    }
+}
+
+static inline void module_lock_release(void) {
+    __atomic_store_n(&module_lock, 0, __ATOMIC_RELEASE);
+}
+
+/* the file names of the runtime libraries */
+static const char *const module_runtimes[] = {
+     "libc.so", "libstdc++.so", "libc++.so", "libc++abi.so", "libgcc_s.so", "ld-linux"
+};
+
+static bool module_is_runtime(const char *path) {
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+
+    for ( size_t i = 0; i < sizeof(module_runtimes) / sizeof(module_runtimes[0]); ++i ) {
+        if ( strncmp(name, module_runtimes[i], myStrlen(module_runtimes[i])) == 0 ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static uint32_t module_slot(const char *path) {
+    module_lock_acquire();
+    uint32_t i = 1;
+    for ( ; i < module_slots && strcmp(module_paths[i], path) != 0; ++i )
+    {}
+    if ( i == module_slots ) {
+        if ( module_slots == MALLOC_STAT_MODULES ) {
+            module_lock_release();
+            return 0;
+        }
+        size_t len = myStrlen(path);
+        len = len < MALLOC_STAT_MODULE_PATH - 1 ? len : MALLOC_STAT_MODULE_PATH - 1;
+        memcpy(module_paths[i], path, len);
+        module_paths[i][len] = '\0';
+        module_runtime[i] = module_is_runtime(module_paths[i]);
+        __atomic_store_n(&module_slots, i + 1, __ATOMIC_RELEASE);
+    }
+    module_lock_release();
+
+    return i;
+}
+
+static int module_range_cb(struct dl_phdr_info *info, size_t size, void *data) {
+    (void)size;
+    malloc_stat_module_scratch *sc = (malloc_stat_module_scratch *)data;
+    uintptr_t begin, end;
+
+    phdr_range(info, &begin, &end);
+    if ( begin >= end || sc->nranges == MALLOC_STAT_MODULES ) {
+        return 0;
+    }
+
+    /* the executable is the first one and has no name */
+    const char *path = info->dlpi_name[0] ? info->dlpi_name : module_exe;
+    uint32_t pos = sc->nranges++;
+    for ( ; pos > 0 && sc->ranges[pos - 1].begin > begin; --pos ) {
+        sc->ranges[pos] = sc->ranges[pos - 1];
+    }
+    sc->ranges[pos].begin = begin;
+    sc->ranges[pos].end = end;
+    sc->ranges[pos].slot = module_slot(path);
+    sc->bases[sc->ranges[pos].slot] = info->dlpi_addr;
+
+    return 0;
+}
+
+static void modules_refresh(void) {
+    /* mapped zeroed, too big for the stack of the allocating thread */
+    malloc_stat_module_scratch *sc = mmap(NULL, sizeof(*sc), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( sc == MAP_FAILED ) {
+        return;
+    }
+
+    uint64_t ticket = __atomic_add_fetch(&module_refreshes, 1, __ATOMIC_RELAXED);
+    dl_iterate_phdr(module_range_cb, sc);
+
+    module_lock_acquire();
+    if ( ticket > module_published ) {
+        module_published = ticket;
+        __atomic_store_n(&module_seq, module_seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        for ( uint32_t i = 1; i < MALLOC_STAT_MODULES; ++i ) {
+            module_bases[i] = sc->bases[i];
+        }
+        memcpy(module_ranges, sc->ranges, sc->nranges * sizeof(sc->ranges[0]));
+        module_nranges = sc->nranges;
+
+        __atomic_store_n(&module_seq, module_seq + 1, __ATOMIC_RELEASE);
+    }
+    module_lock_release();
+
+    munmap(sc, sizeof(*sc));
+}
+
+/* the slot of a module out of the table, 0 if the loader does not know it either */
+static uint32_t module_loaded(uintptr_t addr, uint64_t seq) {
+#if __GLIBC_PREREQ(2, 35)
+    struct dl_find_object fo;
+    if ( _dl_find_object((void *)addr, &fo) != 0 || !fo.dlfo_link_map ) {
+        return 0;
+    }
+
+    const char *path = fo.dlfo_link_map->l_name[0] ? fo.dlfo_link_map->l_name : module_exe;
+    uint32_t slot = module_slot(path);
+    if ( slot && !module_bases[slot] ) {
+        module_bases[slot] = fo.dlfo_link_map->l_addr;
+    }
+    module_cache_begin = (uintptr_t)fo.dlfo_map_start;
+    module_cache_end = (uintptr_t)fo.dlfo_map_end;
+    module_cache_slot = slot;
+    module_cache_seq = seq;
+
+    return slot;
+#else
+    (void)addr;
+    (void)seq;
+
+    return 0;
+#endif
+}
+
+/* the slot of the module holding the address, 0 if there is none */
+static uint32_t module_find(uintptr_t addr) {
+    for ( ;; ) {
+        uint64_t seq = __atomic_load_n(&module_seq, __ATOMIC_ACQUIRE);
+        if ( seq & 1 ) {
+            sched_yield();
+            continue;
+        }
+
+        uint32_t lo = 0, hi = module_nranges, slot = 0;
+        uintptr_t begin = 0, end = 0;
+        while ( lo < hi ) {
+            uint32_t mid = (lo + hi) / 2;
+            if ( addr < module_ranges[mid].begin ) {
+                hi = mid;
+            } else if ( addr >= module_ranges[mid].end ) {
+                lo = mid + 1;
+            } else {
+                begin = module_ranges[mid].begin;
+                end = module_ranges[mid].end;
+                slot = module_ranges[mid].slot;
+                break;
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ( __atomic_load_n(&module_seq, __ATOMIC_RELAXED) != seq ) {
+            continue;
+        }
+        if ( begin < end ) {
+            module_cache_begin = begin;
+            module_cache_end = end;
+            module_cache_slot = slot;
+            module_cache_seq = seq;
+
+            return slot;
+        }
+        if ( (slot = module_loaded(addr, seq)) ) {
+            return slot;
+        }
+        module_miss_addr = addr;
+        module_miss_seq = seq;
+
+        return 0;
+    }
+}
+
+static inline uint32_t module_of(void *caller) {
+    uintptr_t addr = (uintptr_t)caller;
+    uint64_t seq = __atomic_load_n(&module_seq, __ATOMIC_ACQUIRE);
+    if ( module_cache_seq == seq
+        && addr - module_cache_begin < module_cache_end - module_cache_begin )
+    {
+        return module_cache_slot;
+    }
+    /* the table is rebuilt by dlopen() and dlclose(), the address may be taken by a module then */
+    if ( module_miss_seq == seq && addr == module_miss_addr ) {
+        return 0;
+    }
+
+    return module_find(addr);
+}
+
+/* the first module out of the runtime libraries on the stack of the caller */
+static uint32_t module_caller(uint32_t slot) {
+    /* backtrace() loads libgcc_s on its first call, which calls malloc() */
+    if ( in_trace ) {
+        return slot;
+    }
+
+    void *frames[MALLOC_STAT_MODULE_FRAMES];
+    in_trace = 1;
+    int nptrs = backtrace_capture(frames, MALLOC_STAT_MODULE_FRAMES);
+    in_trace = 0;
+
+    for ( int i = 0; i < nptrs; ++i ) {
+        uint32_t s = module_of(frames[i]);
+        if ( !module_runtime[s] ) {
+            return s;
+        }
+    }
+
+    return slot;
+}
+
+/* stores the slot of the block, false if the table is full */
+static bool module_block_add(uintptr_t ptr, uint32_t slot) {
+    uint32_t mask = module_blocks_size - 1;
+    uint32_t idx = ptr_hash(ptr) & mask;
+
+    for ( int i = 0; i < MALLOC_STAT_PROBE_LIMIT; ++i, idx = (idx + 1) & mask ) {
+        uintptr_t key = __atomic_load_n(&module_block_keys[idx], __ATOMIC_ACQUIRE);
+        /* the key equal to the pointer is a stale one, so is reused too */
+        if ( key == MALLOC_STAT_SLOT_EMPTY || key == MALLOC_STAT_SLOT_TOMB || key == ptr ) {
+            if ( __atomic_compare_exchange_n(&module_block_keys[idx], &key, MALLOC_STAT_SLOT_BUSY
+                ,false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) )
+            {
+                module_block_slots[idx] = (uint16_t)slot;
+                __atomic_store_n(&module_block_keys[idx], ptr, __ATOMIC_RELEASE);
+
+                return true;
+            }
+        }
+    }
+
+    __atomic_add_fetch(&module_blocks_dropped, 1, __ATOMIC_RELAXED);
+
+    return false;
+}
+
+/* removes the block, returns the slot of its allocating module, 0 if it's not stored */
+static uint32_t module_block_take(uintptr_t ptr) {
+    uint32_t mask = module_blocks_size - 1;
+    uint32_t idx = ptr_hash(ptr) & mask;
+
+    for ( int i = 0; i < MALLOC_STAT_PROBE_LIMIT; ++i, idx = (idx + 1) & mask ) {
+        uintptr_t key = __atomic_load_n(&module_block_keys[idx], __ATOMIC_ACQUIRE);
+        if ( key == MALLOC_STAT_SLOT_EMPTY ) {
+            break;
+        }
+        if ( key == ptr ) {
+            if ( __atomic_compare_exchange_n(&module_block_keys[idx], &key, MALLOC_STAT_SLOT_BUSY
+                ,false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) )
+            {
+                uint32_t slot = module_block_slots[idx];
+                __atomic_store_n(&module_block_keys[idx], MALLOC_STAT_SLOT_TOMB, __ATOMIC_RELEASE);
+
+                return slot;
+            }
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static void module_alloc(size_t size, size_t requested, void *caller, void *ptr) {
+    uint32_t slot = module_of(caller);
+    if ( module_runtime[slot] ) {
+        slot = module_caller(slot);
+    }
+    /* the free of a block not stored is accounted to [unknown] */
+    if ( ptr && !module_block_add((uintptr_t)ptr, slot) ) {
+        slot = 0;
+    }
+    malloc_stat_module_vars *v = &module_vars[slot];
+
+    __atomic_add_fetch(&v->allocations, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&v->allocated, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&v->requested, requested, __ATOMIC_RELAXED);
+    int64_t in_use = __atomic_add_fetch(&v->in_use, (int64_t)size, __ATOMIC_RELAXED);
+    for ( int64_t peak = __atomic_load_n(&v->peak_in_use, __ATOMIC_RELAXED); peak < in_use; ) {
+        if ( __atomic_compare_exchange_n(&v->peak_in_use, &peak, in_use, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+            break;
+        }
+    }
+}
+
+/* accounted to the allocating module of the block, free(NULL) to the caller */
+static void module_free(size_t size, void *ptr, void *caller) {
+    uint32_t slot = ptr ? module_block_take((uintptr_t)ptr) : module_of(caller);
+    malloc_stat_module_vars *v = &module_vars[slot];
+
+    __atomic_add_fetch(&v->deallocations, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&v->deallocated, size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&v->in_use, (int64_t)size, __ATOMIC_RELAXED);
+}
+
+#define MALLOC_STAT_MODULE_ALLOC(size, requested, caller, ptr) \
+    if ( modules_enabled ) { \
+        module_alloc(size, requested, caller, ptr); \
+    }
+
+/* must be called before the block is passed to the real function */
+#define MALLOC_STAT_MODULE_FREE(size, ptr, caller) \
+    if ( modules_enabled ) { \
+        module_free(size, ptr, caller); \
+    }
+
+static void modules_reset(void) {
+    for ( uint32_t i = 0; i < MALLOC_STAT_MODULES; ++i ) {
+        memset(&module_vars[i], 0, sizeof(module_vars[i]));
+    }
+}
+
+int malloc_stat_set_modules(int on) {
+    int prev = modules_enabled;
+
+    /* dl_iterate_phdr() can't be called before the real functions are resolved */
+    if ( init_done != LOG_MALLOC_INIT_DONE ) {
+        return prev;
+    }
+    if ( on && !module_block_keys ) {
+        size_t keys_bytes = module_blocks_size * sizeof(*module_block_keys);
+        char *p = mmap(NULL, keys_bytes + module_blocks_size * sizeof(*module_block_slots)
+            ,PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if ( p == MAP_FAILED ) {
+            return prev;
+        }
+        module_block_slots = (uint16_t *)(p + keys_bytes);
+        module_block_keys = (uintptr_t *)p;
+    }
+    if ( on && !module_slots ) {
+        ssize_t len = readlink("/proc/self/exe", module_exe, sizeof(module_exe) - 1);
+        module_exe[len > 0 ? len : 0] = '\0';
+        memcpy(module_paths[0], "[unknown]", 10);
+        module_slots = 1;
+        modules_refresh();
+    }
+    modules_enabled = on;
+
+    return prev;
+}
+
+size_t malloc_stat_get_modules(malloc_stat_module *out, size_t max) {
+    uint32_t slots = __atomic_load_n(&module_slots, __ATOMIC_ACQUIRE);
+    size_t num = 0;
+
+    for ( uint32_t i = 0; i < slots; ++i ) {
+        const malloc_stat_module_vars *v = &module_vars[i];
+        malloc_stat_module m;
+        m.stat.allocations = MALLOC_STAT_ATOMIC_LOAD(v->allocations);
+        m.stat.deallocations = MALLOC_STAT_ATOMIC_LOAD(v->deallocations);
+        if ( !m.stat.allocations && !m.stat.deallocations ) {
+            continue;
+        }
+        int64_t in_use = MALLOC_STAT_ATOMIC_LOAD(v->in_use);
+        m.stat.allocated = MALLOC_STAT_ATOMIC_LOAD(v->allocated);
+        m.stat.deallocated = MALLOC_STAT_ATOMIC_LOAD(v->deallocated);
+        m.stat.requested = MALLOC_STAT_ATOMIC_LOAD(v->requested);
+        m.stat.in_use = in_use_bytes(in_use);
+        m.stat.peak_in_use = (uint64_t)MALLOC_STAT_ATOMIC_LOAD(v->peak_in_use);
+        m.base = (void *)module_bases[i];
+        memcpy(m.path, module_paths[i], sizeof(m.path));
+
+        /* insertion into the output ordered by the bytes in use */
+        size_t pos = num;
+        for ( ; pos > 0 && out[pos - 1].stat.in_use < m.stat.in_use; --pos ) {
+            if ( pos < max ) {
+                out[pos] = out[pos - 1];
+            }
+        }
+        if ( pos < max ) {
+            out[pos] = m;
+            if ( num < max ) {
+                ++num;
+            }
+        }
+    }
+
+    return num;
+}
+
+static void modules_report(int fd) {
+    char buf[LOG_BUFSIZE];
+    malloc_stat_module top[MALLOC_STAT_MODULES_REPORT];
+    size_t num = malloc_stat_get_modules(top, MALLOC_STAT_MODULES_REPORT);
+
+    /* the blocks accounted to [unknown] because the table was full */
+    uint64_t dropped = MALLOC_STAT_ATOMIC_LOAD(module_blocks_dropped);
+    if ( dropped ) {
+        int s = snprintf(buf, sizeof(buf), "# MODULES blocks %u dropped %" PRIu64 "\n", module_blocks_size, dropped);
+        log_write(fd, buf, s);
+    }
+
+    for ( size_t i = 0; i < num; ++i ) {
+        const malloc_stat_vars *v = &top[i].stat;
+        int s = snprintf(buf, sizeof(buf)
+            ,"# MODULE %s allocs %" PRIu64 " bytes %" PRIu64 " frees %" PRIu64 " bytes %" PRIu64
+             " in_use %" PRIu64 " peak %" PRIu64 "\n"
+            ,top[i].path, v->allocations, v->allocated, v->deallocations, v->deallocated
+            ,v->in_use, v->peak_in_use
+        );
+        log_write(fd, buf, s);
+    }
+}
+
+/* collectors part
+ *
+ * every N-th allocation of a thread is sampled and stored in the blocks
+ * table together with the allocation site and the time. the tables are
+ * mmap()ed when a collector is enabled for the first time, so no malloc()
+ * is needed. the blocks table is lock-free: a slot is claimed by CAS-ing
+ * its key to BUSY, filled and then published with the pointer as the key.
+ * freed slots become TOMBs which are never turned back into EMPTY, so
+ * a lookup may stop on the first EMPTY slot.
+ */
+
+#define MALLOC_STAT_LIFETIME_BUCKETS 40
+
+/* every field but `addr` is a uint64_t counter, see sites_reset() */
+typedef struct {
+    void *addr;      /* the return address, NULL for unknown/overflowed */
+    uint64_t calls;  /* sampled allocations */
+    uint64_t bytes;  /* requested bytes of them */
+    uint64_t usable; /* usable bytes of them */
+    uint64_t min_size;
+    uint64_t max_size;
+    uint64_t freed;  /* sampled blocks freed */
+    uint64_t short_lived;
+    uint64_t lifetime[MALLOC_STAT_LIFETIME_BUCKETS]; /* log2(ns) histogram */
+    uint64_t chains;      /* sampled blocks grown by realloc() at least once */
+    uint64_t grows;       /* realloc() calls which grew them */
+    uint64_t max_grows;   /* the longest chain */
+    uint64_t copied;      /* bytes copied by the moving realloc() calls */
+    uint64_t chains_done; /* chains ended by free() */
+    uint64_t first_bytes; /* initial sizes of the ended chains */
+    uint64_t final_bytes; /* final sizes of the ended chains */
+    uint64_t remote_frees; /* freed by another thread */
+    uint64_t remote_bytes;
+    uint64_t class_remote[MALLOC_STAT_SIZE_CLASSES];
+} malloc_stat_site;
+
+typedef struct {
+    uint32_t site;   /* index in the sites table */
+    uint32_t tid;    /* allocating thread */
+    uint64_t size;   /* requested size */
+    uint64_t ts;     /* allocation time, ns */
+    uint64_t events; /* allocations of the thread made before this one */
+    uint64_t first_size; /* requested size before the first realloc() */
+    uint32_t grows;  /* realloc() calls which grew the block */
+    uint32_t node;   /* the NUMA node of the allocating CPU */
+    uint32_t epoch;  /* collect_epoch at the allocation */
+} malloc_stat_block;
+
+/* the collectors working on the sampled blocks, the size classes histogram does not */
+#define MALLOC_STAT_COLLECT_BLOCKS (~MALLOC_STAT_COLLECT_CLASSES)
+
+/* bumped each time some collectors are enabled, a collector takes only the
+ * blocks allocated since it was enabled the last time, so a block left from
+ * the previous session, or allocated while the collector was off, is skipped.
+ */
+static uint32_t collect_epoch = 0;
+static uint32_t collector_epochs[32];
+
+/* every N-th allocation of a thread is sampled */
+static uint32_t sample_rate = 1;
+
+/* the churn window */
+static uint64_t churn_window_ns = MALLOC_STAT_CHURN_WINDOW_NS;
+static uint64_t churn_window_events = MALLOC_STAT_CHURN_WINDOW_EVENTS;
+
+/* the time the collectors were enabled or reset */
+static uint64_t collect_start_ns = 0;
+
+/* the tables sizes, can not be changed after the tables are mapped */
+static uint32_t blocks_size = MALLOC_STAT_BLOCKS_SIZE;
+static uint32_t sites_size = MALLOC_STAT_SITES_SIZE;
+
+/* 0 - not mapped, 1 - mapping in progress, 2 - ready */
+static int tables_state = 0;
+static uintptr_t *block_keys = NULL;
+static malloc_stat_block *blocks = NULL;
+static malloc_stat_site *sites = NULL;
+static uint64_t blocks_dropped = 0;
+
+/* the cross-thread frees */
+#define MALLOC_STAT_XTHREAD_PAIRS 256
+
+typedef struct {
+    uint64_t key; /* (alloc tid << 32 | free tid), 0 for free slot */
+    uint64_t frees;
+    uint64_t bytes;
+} malloc_stat_xthread_slot;
+
+static malloc_stat_xthread_vars xthread_vars;
+static malloc_stat_xthread_slot xthread_pairs[MALLOC_STAT_XTHREAD_PAIRS];
+
+/* per-thread sampling countdown and allocations counter */
+static __thread uint32_t sample_countdown = 0;
+static __thread uint64_t thread_allocations = 0;
+
+#define MALLOC_STAT_COLLECT_ALLOC(ptr, size, caller) \
+    if ( (collectors & MALLOC_STAT_COLLECT_BLOCKS) && ptr && !in_trace ) { \
+        collect_alloc(ptr, size, caller); \
+    }
+
+#define MALLOC_STAT_COLLECT_FREE(ptr) \
+    if ( (collectors & MALLOC_STAT_COLLECT_BLOCKS) && !in_trace ) { \
+        collect_free(ptr); \
+    }
+
+static inline uint32_t size_class(uint64_t size) {
+    if ( size <= 16 ) {
+        return 0;
+    }
+
+    uint32_t c = 64 - __builtin_clzll(size - 1) - 4;
+
+    return c < MALLOC_STAT_SIZE_CLASSES ? c : MALLOC_STAT_SIZE_CLASSES - 1;
+}
+
+static int tables_init(void) {
+    int state = 0;
+    if ( !__atomic_compare_exchange_n(&tables_state, &state, 1
+        ,false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE) )
+    {
+        while ( state == 1 ) {
+            sched_yield();
+            state = __atomic_load_n(&tables_state, __ATOMIC_ACQUIRE);
+        }
+
+        return state == 2;
+    }
+
+    size_t keys_bytes = blocks_size * sizeof(*block_keys);
+    size_t blocks_bytes = blocks_size * sizeof(*blocks);
+    size_t sites_bytes = sites_size * sizeof(*sites);
+    char *p = mmap(NULL, keys_bytes + blocks_bytes + sites_bytes
+        ,PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if ( p == MAP_FAILED ) {
+        __atomic_store_n(&tables_state, 0, __ATOMIC_RELEASE);
+
+        return 0;
+    }
+
+    block_keys = (uintptr_t *)p;
+    blocks = (malloc_stat_block *)(p + keys_bytes);
+    sites = (malloc_stat_site *)(p + keys_bytes + blocks_bytes);
+    sites[0].min_size = UINT64_MAX;
+    __atomic_store_n(&tables_state, 2, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/* returns the index of the site, 0 if the table is full */
+static uint32_t site_find(void *addr) {
+    uint32_t mask = sites_size - 1;
+    uint32_t idx = ptr_hash((uintptr_t)addr) & mask;
+
+    for ( int i = 0; i < MALLOC_STAT_PROBE_LIMIT; ++i, idx = (idx + 1) & mask ) {
+        if ( idx == 0 ) {
+            continue;
+        }
+
+        void *cur = __atomic_load_n(&sites[idx].addr, __ATOMIC_ACQUIRE);
+        if ( cur == addr ) {
+            return idx;
+        }
+        if ( !cur ) {
+            /* min_size must be set before any update of the site */
+            uint64_t min = 0;
+            __atomic_compare_exchange_n(&sites[idx].min_size, &min, UINT64_MAX
+                ,false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            if ( __atomic_compare_exchange_n(&sites[idx].addr, &cur, addr
+                ,false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE) )
+            {
+                return idx;
+            }
+            if ( cur == addr ) {
+                return idx;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* claims a slot for the pointer, the slot key is left BUSY */
+static uint32_t block_claim(uintptr_t ptr) {
+    uint32_t mask = blocks_size - 1;
+    uint32_t idx = ptr_hash(ptr) & mask;
+
+    for ( int i = 0; i < MALLOC_STAT_PROBE_LIMIT; ++i, idx = (idx + 1) & mask ) {
+        uintptr_t key = __atomic_load_n(&block_keys[idx], __ATOMIC_ACQUIRE);
+        /* the key equal to the pointer is a stale one, so is reused too */
+        if ( key == MALLOC_STAT_SLOT_EMPTY || key == MALLOC_STAT_SLOT_TOMB || key == ptr ) {
+            if ( __atomic_compare_exchange_n(&block_keys[idx], &key, MALLOC_STAT_SLOT_BUSY
+                ,false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) )
+            {
+                return idx;
+            }
+        }
+    }
+
+    __atomic_add_fetch(&blocks_dropped, 1, __ATOMIC_RELAXED);
+
+    return MALLOC_STAT_NO_SLOT;
+}
+
+/* finds the slot of the pointer and makes it BUSY */
+static uint32_t block_detach(uintptr_t ptr) {
+    uint32_t mask = blocks_size - 1;
+    uint32_t idx = ptr_hash(ptr) & mask;
+
+    for ( int i = 0; i < MALLOC_STAT_PROBE_LIMIT; ++i, idx = (idx + 1) & mask ) {
+        uintptr_t key = __atomic_load_n(&block_keys[idx], __ATOMIC_ACQUIRE);
+        if ( key == MALLOC_STAT_SLOT_EMPTY ) {
+            break;
+        }
+        if ( key == ptr ) {
+            if ( __atomic_compare_exchange_n(&block_keys[idx], &key, MALLOC_STAT_SLOT_BUSY
+                ,false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) )
+            {
+                return idx;
+            }
+            break;
+        }
+    }
+
+    return MALLOC_STAT_NO_SLOT;
+}
+
+static inline void block_publish(uint32_t slot, uintptr_t key) {
+    __atomic_store_n(&block_keys[slot], key, __ATOMIC_RELEASE);
+}
+
+#define MALLOC_STAT_ATOMIC_MIN(var, val) \
+    for ( uint64_t cur = __atomic_load_n(&(var), __ATOMIC_RELAXED); val < cur; ) { \
+        if ( __atomic_compare_exchange_n(&(var), &cur, val, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) \
+            break; \
+    }
+
+#define MALLOC_STAT_ATOMIC_MAX(var, val) \
+    for ( uint64_t cur = __atomic_load_n(&(var), __ATOMIC_RELAXED); val > cur; ) { \
+        if ( __atomic_compare_exchange_n(&(var), &cur, val, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) \
+            break; \
+    }
+
+static void numa_on_alloc(malloc_stat_block *b, uint64_t usable);
+
+/* the collector is enabled and the block was allocated since then */
+static inline bool block_collected(const malloc_stat_block *b, uint32_t collector) {
+    return (collectors & collector)
+        && b->epoch >= __atomic_load_n(&collector_epochs[__builtin_ctz(collector)], __ATOMIC_RELAXED);
+}
+
+static void collect_alloc(void *ptr, size_t size, void *caller) {
+    ++thread_allocations;
+    if ( sample_countdown > 1 ) {
+        --sample_countdown;
+
+        return;
+    }
+    sample_countdown = sample_rate;
+
+    uint32_t slot = block_claim((uintptr_t)ptr);
+    if ( slot == MALLOC_STAT_NO_SLOT ) {
+        return;
+    }
+
+    malloc_stat_block *b = &blocks[slot];
+    b->site = site_find(caller);
+    b->tid = thread_id();
+    b->size = size;
+    b->ts = now_ns();
+    b->events = thread_allocations;
+    b->first_size = size;
+    b->grows = 0;
+    b->node = 0;
+    b->epoch = __atomic_load_n(&collect_epoch, __ATOMIC_RELAXED);
+
+    uint64_t usable = malloc_usable_size(ptr);
+    if ( collectors & MALLOC_STAT_COLLECT_NUMA ) {
+        numa_on_alloc(b, usable);
+    }
+
+    malloc_stat_site *s = &sites[b->site];
+    __atomic_add_fetch(&s->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->bytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->usable, usable, __ATOMIC_RELAXED);
+    MALLOC_STAT_ATOMIC_MIN(s->min_size, size);
+    MALLOC_STAT_ATOMIC_MAX(s->max_size, size);
+
+    block_publish(slot, (uintptr_t)ptr);
+}
+
+static void churn_on_free(const malloc_stat_block *b) {
+    malloc_stat_site *s = &sites[b->site];
+    uint64_t lifetime = now_ns() - b->ts;
+    uint32_t bucket = lifetime ? 64 - __builtin_clzll(lifetime) : 0;
+    if ( bucket >= MALLOC_STAT_LIFETIME_BUCKETS ) {
+        bucket = MALLOC_STAT_LIFETIME_BUCKETS - 1;
+    }
+
+    __atomic_add_fetch(&s->lifetime[bucket], 1, __ATOMIC_RELAXED);
+
+    if ( b->tid != (uint32_t)thread_id() ) {
+        return;
+    }
+    if ( (churn_window_ns && lifetime <= churn_window_ns)
+        || (churn_window_events && thread_allocations - b->events <= churn_window_events) )
+    {
+        __atomic_add_fetch(&s->short_lived, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void realloc_on_grow(malloc_stat_block *b, size_t copied) {
+    malloc_stat_site *s = &sites[b->site];
+    uint64_t grows = ++b->grows;
+
+    if ( grows == 1 ) {
+        __atomic_add_fetch(&s->chains, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&s->grows, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->copied, copied, __ATOMIC_RELAXED);
+    MALLOC_STAT_ATOMIC_MAX(s->max_grows, grows);
+}
+
+static void realloc_on_free(const malloc_stat_block *b) {
+    malloc_stat_site *s = &sites[b->site];
+
+    __atomic_add_fetch(&s->chains_done, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->first_bytes, b->first_size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->final_bytes, b->size, __ATOMIC_RELAXED);
+}
+
+static void xthread_on_free(const malloc_stat_block *b) {
+    uint32_t cls = size_class(b->size);
+    uint32_t tid = thread_id();
+
+    __atomic_add_fetch(&xthread_vars.frees, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&xthread_vars.class_frees[cls], 1, __ATOMIC_RELAXED);
+    if ( b->tid == tid ) {
+        return;
+    }
+
+    __atomic_add_fetch(&xthread_vars.remote_frees, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&xthread_vars.remote_bytes, b->size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&xthread_vars.class_remote_frees[cls], 1, __ATOMIC_RELAXED);
+
+    malloc_stat_site *s = &sites[b->site];
+    __atomic_add_fetch(&s->remote_frees, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->remote_bytes, b->size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->class_remote[cls], 1, __ATOMIC_RELAXED);
+
+    uint64_t key = (uint64_t)b->tid << 32 | tid;
+    uint32_t idx = ptr_hash(key) & (MALLOC_STAT_XTHREAD_PAIRS - 1);
+    for ( int i = 0; i < MALLOC_STAT_PROBE_LIMIT; ++i, idx = (idx + 1) & (MALLOC_STAT_XTHREAD_PAIRS - 1) ) {
+        malloc_stat_xthread_slot *p = &xthread_pairs[idx];
+        uint64_t cur = __atomic_load_n(&p->key, __ATOMIC_RELAXED);
+        if ( !cur && __atomic_compare_exchange_n(&p->key, &cur, key
+            ,false, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+        {
+            cur = key;
+        }
+        if ( cur != key ) {
+            continue;
+        }
+
+        __atomic_add_fetch(&p->frees, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&p->bytes, b->size, __ATOMIC_RELAXED);
+
+        return;
+    }
+
+    /* no free slot within the probe limit */
+    __atomic_add_fetch(&xthread_vars.pairs_dropped, 1, __ATOMIC_RELAXED);
+}
+
+static void collect_free(void *ptr) {
+    uint32_t slot = block_detach((uintptr_t)ptr);
+    if ( slot == MALLOC_STAT_NO_SLOT ) {
+        return;
+    }
+
+    __atomic_add_fetch(&sites[blocks[slot].site].freed, 1, __ATOMIC_RELAXED);
+    if ( block_collected(&blocks[slot], MALLOC_STAT_COLLECT_XTHREAD) ) {
+        xthread_on_free(&blocks[slot]);
+    }
+
+    if ( block_collected(&blocks[slot], MALLOC_STAT_COLLECT_CHURN) ) {
+        churn_on_free(&blocks[slot]);
+    }
+    if ( block_collected(&blocks[slot], MALLOC_STAT_COLLECT_REALLOC) && blocks[slot].grows ) {
+        realloc_on_free(&blocks[slot]);
+    }
+
+    block_publish(slot, MALLOC_STAT_SLOT_TOMB);
+}
+
+/* the block keeps its slot BUSY while real_realloc() is in progress,
+ * so the freed address can not be claimed by another thread meanwhile.
+ */
+static uint32_t collect_realloc_begin(void *ptr) {
+    if ( !(collectors & MALLOC_STAT_COLLECT_BLOCKS) || in_trace ) {
+        return MALLOC_STAT_NO_SLOT;
+    }
+
+    return block_detach((uintptr_t)ptr);
+}
+
+static void collect_realloc_end(uint32_t slot, void *ptr, void *ret, size_t size, size_t old_size) {
+    if ( slot == MALLOC_STAT_NO_SLOT ) {
+        return;
+    }
+    if ( !ret ) {
+        block_publish(slot, (uintptr_t)ptr);
+
+        return;
+    }
+
+    malloc_stat_block *b = &blocks[slot];
+    if ( block_collected(b, MALLOC_STAT_COLLECT_REALLOC) && size > b->size ) {
+        /* the moving realloc() copies the old content, estimated by the usable size */
+        realloc_on_grow(b, ret == ptr ? 0 : (old_size < size ? old_size : size));
+    }
+    b->size = size;
+    if ( ret == ptr ) {
+        block_publish(slot, (uintptr_t)ret);
+
+        return;
+    }
+
+    uint32_t moved = block_claim((uintptr_t)ret);
+    if ( moved != MALLOC_STAT_NO_SLOT ) {
+        blocks[moved] = *b;
+        block_publish(moved, (uintptr_t)ret);
+    }
+    block_publish(slot, MALLOC_STAT_SLOT_TOMB);
+}
+
+/* the blocks freed in the passthrough mode are left in the table, so they
+ * are forgotten when the accounting is turned back on. Other threads may be
+ * claiming the slots meanwhile, so each live key is turned into a TOMB by
+ * CAS, the BUSY slots belong to the calls in flight and are left alone.
+ */
+static void blocks_forget(void) {
+    if ( __atomic_load_n(&tables_state, __ATOMIC_ACQUIRE) != 2 ) {
+        return;
+    }
+    for ( uint32_t i = 0; i < blocks_size; ++i ) {
+        uintptr_t key = __atomic_load_n(&block_keys[i], __ATOMIC_RELAXED);
+        if ( key > MALLOC_STAT_SLOT_BUSY ) {
+            __atomic_compare_exchange_n(&block_keys[i], &key, MALLOC_STAT_SLOT_TOMB
+                ,false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void leak_reset(void);
+
+/* the counters follow `addr` and are all uint64_t */
+#define MALLOC_STAT_SITE_COUNTERS \
+    ((sizeof(malloc_stat_site) - offsetof(malloc_stat_site, calls)) / sizeof(uint64_t))
+
+/* zeroes the counters only, `addr` is left as is since the allocating
+ * threads keep claiming the sites meanwhile */
+static void sites_reset(void) {
+    for ( uint32_t i = 0; i < sites_size; ++i ) {
+        malloc_stat_site *s = &sites[i];
+        uint64_t *counters = &s->calls;
+        for ( size_t k = 0; k < MALLOC_STAT_SITE_COUNTERS; ++k ) {
+            __atomic_store_n(&counters[k], 0, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&s->min_size, UINT64_MAX, __ATOMIC_RELAXED);
+    }
+    /* the samples of the sites describe the dropped blocks */
+    leak_reset();
+}
+
+static uint64_t site_median_lifetime(const malloc_stat_site *s) {
+    uint64_t half = (s->freed + 1) / 2;
+    uint64_t cum = 0;
+    for ( uint32_t b = 0; b < MALLOC_STAT_LIFETIME_BUCKETS; ++b ) {
+        uint64_t cnt = s->lifetime[b];
+        if ( cnt && cum + cnt >= half ) {
+            uint64_t lo = b ? 1ull << (b - 1) : 0;
+            uint64_t hi = 1ull << b;
+
+            return lo + (hi - lo) * (half - cum) / cnt;
+        }
+        cum += cnt;
+    }
+
+    return 0;
+}
+
+/* the site is flagged when most of its freed blocks are short-lived */
+static inline bool site_is_churning(const malloc_stat_site *s) {
+    return s->short_lived && s->short_lived * 2 >= s->freed;
+}
+
+static void churn_fill(malloc_stat_churn_site *out, const malloc_stat_site *s, uint64_t elapsed_ns) {
+    out->site = s->addr;
+    out->calls = s->calls * sample_rate;
+    out->short_lived = s->short_lived * sample_rate;
+    out->calls_per_sec = elapsed_ns
+        ? (uint64_t)((double)out->calls * 1000000000.0 / elapsed_ns)
+        : 0
+    ;
+    out->median_lifetime_ns = site_median_lifetime(s);
+    out->min_size = s->calls ? s->min_size : 0;
+    out->max_size = s->max_size;
+    out->avg_size = s->calls ? s->bytes / s->calls : 0;
+}
+
+/* fills `idx` with up to `max` indexes of the sites having the biggest
+ * non-zero rank, ordered by the rank. returns the number of filled items.
+ */
+/* fills `idx` with up to `max` sites, capped at MALLOC_STAT_TOP_SITES */
+static size_t sites_top(uint32_t *idx, size_t max, uint64_t (*rank)(const malloc_stat_site *)) {
+    uint64_t ranks[MALLOC_STAT_TOP_SITES];
+    size_t num = 0;
+
+    max = max < MALLOC_STAT_TOP_SITES ? max : MALLOC_STAT_TOP_SITES;
+
+    if ( __atomic_load_n(&tables_state, __ATOMIC_ACQUIRE) != 2 ) {
+        return 0;
+    }
+
+    for ( uint32_t i = 0; i < sites_size; ++i ) {
+        uint64_t r = rank(&sites[i]);
+        if ( !r ) {
+            continue;
+        }
+
+        size_t pos = num;
+        for ( ; pos > 0 && ranks[pos - 1] < r; --pos ) {
+            if ( pos < max ) {
+                ranks[pos] = ranks[pos - 1];
+                idx[pos] = idx[pos - 1];
+            }
+        }
+        if ( pos < max ) {
+            ranks[pos] = r;
+            idx[pos] = i;
+            if ( num < max ) {
+                ++num;
+            }
+        }
+    }
+
+    return num;
+}
+
+static uint64_t churn_rank(const malloc_stat_site *s) {
+    return site_is_churning(s) ? s->calls : 0;
+}
+
+size_t malloc_stat_get_churn(malloc_stat_churn_site *out, size_t max) {
+    uint32_t idx[MALLOC_STAT_TOP_SITES];
+    size_t num = sites_top(idx, max, churn_rank);
+    uint64_t elapsed = now_ns() - collect_start_ns;
+
+    for ( size_t i = 0; i < num; ++i ) {
+        churn_fill(&out[i], &sites[idx[i]], elapsed);
+    }
+
+    return num;
+}
+
+static uint64_t realloc_rank(const malloc_stat_site *s) {
+    return s->chains ? s->copied + 1 : 0;
+}
+
+size_t malloc_stat_get_realloc_chains(malloc_stat_realloc_site *out, size_t max) {
+    uint32_t idx[MALLOC_STAT_TOP_SITES];
+    size_t num = sites_top(idx, max, realloc_rank);
+
+    for ( size_t i = 0; i < num; ++i ) {
+        const malloc_stat_site *s = &sites[idx[i]];
+        out[i].site = s->addr;
+        out[i].chains = s->chains * sample_rate;
+        out[i].grows = s->grows * sample_rate;
+        out[i].max_grows = s->max_grows;
+        out[i].copied = s->copied * sample_rate;
+        out[i].avg_first_size = s->chains_done ? s->first_bytes / s->chains_done : 0;
+        out[i].avg_final_size = s->chains_done ? s->final_bytes / s->chains_done : 0;
+    }
+
+    return num;
+}
+
+static uint64_t slack_rank(const malloc_stat_site *s) {
+    return s->usable > s->bytes ? s->usable - s->bytes : 0;
+}
+
+size_t malloc_stat_get_slack(malloc_stat_slack_site *out, size_t max) {
+    uint32_t idx[MALLOC_STAT_TOP_SITES];
+    size_t num = sites_top(idx, max, slack_rank);
+
+    for ( size_t i = 0; i < num; ++i ) {
+        const malloc_stat_site *s = &sites[idx[i]];
+        out[i].site = s->addr;
+        out[i].calls = s->calls * sample_rate;
+        out[i].requested = s->bytes * sample_rate;
+        out[i].usable = s->usable * sample_rate;
+        out[i].min_size = s->min_size;
+        out[i].max_size = s->max_size;
+    }
+
+    return num;
+}
+
+static uint64_t xthread_rank(const malloc_stat_site *s) {
+    return s->remote_frees;
+}
+
+malloc_stat_xthread_vars malloc_stat_get_xthread(void) {
+    malloc_stat_xthread_vars res = xthread_vars;
+
+    res.frees *= sample_rate;
+    res.remote_frees *= sample_rate;
+    res.remote_bytes *= sample_rate;
+    res.pairs_dropped *= sample_rate;
+    for ( uint32_t i = 0; i < MALLOC_STAT_SIZE_CLASSES; ++i ) {
+        res.class_frees[i] *= sample_rate;
+        res.class_remote_frees[i] *= sample_rate;
+    }
+
+    return res;
+}
+
+size_t malloc_stat_get_xthread_sites(malloc_stat_xthread_site *out, size_t max) {
+    uint32_t idx[MALLOC_STAT_TOP_SITES];
+    size_t num = sites_top(idx, max, xthread_rank);
+
+    for ( size_t i = 0; i < num; ++i ) {
+        const malloc_stat_site *s = &sites[idx[i]];
+        out[i].site = s->addr;
+        out[i].frees = s->freed * sample_rate;
+        out[i].remote_frees = s->remote_frees * sample_rate;
+        out[i].remote_bytes = s->remote_bytes * sample_rate;
+        for ( uint32_t c = 0; c < MALLOC_STAT_SIZE_CLASSES; ++c ) {
+            out[i].class_remote_frees[c] = s->class_remote[c] * sample_rate;
+        }
+    }
+
+    return num;
+}
+
+size_t malloc_stat_get_xthread_pairs(malloc_stat_xthread_pair *out, size_t max) {
+    size_t num = 0;
+
+    for ( uint32_t i = 0; i < MALLOC_STAT_XTHREAD_PAIRS; ++i ) {
+        const malloc_stat_xthread_slot *p = &xthread_pairs[i];
+        if ( !p->frees ) {
+            continue;
+        }
+
+        size_t pos = num;
+        for ( ; pos > 0 && out[pos - 1].frees < p->frees * sample_rate; --pos ) {
+            if ( pos < max ) {
+                out[pos] = out[pos - 1];
+            }
+        }
+        if ( pos < max ) {
+            out[pos].alloc_tid = (uint32_t)(p->key >> 32);
+            out[pos].free_tid = (uint32_t)p->key;
+            out[pos].frees = p->frees * sample_rate;
+            out[pos].bytes = p->bytes * sample_rate;
+            if ( num < max ) {
+                ++num;
+            }
+        }
+    }
+
+    return num;
+}
+
+static void xthread_reset(void) {
+    memset(&xthread_vars, 0, sizeof(xthread_vars));
+    memset(xthread_pairs, 0, sizeof(xthread_pairs));
+}
+
+/* live blocks snapshot
+ */
+
+typedef struct {
+    uintptr_t ptr;
+    uint64_t size;
+    uint32_t tid;
+    uint32_t site;
+    uint32_t node;
+    uint32_t slot; /* the slot of the blocks table, to re-check the block is still live */
+} malloc_stat_live;
+
+typedef struct {
+    malloc_stat_live *items;
+    size_t num;
+    size_t mapped;
+} malloc_stat_snapshot;
+
+/* copies the live sampled blocks of the collector into a mmap()ed array */
+static int live_snapshot(malloc_stat_snapshot *snap, uint32_t collector) {
+    size_t cap = 0;
+
+    snap->items = NULL;
+    snap->num = 0;
+    if ( __atomic_load_n(&tables_state, __ATOMIC_ACQUIRE) != 2 ) {
+        return 0;
+    }
+
+    for ( uint32_t i = 0; i < blocks_size; ++i ) {
+        cap += __atomic_load_n(&block_keys[i], __ATOMIC_RELAXED) > MALLOC_STAT_SLOT_BUSY;
+    }
+    /* the blocks allocated meanwhile */
+    cap += cap / 8 + 64;
+
+    snap->mapped = cap * sizeof(*snap->items);
+    snap->items = mmap(NULL, snap->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( snap->items == MAP_FAILED ) {
+        snap->items = NULL;
+
+        return 0;
+    }
+
+    uint32_t epoch = __atomic_load_n(&collector_epochs[__builtin_ctz(collector)], __ATOMIC_RELAXED);
+    for ( uint32_t i = 0; i < blocks_size && snap->num < cap; ++i ) {
+        uintptr_t key = __atomic_load_n(&block_keys[i], __ATOMIC_ACQUIRE);
+        if ( key <= MALLOC_STAT_SLOT_BUSY || blocks[i].epoch < epoch ) {
+            continue;
+        }
+
+        malloc_stat_live *l = &snap->items[snap->num++];
+        l->ptr = key;
+        l->size = blocks[i].size;
+        l->tid = blocks[i].tid;
+        l->site = blocks[i].site;
+        l->node = blocks[i].node;
+        l->slot = i;
+    }
+
+    return 1;
+}
+
+static void live_release(malloc_stat_snapshot *snap) {
+    if ( snap->items ) {
+        munmap(snap->items, snap->mapped);
+        snap->items = NULL;
+    }
+}
+
+/* heapsort by the address, qsort() may call malloc() */
+static void live_sort(malloc_stat_live *a, size_t n) {
+    for ( size_t start = n / 2, end = n; end > 1; ) {
+        size_t root;
+        if ( start > 0 ) {
+            root = --start;
+        } else {
+            malloc_stat_live t = a[0]; a[0] = a[--end]; a[end] = t;
+            root = 0;
+        }
+
+        for ( size_t child; (child = root * 2 + 1) < end; root = child ) {
+            if ( child + 1 < end && a[child].ptr < a[child + 1].ptr ) {
+                ++child;
+            }
+            if ( a[root].ptr >= a[child].ptr ) {
+                break;
+            }
+            malloc_stat_live t = a[root]; a[root] = a[child]; a[child] = t;
+        }
+    }
+}
+
+/* false sharing detector
+ *
+ * the live sampled blocks are sorted by the address and the cache lines
+ * holding the edges of the blocks allocated by different threads are
+ * counted per pair of the allocation sites. the interior lines of a block
+ * can not be shared, so only the edges are checked.
+ */
+
+#define MALLOC_STAT_FS_PAIRS 1024
+#define MALLOC_STAT_FS_EDGES 16
+
+typedef struct {
+    uint64_t key; /* (site a << 32 | site b) + 1, 0 for free slot */
+    uint64_t lines;
+} malloc_stat_fs_slot;
+
+typedef struct {
+    uintptr_t line;
+    uint32_t tid;
+    uint32_t site;
+} malloc_stat_fs_edge;
+
+static void fs_pair_add(malloc_stat_fs_slot *pairs, uint32_t a, uint32_t b) {
+    uint64_t key = (a < b ? (uint64_t)a << 32 | b : (uint64_t)b << 32 | a) + 1;
+    uint32_t idx = ptr_hash(key) & (MALLOC_STAT_FS_PAIRS - 1);
+
+    for ( int i = 0; i < MALLOC_STAT_FS_PAIRS; ++i, idx = (idx + 1) & (MALLOC_STAT_FS_PAIRS - 1) ) {
+        if ( !pairs[idx].key || pairs[idx].key == key ) {
+            pairs[idx].key = key;
+            ++pairs[idx].lines;
+
+            return;
+        }
+    }
+}
+
+/* checks the edges laying on the same line */
+static uint64_t fs_line(malloc_stat_fs_slot *pairs, const malloc_stat_fs_edge *e, size_t n) {
+    uint64_t seen[MALLOC_STAT_FS_EDGES * MALLOC_STAT_FS_EDGES / 2];
+    size_t nseen = 0;
+
+    for ( size_t i = 0; i < n; ++i ) {
+        for ( size_t j = i + 1; j < n; ++j ) {
+            if ( e[i].tid == e[j].tid ) {
+                continue;
+            }
+
+            /* every site pair is counted once per line */
+            uint32_t a = e[i].site, b = e[j].site;
+            uint64_t key = a < b ? (uint64_t)a << 32 | b : (uint64_t)b << 32 | a;
+            size_t k = 0;
+            for ( ; k < nseen && seen[k] != key; ++k )
+            {}
+            if ( k == nseen ) {
+                seen[nseen++] = key;
+                fs_pair_add(pairs, a, b);
+            }
+        }
+    }
+
+    return nseen != 0;
+}
+
+static size_t false_sharing_scan(malloc_stat_false_sharing *out, size_t max, uint64_t *total_lines) {
+    malloc_stat_snapshot snap;
+    size_t num = 0;
+
+    *total_lines = 0;
+    if ( !live_snapshot(&snap, MALLOC_STAT_COLLECT_FALSE_SHARING) ) {
+        return 0;
+    }
+    live_sort(snap.items, snap.num);
+
+    size_t pairs_size = MALLOC_STAT_FS_PAIRS * sizeof(malloc_stat_fs_slot);
+    malloc_stat_fs_slot *pairs = mmap(NULL, pairs_size, PROT_READ | PROT_WRITE
+        ,MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( pairs == MAP_FAILED ) {
+        live_release(&snap);
+
+        return 0;
+    }
+
+    /* the edges of the consecutive blocks sharing the current line */
+    malloc_stat_fs_edge edges[MALLOC_STAT_FS_EDGES];
+    size_t nedges = 0;
+    for ( size_t i = 0; i <= snap.num; ++i ) {
+        const malloc_stat_live *l = &snap.items[i];
+        uintptr_t first = 0, last = 0;
+        if ( i < snap.num ) {
+            first = l->ptr / MALLOC_STAT_CACHE_LINE;
+            last = (l->ptr + (l->size ? l->size : 1) - 1) / MALLOC_STAT_CACHE_LINE;
+        }
+        if ( nedges && (i == snap.num || edges[0].line != first) ) {
+            *total_lines += fs_line(pairs, edges, nedges);
+            nedges = 0;
+        }
+        if ( i == snap.num ) {
+            break;
+        }
+
+        if ( nedges < MALLOC_STAT_FS_EDGES ) {
+            edges[nedges++] = (malloc_stat_fs_edge){first, l->tid, l->site};
+        }
+        if ( last != first ) {
+            *total_lines += fs_line(pairs, edges, nedges);
+            edges[0] = (malloc_stat_fs_edge){last, l->tid, l->site};
+            nedges = 1;
+        }
+    }
+
+    for ( uint32_t i = 0; i < MALLOC_STAT_FS_PAIRS; ++i ) {
+        const malloc_stat_fs_slot *p = &pairs[i];
+        if ( !p->key ) {
+            continue;
+        }
+
+        size_t pos = num;
+        for ( ; pos > 0 && out[pos - 1].lines < p->lines; --pos ) {
+            if ( pos < max ) {
+                out[pos] = out[pos - 1];
+            }
+        }
+        if ( pos < max ) {
+            out[pos].site_a = sites[(p->key - 1) >> 32].addr;
+            out[pos].site_b = sites[(uint32_t)(p->key - 1)].addr;
+            out[pos].lines = p->lines;
+            if ( num < max ) {
+                ++num;
+            }
+        }
+    }
+
+    munmap(pairs, pairs_size);
+    live_release(&snap);
+
+    return num;
+}
+
+size_t malloc_stat_get_false_sharing(malloc_stat_false_sharing *out, size_t max) {
+    uint64_t lines;
+
+    return false_sharing_scan(out, max, &lines);
+}
+
+static void false_sharing_report(int fd) {
+    char buf[LOG_BUFSIZE];
+    malloc_stat_false_sharing top[32];
+    uint64_t lines;
+    size_t num = false_sharing_scan(top, sizeof(top) / sizeof(top[0]), &lines);
+
+    int s = snprintf(buf, sizeof(buf), "# FALSE-SHARING lines %" PRIu64 "\n", lines);
+    log_write(fd, buf, s);
+
+    for ( size_t i = 0; i < num; ++i ) {
+        s = snprintf(buf, sizeof(buf)
+            ,"# FALSE-SHARING %p %p lines %" PRIu64 "\n"
+            ,top[i].site_a, top[i].site_b, top[i].lines
+        );
+        s = symbol_append(buf, s, sizeof(buf), top[i].site_a);
+        s = symbol_append(buf, s, sizeof(buf), top[i].site_b);
+        log_write(fd, buf, s);
+    }
+}
+
+/* resident scan
+ *
+ * on demand a background thread walks the live sampled blocks of
+ * `resident_min` bytes and more and asks mincore() which of their pages
+ * are resident. the blocks are read from the snapshot, so the hot path is
+ * not involved. a block freed meanwhile usually stays mapped by the
+ * allocator, so it is skipped if its slot of the blocks table does not
+ * hold it anymore once mincore() returned, and by the ENOMEM of mincore()
+ * if it was unmapped. the last finished scan is kept for the API and the
+ * report.
+ */
+
+typedef struct {
+    uint64_t blocks;
+    uint64_t virtual_bytes;
+    uint64_t resident_bytes;
+} malloc_stat_resident_acc;
+
+static uint64_t resident_min = MALLOC_STAT_RESIDENT_MIN;
+
+/* the requests and the finished scans, guarded by resident_mutex */
+static pthread_mutex_t resident_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resident_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t resident_requested = 0;
+static uint64_t resident_done = 0;
+static pid_t resident_pid = 0; /* the process running the scan thread */
+
+/* the result of the last finished scan */
+static uint64_t resident_scanned_min = 0;
+static malloc_stat_resident_site resident_total;
+static malloc_stat_resident_site resident_sites[MALLOC_STAT_RESIDENT_SITES];
+static size_t resident_nsites = 0;
+
+/* the resident bytes of the page range [begin, end) */
+static uint64_t resident_pages(uintptr_t begin, uintptr_t end, uintptr_t page, bool *mapped) {
+    unsigned char vec[1024];
+    uint64_t res = 0;
+
+    while ( begin < end ) {
+        size_t pages = (end - begin) / page;
+        pages = pages < sizeof(vec) ? pages : sizeof(vec);
+        if ( mincore((void *)begin, pages * page, vec) == -1 ) {
+            *mapped = false;
+
+            return 0;
+        }
+        for ( size_t i = 0; i < pages; ++i ) {
+            res += vec[i] & 1;
+        }
+        begin += pages * page;
+    }
+
+    return res * page;
+}
+
+static void resident_scan(uint64_t min_size) {
+    malloc_stat_snapshot snap;
+    malloc_stat_resident_site total = {0}, top[MALLOC_STAT_RESIDENT_SITES];
+    size_t num = 0;
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+
+    if ( !live_snapshot(&snap, MALLOC_STAT_COLLECT_RESIDENT) ) {
+        return;
+    }
+    size_t acc_size = sites_size * sizeof(malloc_stat_resident_acc);
+    malloc_stat_resident_acc *acc = mmap(NULL, acc_size, PROT_READ | PROT_WRITE
+        ,MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( acc == MAP_FAILED ) {
+        live_release(&snap);
+
+        return;
+    }
+
+    for ( size_t i = 0; i < snap.num; ++i ) {
+        const malloc_stat_live *l = &snap.items[i];
+        if ( l->size < min_size || !l->size ) {
+            continue;
+        }
+
+        uintptr_t begin = l->ptr & ~(page - 1);
+        uintptr_t end = (l->ptr + l->size + page - 1) & ~(page - 1);
+        bool mapped = true;
+        uint64_t resident = resident_pages(begin, end, page, &mapped);
+        if ( !mapped || __atomic_load_n(&block_keys[l->slot], __ATOMIC_ACQUIRE) != l->ptr ) {
+            continue;
+        }
+        acc[l->site].blocks += sample_rate;
+        acc[l->site].virtual_bytes += (end - begin) * sample_rate;
+        acc[l->site].resident_bytes += resident * sample_rate;
+    }
+
+    for ( uint32_t i = 0; i < sites_size; ++i ) {
+        const malloc_stat_resident_acc *a = &acc[i];
+        if ( !a->blocks ) {
+            continue;
+        }
+        total.blocks += a->blocks;
+        total.virtual_bytes += a->virtual_bytes;
+        total.resident_bytes += a->resident_bytes;
+
+        /* insertion ordered by the untouched bytes */
+        uint64_t untouched = a->virtual_bytes - a->resident_bytes;
+        size_t pos = num;
+        for ( ; pos > 0 && top[pos - 1].virtual_bytes - top[pos - 1].resident_bytes < untouched; --pos ) {
+            if ( pos < MALLOC_STAT_RESIDENT_SITES ) {
+                top[pos] = top[pos - 1];
+            }
+        }
+        if ( pos < MALLOC_STAT_RESIDENT_SITES ) {
+            top[pos].site = sites[i].addr;
+            top[pos].blocks = a->blocks;
+            top[pos].virtual_bytes = a->virtual_bytes;
+            top[pos].resident_bytes = a->resident_bytes;
+            if ( num < MALLOC_STAT_RESIDENT_SITES ) {
+                ++num;
+            }
+        }
+    }
+
+    munmap(acc, acc_size);
+    live_release(&snap);
+
+    pthread_mutex_lock(&resident_mutex);
+    resident_scanned_min = min_size;
+    resident_total = total;
+    memcpy(resident_sites, top, num * sizeof(top[0]));
+    resident_nsites = num;
+    pthread_mutex_unlock(&resident_mutex);
+}
+
+static void* resident_thread(void *arg) {
+    (void)arg;
+
+    thread_passthrough = 1;
+
+    pthread_mutex_lock(&resident_mutex);
+    for ( ;; ) {
+        while ( resident_done == resident_requested ) {
+            pthread_cond_wait(&resident_cond, &resident_mutex);
+        }
+        uint64_t requested = resident_requested;
+        uint64_t min_size = resident_min;
+        pthread_mutex_unlock(&resident_mutex);
+
+        resident_scan(min_size);
+
+        pthread_mutex_lock(&resident_mutex);
+        resident_done = requested;
+        pthread_cond_broadcast(&resident_cond);
+    }
+
+    return NULL;
+}
+
+int malloc_stat_scan_resident(uint64_t min_size, int wait) {
+    if ( !(collectors & MALLOC_STAT_COLLECT_RESIDENT) ) {
+        return 0;
+    }
+
+    /* the thread of the parent does not exist in the forked child, the
+     * mutex is re-initialised by atfork_child() */
+    pid_t self = process_id();
+    pid_t pid = __atomic_load_n(&resident_pid, __ATOMIC_ACQUIRE);
+    if ( pid != self
+        && __atomic_compare_exchange_n(&resident_pid, &pid, self, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) )
+    {
+        sigset_t all, prev;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &prev);
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int err = pthread_create(&thread, &attr, resident_thread, NULL);
+        pthread_attr_destroy(&attr);
+
+        pthread_sigmask(SIG_SETMASK, &prev, NULL);
+        if ( err ) {
+            __atomic_store_n(&resident_pid, 0, __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+
+    pthread_mutex_lock(&resident_mutex);
+    uint64_t request = ++resident_requested;
+    resident_min = min_size;
+    pthread_cond_broadcast(&resident_cond);
+    while ( wait && resident_done < request ) {
+        pthread_cond_wait(&resident_cond, &resident_mutex);
+    }
+    pthread_mutex_unlock(&resident_mutex);
+
+    return 1;
+}
+
+size_t malloc_stat_get_resident(malloc_stat_resident_site *total, malloc_stat_resident_site *out, size_t max) {
+    pthread_mutex_lock(&resident_mutex);
+    if ( total ) {
+        *total = resident_total;
+    }
+    size_t num = resident_nsites < max ? resident_nsites : max;
+    memcpy(out, resident_sites, num * sizeof(out[0]));
+    pthread_mutex_unlock(&resident_mutex);
+
+    return num;
+}
+
+/* writes the last finished scan, a scan is never started from here: the
+ * report is written at FINI too, where the thread can't be waited for */
+static void resident_report(int fd) {
+    char buf[LOG_BUFSIZE];
+    malloc_stat_resident_site total, top[MALLOC_STAT_RESIDENT_SITES];
+
+    pthread_mutex_lock(&resident_mutex);
+    uint64_t done = resident_done;
+    uint64_t min_size = resident_scanned_min;
+    total = resident_total;
+    size_t num = resident_nsites;
+    memcpy(top, resident_sites, num * sizeof(top[0]));
+    pthread_mutex_unlock(&resident_mutex);
+    if ( !done ) {
+        return;
+    }
+
+    int s = snprintf(buf, sizeof(buf)
+        ,"# RESIDENT min %" PRIu64 " blocks %" PRIu64 " virtual %" PRIu64 " resident %" PRIu64 "\n"
+        ,min_size, total.blocks, total.virtual_bytes, total.resident_bytes
+    );
+    log_write(fd, buf, s);
+
+    for ( size_t i = 0; i < num; ++i ) {
+        s = snprintf(buf, sizeof(buf)
+            ,"# RESIDENT %p blocks %" PRIu64 " virtual %" PRIu64 " resident %" PRIu64 "\n"
+            ,top[i].site, top[i].blocks, top[i].virtual_bytes, top[i].resident_bytes
+        );
+        s = symbol_append(buf, s, sizeof(buf), top[i].site);
+        log_write(fd, buf, s);
+    }
+}
+
+/* numa placement
+ *
+ * the node of the CPU running the allocating thread is stored with each
+ * sampled block, getcpu() is served by the vDSO. on demand the pages of
+ * the live sampled blocks are looked up by move_pages() in the query mode
+ * and compared to that node: the bytes on another node are remote, the
+ * ones never touched are unplaced. the pages of many blocks are queried by
+ * a single call. without the NUMA support in the kernel there is the node
+ * 0 only and the resident pages are found by mincore().
+ */
+
+typedef struct {
+    uint32_t key; /* the site index or the tid + 1, 0 for free */
+    malloc_stat_numa_usage usage;
+} malloc_stat_numa_acc;
+
+#define MALLOC_STAT_NUMA_BATCH 256
+
+typedef struct {
+    void *pages[MALLOC_STAT_NUMA_BATCH];
+    int status[MALLOC_STAT_NUMA_BATCH];
+    uint32_t bytes[MALLOC_STAT_NUMA_BATCH]; /* of the block within the page */
+    malloc_stat_numa_acc *acc[MALLOC_STAT_NUMA_BATCH];
+    uint32_t node[MALLOC_STAT_NUMA_BATCH];  /* the allocating node */
+    size_t num;
+    uintptr_t page;
+} malloc_stat_numa_batch;
+
+/* the online nodes, read when the collector is enabled */
+static uint32_t numa_nodes = 0;
+static uint64_t numa_allocations[MALLOC_STAT_NUMA_NODES];
+static uint64_t numa_allocated[MALLOC_STAT_NUMA_NODES];
+
+/* the highest node of /sys/devices/system/node/online, e.g. "0-1" */
+static uint32_t numa_online(void) {
+    char buf[256];
+    uint32_t last = 0;
+
+    int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if ( fd == -1 ) {
+        return 1;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    for ( ssize_t i = 0; i < len; ) {
+        uint32_t n = 0;
+        for ( ; i < len && buf[i] >= '0' && buf[i] <= '9'; ++i ) {
+            n = n * 10 + (buf[i] - '0');
+        }
+        last = n > last ? n : last;
+        for ( ; i < len && (buf[i] < '0' || buf[i] > '9'); ++i )
+        {}
+    }
+
+    return last < MALLOC_STAT_NUMA_NODES ? last + 1 : MALLOC_STAT_NUMA_NODES;
+}
+
+static inline uint32_t numa_node(void) {
+    unsigned cpu, node = 0;
+    getcpu(&cpu, &node);
+
+    return node < MALLOC_STAT_NUMA_NODES ? node : MALLOC_STAT_NUMA_NODES - 1;
+}
+
+static void numa_on_alloc(malloc_stat_block *b, uint64_t usable) {
+    b->node = numa_node();
+    __atomic_add_fetch(&numa_allocations[b->node], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&numa_allocated[b->node], usable, __ATOMIC_RELAXED);
+}
+
+size_t malloc_stat_get_numa_nodes(malloc_stat_numa_node *out) {
+    for ( uint32_t i = 0; i < numa_nodes; ++i ) {
+        out[i].allocations = __atomic_load_n(&numa_allocations[i], __ATOMIC_RELAXED) * sample_rate;
+        out[i].allocated = __atomic_load_n(&numa_allocated[i], __ATOMIC_RELAXED) * sample_rate;
+    }
+
+    return numa_nodes;
+}
+
+static void numa_flush(malloc_stat_numa_batch *q) {
+    if ( !q->num ) {
+        return;
+    }
+
+    if ( syscall(SYS_move_pages, 0, q->num, q->pages, NULL, q->status, 0) == -1 ) {
+        /* no NUMA in the kernel: the node 0 only */
+        for ( size_t i = 0; i < q->num; ++i ) {
+            unsigned char vec;
+            q->status[i] = mincore(q->pages[i], q->page, &vec) == -1
+                ? -EFAULT
+                : ((vec & 1) ? 0 : -ENOENT);
+        }
+    }
+
+    for ( size_t i = 0; i < q->num; ++i ) {
+        malloc_stat_numa_usage *u = &q->acc[i]->usage;
+        uint64_t bytes = (uint64_t)q->bytes[i] * sample_rate;
+        if ( q->status[i] >= 0 ) {
+            if ( (uint32_t)q->status[i] == q->node[i] ) {
+                u->local_bytes += bytes;
+            } else {
+                u->remote_bytes += bytes;
+            }
+        } else if ( q->status[i] == -ENOENT ) {
+            u->unplaced_bytes += bytes;
+        }
+        /* -EFAULT: the block was freed meanwhile */
+    }
+    q->num = 0;
+}
+
+static malloc_stat_numa_acc *numa_slot(malloc_stat_numa_acc *acc, uint32_t size, uint32_t key) {
+    uint32_t mask = size - 1;
+    for ( uint32_t i = ptr_hash(key) & mask, n = 0; n < size; i = (i + 1) & mask, ++n ) {
+        if ( acc[i].key == key || !acc[i].key ) {
+            acc[i].key = key;
+            return &acc[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* aggregates the placement of the live sampled blocks per thread or per site,
+ * ordered by the remote bytes and then by the local ones
+ */
+static size_t numa_scan(bool by_thread, malloc_stat_numa_usage *total, malloc_stat_numa_usage *out, size_t max) {
+    malloc_stat_snapshot snap;
+    malloc_stat_numa_batch q;
+    size_t num = 0;
+
+    memset(total, 0, sizeof(*total));
+    if ( !live_snapshot(&snap, MALLOC_STAT_COLLECT_NUMA) ) {
+        return 0;
+    }
+    uint32_t size = by_thread ? MALLOC_STAT_NUMA_THREADS : sites_size;
+    size_t acc_size = size * sizeof(malloc_stat_numa_acc);
+    malloc_stat_numa_acc *acc = mmap(NULL, acc_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( acc == MAP_FAILED ) {
+        live_release(&snap);
+
+        return 0;
+    }
+
+    q.num = 0;
+    q.page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    for ( size_t i = 0; i < snap.num; ++i ) {
+        const malloc_stat_live *l = &snap.items[i];
+        malloc_stat_numa_acc *a = by_thread ? numa_slot(acc, size, l->tid + 1) : &acc[l->site];
+        if ( !a ) {
+            continue;
+        }
+        if ( by_thread ) {
+            a->usage.tid = l->tid;
+        } else {
+            a->usage.site = sites[l->site].addr;
+        }
+        a->usage.blocks += sample_rate;
+
+        for ( uintptr_t p = l->ptr & ~(q.page - 1); p < l->ptr + l->size; p += q.page ) {
+            uintptr_t begin = p > l->ptr ? p : l->ptr;
+            uintptr_t end = p + q.page < l->ptr + l->size ? p + q.page : l->ptr + l->size;
+            q.pages[q.num] = (void *)p;
+            q.bytes[q.num] = (uint32_t)(end - begin);
+            q.acc[q.num] = a;
+            q.node[q.num] = l->node;
+            if ( ++q.num == MALLOC_STAT_NUMA_BATCH ) {
+                numa_flush(&q);
+            }
+        }
+    }
+    numa_flush(&q);
+
+    for ( uint32_t i = 0; i < size; ++i ) {
+        const malloc_stat_numa_usage *u = &acc[i].usage;
+        if ( !u->blocks ) {
+            continue;
+        }
+        total->blocks += u->blocks;
+        total->local_bytes += u->local_bytes;
+        total->remote_bytes += u->remote_bytes;
+        total->unplaced_bytes += u->unplaced_bytes;
+
+        size_t pos = num;
+        for ( ; pos > 0 && (out[pos - 1].remote_bytes < u->remote_bytes
+            || (out[pos - 1].remote_bytes == u->remote_bytes && out[pos - 1].local_bytes < u->local_bytes)); --pos )
+        {
+            if ( pos < max ) {
+                out[pos] = out[pos - 1];
+            }
+        }
+        if ( pos < max ) {
+            out[pos] = *u;
+            if ( num < max ) {
+                ++num;
+            }
+        }
+    }
+
+    munmap(acc, acc_size);
+    live_release(&snap);
+
+    return num;
+}
+
+size_t malloc_stat_get_numa_threads(malloc_stat_numa_usage *total, malloc_stat_numa_usage *out, size_t max) {
+    malloc_stat_numa_usage dummy;
+    int prev = in_trace;
+    in_trace = 1;
+    size_t num = numa_scan(true, total ? total : &dummy, out, max);
+    in_trace = prev;
+
+    return num;
+}
+
+size_t malloc_stat_get_numa_sites(malloc_stat_numa_usage *total, malloc_stat_numa_usage *out, size_t max) {
+    malloc_stat_numa_usage dummy;
+    int prev = in_trace;
+    in_trace = 1;
+    size_t num = numa_scan(false, total ? total : &dummy, out, max);
+    in_trace = prev;
+
+    return num;
+}
+
+static void numa_report(int fd) {
+    char buf[LOG_BUFSIZE];
+    malloc_stat_numa_node nodes[MALLOC_STAT_NUMA_NODES];
+    malloc_stat_numa_usage total, top[MALLOC_STAT_NUMA_REPORT];
+
+    size_t num = malloc_stat_get_numa_threads(&total, top, MALLOC_STAT_NUMA_REPORT);
+    int s = snprintf(buf, sizeof(buf)
+        ,"# NUMA nodes %u blocks %" PRIu64 " local %" PRIu64 " remote %" PRIu64 " unplaced %" PRIu64 "\n"
+        ,numa_nodes, total.blocks, total.local_bytes, total.remote_bytes, total.unplaced_bytes
+    );
+    log_write(fd, buf, s);
+
+    size_t n = malloc_stat_get_numa_nodes(nodes);
+    for ( size_t i = 0; i < n; ++i ) {
+        s = snprintf(buf, sizeof(buf)
+            ,"# NUMA node %zu allocs %" PRIu64 " bytes %" PRIu64 "\n"
+            ,i, nodes[i].allocations, nodes[i].allocated
+        );
+        log_write(fd, buf, s);
+    }
+
+    for ( size_t i = 0; i < num; ++i ) {
+        s = snprintf(buf, sizeof(buf)
+            ,"# NUMA thread %u blocks %" PRIu64 " local %" PRIu64 " remote %" PRIu64 " unplaced %" PRIu64 "\n"
+            ,top[i].tid, top[i].blocks, top[i].local_bytes, top[i].remote_bytes, top[i].unplaced_bytes
+        );
+        log_write(fd, buf, s);
+    }
+
+    num = malloc_stat_get_numa_sites(&total, top, MALLOC_STAT_NUMA_REPORT);
+    for ( size_t i = 0; i < num; ++i ) {
+        s = snprintf(buf, sizeof(buf)
+            ,"# NUMA site %p blocks %" PRIu64 " local %" PRIu64 " remote %" PRIu64 " unplaced %" PRIu64 "\n"
+            ,top[i].site, top[i].blocks, top[i].local_bytes, top[i].remote_bytes, top[i].unplaced_bytes
+        );
+        s = symbol_append(buf, s, sizeof(buf), top[i].site);
+        log_write(fd, buf, s);
+    }
+}
+
+/* leak trend part
+ *
+ * a monitor thread sums the requested bytes of the live sampled blocks per
+ * allocation site every `leak_interval` and keeps the last
+ * MALLOC_STAT_LEAK_WINDOW samples of each site. a site is flagged when the
+ * least squares slope of the window is positive, its live bytes rose at
+ * least at a half of the samples and dropped at most at 1/8 of them, i.e.
+ * it keeps growing instead of stepping up once to a plateau. the hot path
+ * is not involved, the blocks table is read as is.
+ */
+
+typedef struct {
+    uint64_t *history; /* [site][MALLOC_STAT_LEAK_WINDOW] live bytes */
+    uint64_t *live;    /* [site] summed by the current tick */
+    uint8_t *flagged;  /* [site] flagged by the previous tick */
+    size_t mapped;
+} malloc_stat_leak_tables;
+
+static uint64_t leak_interval_ns = MALLOC_STAT_LEAK_INTERVAL_MS * 1000000ull;
+static malloc_stat_leak_tables leak_tables;
+static uint64_t leak_ticks = 0;
+static uint64_t leak_times[MALLOC_STAT_LEAK_WINDOW];
+static int leak_restart = 0; /* the next tick starts a new window */
+
+/* the ticks of the monitor thread and of the API, guarded by leak_tick_mutex */
+static pthread_mutex_t leak_tick_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* the sites flagged by the last tick, guarded by leak_mutex */
+static pthread_mutex_t leak_mutex = PTHREAD_MUTEX_INITIALIZER;
+static malloc_stat_leak_site leak_sites[MALLOC_STAT_LEAK_SITES];
+static size_t leak_nsites = 0;
+
+static int monitor_start(void);
+static void monitor_wake(void);
+static bool monitor_idle(void);
+
+static int leak_format(char *buf, size_t size, const malloc_stat_leak_site *l) {
+    int s = snprintf(buf, size
+        ,"# LEAK %p live %" PRIu64 " growth %" PRIu64 " slope %" PRIu64 "/s window %" PRIu64 " ms\n"
+        ,l->site, l->live_bytes, l->growth, l->slope, l->window_ns / 1000000
+    );
+
+    return symbol_append(buf, s, size, l->site);
+}
+
+/* checks the window of the site, `y` is in the chronological order */
+static bool leak_trend(const uint64_t *y, const double *x, malloc_stat_leak_site *out) {
+    uint32_t rises = 0, drops = 0;
+    double mean_x = 0, mean_y = 0;
+
+    for ( uint32_t i = 0; i < MALLOC_STAT_LEAK_WINDOW; ++i ) {
+        if ( i ) {
+            rises += y[i] > y[i - 1];
+            drops += y[i] < y[i - 1];
+        }
+        mean_x += x[i];
+        mean_y += (double)y[i];
+    }
+    if ( rises < MALLOC_STAT_LEAK_WINDOW / 2 || drops > MALLOC_STAT_LEAK_WINDOW / 8
+        || y[MALLOC_STAT_LEAK_WINDOW - 1] <= y[0] )
+    {
+        return false;
+    }
+    mean_x /= MALLOC_STAT_LEAK_WINDOW;
+    mean_y /= MALLOC_STAT_LEAK_WINDOW;
+
+    double sxy = 0, sxx = 0;
+    for ( uint32_t i = 0; i < MALLOC_STAT_LEAK_WINDOW; ++i ) {
+        sxy += (x[i] - mean_x) * ((double)y[i] - mean_y);
+        sxx += (x[i] - mean_x) * (x[i] - mean_x);
+    }
+    if ( sxx <= 0 || sxy <= 0 ) {
+        return false;
+    }
+
+    out->live_bytes = y[MALLOC_STAT_LEAK_WINDOW - 1];
+    out->growth = y[MALLOC_STAT_LEAK_WINDOW - 1] - y[0];
+    out->slope = (uint64_t)(sxy / sxx);
+
+    return true;
+}
+
+/* the window and the flagged sites are dropped, the next tick starts anew */
+static void leak_reset(void) {
+    __atomic_store_n(&leak_restart, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&leak_mutex);
+    leak_nsites = 0;
+    pthread_mutex_unlock(&leak_mutex);
+}
+
+/* called with leak_tick_mutex held */
+static void leak_tick(uint64_t now) {
+    malloc_stat_leak_tables *t = &leak_tables;
+    malloc_stat_leak_site top[MALLOC_STAT_LEAK_SITES];
+    size_t num = 0;
+
+    if ( __atomic_load_n(&tables_state, __ATOMIC_ACQUIRE) != 2 ) {
+        return;
+    }
+    if ( !t->history ) {
+        t->mapped = sites_size * (sizeof(uint64_t) * (MALLOC_STAT_LEAK_WINDOW + 1) + 1);
+        void *p = mmap(NULL, t->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if ( p == MAP_FAILED ) {
+            return;
+        }
+        t->history = (uint64_t *)p;
+        t->live = t->history + (size_t)sites_size * MALLOC_STAT_LEAK_WINDOW;
+        t->flagged = (uint8_t *)(t->live + sites_size);
+    }
+
+    /* a gap in the samples, e.g. the collector was disabled meanwhile, restarts the window */
+    if ( __atomic_exchange_n(&leak_restart, 0, __ATOMIC_ACQUIRE)
+        || (leak_ticks && now - leak_times[(leak_ticks - 1) % MALLOC_STAT_LEAK_WINDOW] > 2 * leak_interval_ns) )
+    {
+        leak_ticks = 0;
+        memset(t->flagged, 0, sites_size);
+    }
+
+    uint32_t epoch = __atomic_load_n(&collector_epochs[__builtin_ctz(MALLOC_STAT_COLLECT_LEAKS)], __ATOMIC_RELAXED);
+    memset(t->live, 0, sites_size * sizeof(uint64_t));
+    for ( uint32_t i = 0; i < blocks_size; ++i ) {
+        if ( __atomic_load_n(&block_keys[i], __ATOMIC_ACQUIRE) > MALLOC_STAT_SLOT_BUSY && blocks[i].epoch >= epoch ) {
+            t->live[blocks[i].site] += blocks[i].size;
+        }
+    }
+
+    uint32_t pos = leak_ticks % MALLOC_STAT_LEAK_WINDOW;
+    leak_times[pos] = now;
+    for ( uint32_t i = 0; i < sites_size; ++i ) {
+        t->history[(size_t)i * MALLOC_STAT_LEAK_WINDOW + pos] = t->live[i] * sample_rate;
+    }
+    if ( ++leak_ticks < MALLOC_STAT_LEAK_WINDOW ) {
+        return;
+    }
+
+    /* the oldest sample follows the newest one */
+    double x[MALLOC_STAT_LEAK_WINDOW];
+    uint32_t first = leak_ticks % MALLOC_STAT_LEAK_WINDOW;
+    for ( uint32_t i = 0; i < MALLOC_STAT_LEAK_WINDOW; ++i ) {
+        uint32_t j = (first + i) % MALLOC_STAT_LEAK_WINDOW;
+        x[i] = (double)(leak_times[j] - leak_times[first]) / 1e9;
+    }
+    uint64_t window_ns = now - leak_times[first];
+
+    for ( uint32_t i = 0; i < sites_size; ++i ) {
+        const uint64_t *h = &t->history[(size_t)i * MALLOC_STAT_LEAK_WINDOW];
+        uint64_t y[MALLOC_STAT_LEAK_WINDOW];
+        malloc_stat_leak_site l;
+
+        if ( !h[pos] ) {
+            t->flagged[i] = 0;
+            continue;
+        }
+        for ( uint32_t k = 0; k < MALLOC_STAT_LEAK_WINDOW; ++k ) {
+            y[k] = h[(first + k) % MALLOC_STAT_LEAK_WINDOW];
+        }
+        if ( !leak_trend(y, x, &l) ) {
+            t->flagged[i] = 0;
+            continue;
+        }
+        l.site = sites[i].addr;
+        l.window_ns = window_ns;
+
+        /* the newly flagged sites are logged while the process runs */
+        if ( !t->flagged[i] && memlog_enabled ) {
+            char buf[LOG_BUFSIZE];
+            int s = leak_format(buf, sizeof(buf), &l);
+            log_write(memlog_fd, buf, s);
+        }
+        t->flagged[i] = 1;
+
+        /* insertion ordered by the slope */
+        size_t at = num;
+        for ( ; at > 0 && top[at - 1].slope < l.slope; --at ) {
+            if ( at < MALLOC_STAT_LEAK_SITES ) {
+                top[at] = top[at - 1];
+            }
+        }
+        if ( at < MALLOC_STAT_LEAK_SITES ) {
+            top[at] = l;
+            if ( num < MALLOC_STAT_LEAK_SITES ) {
+                ++num;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&leak_mutex);
+    memcpy(leak_sites, top, num * sizeof(top[0]));
+    leak_nsites = num;
+    pthread_mutex_unlock(&leak_mutex);
+}
+
+/* takes a sample now, besides the ones of the monitor thread */
+static void leak_sample(uint64_t now) {
+    pthread_mutex_lock(&leak_tick_mutex);
+    leak_tick(now);
+    pthread_mutex_unlock(&leak_tick_mutex);
+}
+
+int malloc_stat_sample_leaks(void) {
+    if ( !(collectors & MALLOC_STAT_COLLECT_LEAKS) ) {
+        return 0;
+    }
+    leak_sample(now_ns());
+
+    return 1;
+}
+
+uint64_t malloc_stat_set_leak_interval(uint64_t ms) {
+    uint64_t prev = leak_interval_ns / 1000000;
+    __atomic_store_n(&leak_interval_ns, (ms ? ms : 1) * 1000000ull, __ATOMIC_RELAXED);
+    monitor_wake();
+
+    return prev;
+}
+
+static size_t leak_copy(malloc_stat_leak_site *out, size_t max) {
+    pthread_mutex_lock(&leak_mutex);
+    size_t num = leak_nsites < max ? leak_nsites : max;
+    memcpy(out, leak_sites, num * sizeof(out[0]));
+    pthread_mutex_unlock(&leak_mutex);
+
+    return num;
+}
+
+size_t malloc_stat_get_leaks(malloc_stat_leak_site *out, size_t max) {
+    /* restarts the tracking in the forked child */
+    if ( collectors & MALLOC_STAT_COLLECT_LEAKS ) {
+        monitor_start();
+    }
+
+    return leak_copy(out, max);
+}
+
+static void leak_report(int fd) {
+    char buf[LOG_BUFSIZE];
+    malloc_stat_leak_site top[MALLOC_STAT_LEAK_SITES];
+
+    size_t num = leak_copy(top, MALLOC_STAT_LEAK_SITES);
+    int s = snprintf(buf, sizeof(buf)
+        ,"# LEAK sites %zu interval %" PRIu64 " ms samples %u\n"
+        ,num, leak_interval_ns / 1000000, MALLOC_STAT_LEAK_WINDOW
+    );
+    log_write(fd, buf, s);
+
+    for ( size_t i = 0; i < num; ++i ) {
+        s = leak_format(buf, sizeof(buf), &top[i]);
+        log_write(fd, buf, s);
+    }
+}
+
+/* memory budget part
+ *
+ * the soft and the hard thresholds of `in_use` of the process or of a
+ * module are checked by the monitor thread every `budget_interval`, the
+ * hot path is not involved. a reached threshold is logged and, with
+ * MALLOC_STAT_BUDGET_DUMP, followed by the summary and the reports. the
+ * callbacks are called after the lock is released, so they can change
+ * the budgets, and with the accounting of the thread turned on, so the
+ * blocks they free are accounted.
+ */
+
+typedef struct {
+    char module[MALLOC_STAT_MODULE_PATH]; /* empty for the process */
+    uint32_t slot; /* of the module, 0 until it is loaded */
+    uint32_t flags;
+    uint64_t threshold[2];
+    bool reached[2];
+    malloc_stat_budget_fnptr fn;
+    void *arg;
+} malloc_stat_budget;
+
+typedef struct {
+    malloc_stat_budget_event ev;
+    uint32_t flags;
+    malloc_stat_budget_fnptr fn;
+    void *arg;
+} malloc_stat_budget_call;
+
+static uint64_t budget_interval_ns = MALLOC_STAT_BUDGET_INTERVAL_MS * 1000000ull;
+
+/* the budgets, guarded by budget_mutex */
+static pthread_mutex_t budget_mutex = PTHREAD_MUTEX_INITIALIZER;
+static malloc_stat_budget budgets[MALLOC_STAT_BUDGETS];
+static uint32_t budget_num = 0;
+
+static void stat_dump(int fd);
+
+static const char *const budget_levels[] = {"soft", "hard"};
+
+/* the slot of the module whose path ends with `suffix`, 0 if there is none */
+static uint32_t budget_module(const char *suffix) {
+    size_t len = myStrlen(suffix);
+    uint32_t slots = __atomic_load_n(&module_slots, __ATOMIC_ACQUIRE);
+
+    for ( uint32_t i = 1; i < slots; ++i ) {
+        size_t path_len = myStrlen(module_paths[i]);
+        if ( path_len >= len && memcmp(module_paths[i] + path_len - len, suffix, len) == 0 ) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+/* false while the module of the budget is not loaded */
+static bool budget_in_use(malloc_stat_budget *b, uint64_t *in_use) {
+    if ( !b->module[0] ) {
+        *in_use = in_use_bytes(MALLOC_STAT_ATOMIC_LOAD(simult_in_use));
+
+        return true;
+    }
+    if ( !b->slot && !(b->slot = budget_module(b->module)) ) {
+        return false;
+    }
+    *in_use = in_use_bytes(MALLOC_STAT_ATOMIC_LOAD(module_vars[b->slot].in_use));
+
+    return true;
+}
+
+static void budget_tick(void) {
+    malloc_stat_budget_call calls[MALLOC_STAT_BUDGETS * 2];
+    size_t num = 0;
+
+    pthread_mutex_lock(&budget_mutex);
+    for ( uint32_t i = 0; i < budget_num; ++i ) {
+        malloc_stat_budget *b = &budgets[i];
+        uint64_t in_use;
+        if ( !budget_in_use(b, &in_use) ) {
+            continue;
+        }
+
+        for ( int level = MALLOC_STAT_BUDGET_SOFT; level <= MALLOC_STAT_BUDGET_HARD; ++level ) {
+            uint64_t threshold = b->threshold[level];
+            if ( !threshold ) {
+                continue;
+            }
+            /* re-armed under 15/16 of the threshold, so the noise around it is reported once */
+            if ( b->reached[level] ) {
+                b->reached[level] = in_use >= threshold - threshold / 16;
+                continue;
+            }
+            if ( in_use < threshold ) {
+                continue;
+            }
+            b->reached[level] = true;
+
+            malloc_stat_budget_call *c = &calls[num++];
+            memcpy(c->ev.module, b->module, sizeof(c->ev.module));
+            c->ev.level = level;
+            c->ev.threshold = threshold;
+            c->ev.in_use = in_use;
+            c->flags = b->flags;
+            c->fn = b->fn;
+            c->arg = b->arg;
+        }
+    }
+    pthread_mutex_unlock(&budget_mutex);
+
+    bool dumped = false;
+    for ( size_t i = 0; i < num; ++i ) {
+        const malloc_stat_budget_call *c = &calls[i];
+        int fd = memlog_enabled ? memlog_fd : STDERR_FILENO;
+
+        if ( memlog_enabled || (c->flags & MALLOC_STAT_BUDGET_DUMP) ) {
+            char buf[LOG_BUFSIZE];
+            int s = snprintf(buf, sizeof(buf)
+                ,"# BUDGET %s %s reached in_use %" PRIu64 " threshold %" PRIu64 "\n"
+                ,c->ev.module[0] ? c->ev.module : "process", budget_levels[c->ev.level]
+                ,c->ev.in_use, c->ev.threshold
+            );
+            log_write(fd, buf, s);
+        }
+        /* the soft and the hard thresholds reached at once are dumped once */
+        if ( (c->flags & MALLOC_STAT_BUDGET_DUMP) && !dumped ) {
+            stat_dump(fd);
+            dumped = true;
+        }
+        if ( c->fn ) {
+            thread_passthrough = 0;
+            c->fn(&c->ev, c->arg);
+            thread_passthrough = 1;
+        }
+    }
+}
+
+int malloc_stat_set_budget(const char *module, uint64_t soft, uint64_t hard, uint32_t flags
+    ,malloc_stat_budget_fnptr fn, void *arg)
+{
+    /* the monitor thread can't be started before the real functions are resolved */
+    if ( init_done != LOG_MALLOC_INIT_DONE ) {
+        return 0;
+    }
+    if ( !module ) {
+        module = "";
+    } else if ( !module[0] || !modules_enabled ) {
+        return 0;
+    }
+    size_t len = myStrlen(module);
+    if ( len >= MALLOC_STAT_MODULE_PATH ) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&budget_mutex);
+    uint32_t i = 0;
+    for ( ; i < budget_num && strcmp(budgets[i].module, module) != 0; ++i )
+    {}
+    if ( !soft && !hard ) {
+        if ( i < budget_num ) {
+            budgets[i] = budgets[budget_num - 1];
+            __atomic_store_n(&budget_num, budget_num - 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&budget_mutex);
+        /* the monitor thread stops if it has nothing else to do */
+        monitor_wake();
+
+        return 1;
+    }
+    if ( i == MALLOC_STAT_BUDGETS ) {
+        pthread_mutex_unlock(&budget_mutex);
+
+        return 0;
+    }
+
+    malloc_stat_budget *b = &budgets[i];
+    memset(b, 0, sizeof(*b));
+    memcpy(b->module, module, len);
+    b->threshold[MALLOC_STAT_BUDGET_SOFT] = soft;
+    b->threshold[MALLOC_STAT_BUDGET_HARD] = hard;
+    b->flags = flags;
+    b->fn = fn;
+    b->arg = arg;
+    if ( i == budget_num ) {
+        __atomic_store_n(&budget_num, i + 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&budget_mutex);
+
+    return monitor_start();
+}
+
+uint64_t malloc_stat_set_budget_interval(uint64_t ms) {
+    uint64_t prev = budget_interval_ns / 1000000;
+    __atomic_store_n(&budget_interval_ns, (ms ? ms : 1) * 1000000ull, __ATOMIC_RELAXED);
+    monitor_wake();
+
+    return prev;
+}
+
+static void budget_report(int fd) {
+    char buf[LOG_BUFSIZE];
+
+    pthread_mutex_lock(&budget_mutex);
+    for ( uint32_t i = 0; i < budget_num; ++i ) {
+        malloc_stat_budget *b = &budgets[i];
+        uint64_t in_use = 0;
+        budget_in_use(b, &in_use);
+        int s = snprintf(buf, sizeof(buf)
+            ,"# BUDGET %s soft %" PRIu64 " hard %" PRIu64 " in_use %" PRIu64 "\n"
+            ,b->module[0] ? b->module : "process"
+            ,b->threshold[MALLOC_STAT_BUDGET_SOFT], b->threshold[MALLOC_STAT_BUDGET_HARD], in_use
+        );
+        log_write(fd, buf, s);
+    }
+    pthread_mutex_unlock(&budget_mutex);
+}
+
+/* the results of a collector are kept while it's disabled and dropped when
+ * it's enabled again, its blocks are skipped by the epoch from then on
+ */
+static void collectors_restart(uint32_t on) {
+    uint32_t epoch = __atomic_add_fetch(&collect_epoch, 1, __ATOMIC_RELAXED);
+    for ( uint32_t bits = on; bits; bits &= bits - 1 ) {
+        __atomic_store_n(&collector_epochs[__builtin_ctz(bits)], epoch, __ATOMIC_RELAXED);
+    }
+
+    if ( on & MALLOC_STAT_COLLECT_CLASSES ) {
+        memset(class_allocations, 0, sizeof(class_allocations));
+        memset(class_deallocations, 0, sizeof(class_deallocations));
+        memset(class_requested, 0, sizeof(class_requested));
+        memset(class_usable, 0, sizeof(class_usable));
+    }
+    for ( uint32_t i = 0; (on & MALLOC_STAT_COLLECT_BLOCKS) && i < sites_size; ++i ) {
+        malloc_stat_site *s = &sites[i];
+        if ( on & MALLOC_STAT_COLLECT_CHURN ) {
+            memset(s->lifetime, 0, sizeof(s->lifetime));
+            s->short_lived = 0;
+        }
+        if ( on & MALLOC_STAT_COLLECT_REALLOC ) {
+            s->chains = s->grows = s->max_grows = s->copied = 0;
+            s->chains_done = s->first_bytes = s->final_bytes = 0;
+        }
+        if ( on & MALLOC_STAT_COLLECT_XTHREAD ) {
+            s->remote_frees = s->remote_bytes = 0;
+            memset(s->class_remote, 0, sizeof(s->class_remote));
+        }
+    }
+    if ( on & MALLOC_STAT_COLLECT_XTHREAD ) {
+        xthread_reset();
+    }
+    if ( on & MALLOC_STAT_COLLECT_RESIDENT ) {
+        pthread_mutex_lock(&resident_mutex);
+        memset(&resident_total, 0, sizeof(resident_total));
+        resident_nsites = 0;
+        pthread_mutex_unlock(&resident_mutex);
+    }
+    if ( on & MALLOC_STAT_COLLECT_LEAKS ) {
+        leak_reset();
+    }
+    if ( on & MALLOC_STAT_COLLECT_NUMA ) {
+        memset(numa_allocations, 0, sizeof(numa_allocations));
+        memset(numa_allocated, 0, sizeof(numa_allocated));
+    }
+}
+
+uint32_t malloc_stat_set_collectors(uint32_t mask) {
+    uint32_t prev = collectors;
+    if ( (mask & MALLOC_STAT_COLLECT_BLOCKS) && !tables_init() ) {
+        return prev;
+    }
+    if ( !(prev & MALLOC_STAT_COLLECT_BLOCKS) && (mask & MALLOC_STAT_COLLECT_BLOCKS) ) {
+        /* the frees made while all the collectors were off left their blocks
+         * in the table, so the previous session is dropped entirely */
+        blocks_forget();
+        sites_reset();
+        collect_start_ns = now_ns();
+    }
+    if ( mask & ~prev ) {
+        collectors_restart(mask & ~prev);
+    }
+    if ( (mask & MALLOC_STAT_COLLECT_NUMA) && !numa_nodes ) {
+        numa_nodes = numa_online();
+    }
+    collectors = mask;
+    if ( mask & MALLOC_STAT_COLLECT_LEAKS ) {
+        monitor_start();
+    } else if ( prev & MALLOC_STAT_COLLECT_LEAKS ) {
+        /* the monitor thread stops if it has nothing else to do */
+        monitor_wake();
+    }
+
+    return prev;
+}
+
+void malloc_stat_set_sample_rate(uint32_t every) {
+    sample_rate = every ? every : 1;
+}
+
+void malloc_stat_set_churn_window(uint64_t ns, uint64_t events) {
+    churn_window_ns = ns;
+    churn_window_events = events;
+}
+
+static void churn_report(int fd) {
+    char buf[LOG_BUFSIZE];
+    malloc_stat_churn_site top[32];
+    size_t num = malloc_stat_get_churn(top, sizeof(top) / sizeof(top[0]));
+
+    int s = snprintf(buf, sizeof(buf)
+        ,"# CHURN window %" PRIu64 " ns %" PRIu64 " events, sample %u, dropped %" PRIu64 "\n"
+        ,churn_window_ns, churn_window_events, sample_rate, blocks_dropped
+    );
+    log_write(fd, buf, s);
+
+    for ( size_t i = 0; i < num; ++i ) {
+        s = snprintf(buf, sizeof(buf)
+            ,"# CHURN %p calls %" PRIu64 " short %" PRIu64 " rate %" PRIu64 "/s"
+             " median %" PRIu64 " ns size %" PRIu64 "..%" PRIu64 " avg %" PRIu64 "\n"
+            ,top[i].site, top[i].calls, top[i].short_lived, top[i].calls_per_sec
+            ,top[i].median_lifetime_ns, top[i].min_size, top[i].max_size, top[i].avg_size
+        );
+        s = symbol_append(buf, s, sizeof(buf), top[i].site);
+        log_write(fd, buf, s);
+    }
+}
+
+static void realloc_report(int fd) {
+    char buf[LOG_BUFSIZE];
+    malloc_stat_realloc_site top[32];
+    size_t num = malloc_stat_get_realloc_chains(top, sizeof(top) / sizeof(top[0]));
+
+    for ( size_t i = 0; i < num; ++i ) {
+        int s = snprintf(buf, sizeof(buf)
+            ,"# REALLOC %p chains %" PRIu64 " grows %" PRIu64 " max %" PRIu64
+             " copied %" PRIu64 " size %" PRIu64 "..%" PRIu64 "\n"
+            ,top[i].site, top[i].chains, top[i].grows, top[i].max_grows
+            ,top[i].copied, top[i].avg_first_size, top[i].avg_final_size
+        );
+        s = symbol_append(buf, s, sizeof(buf), top[i].site);
+        log_write(fd, buf, s);
+    }
+}
+
+static void slack_report(int fd) {
+    char buf[LOG_BUFSIZE];
+    malloc_stat_slack_site top[32];
+    size_t num = malloc_stat_get_slack(top, sizeof(top) / sizeof(top[0]));
+
+    uint64_t requested = MALLOC_STAT_ATOMIC_LOAD(total_requested);
+    uint64_t allocated = MALLOC_STAT_ATOMIC_LOAD(total_allocated);
+    int s = snprintf(buf, sizeof(buf)
+        ,"# SLACK requested %" PRIu64 " usable %" PRIu64 " slack %" PRIu64 "\n"
+        ,requested, allocated, allocated - requested
+    );
+    log_write(fd, buf, s);
+
+    for ( uint32_t i = 0; (collectors & MALLOC_STAT_COLLECT_CLASSES) && i < MALLOC_STAT_SIZE_CLASSES; ++i ) {
+        uint64_t usable = MALLOC_STAT_ATOMIC_LOAD(class_usable[i]);
+        if ( !usable ) {
+            continue;
+        }
+        requested = MALLOC_STAT_ATOMIC_LOAD(class_requested[i]);
+        s = snprintf(buf, sizeof(buf)
+            ,"# SLACK class %" PRIu64 " requested %" PRIu64 " usable %" PRIu64 " slack %" PRIu64 "\n"
+            ,MALLOC_STAT_SIZE_CLASS_LIMIT(i), requested, usable, usable - requested
+        );
+        log_write(fd, buf, s);
+    }
+
+    for ( size_t i = 0; i < num; ++i ) {
+        s = snprintf(buf, sizeof(buf)
+            ,"# SLACK %p calls %" PRIu64 " requested %" PRIu64 " usable %" PRIu64
+             " slack %" PRIu64 " size %" PRIu64 "..%" PRIu64 "\n"
+            ,top[i].site, top[i].calls, top[i].requested, top[i].usable
+            ,top[i].usable - top[i].requested, top[i].min_size, top[i].max_size
+        );
+        s = symbol_append(buf, s, sizeof(buf), top[i].site);
+        log_write(fd, buf, s);
+    }
+}
+
+static void xthread_report(int fd) {
+    char buf[LOG_BUFSIZE];
+    malloc_stat_xthread_vars vars = malloc_stat_get_xthread();
+
+    int s = snprintf(buf, sizeof(buf)
+        ,"# XTHREAD frees %" PRIu64 " remote %" PRIu64 " bytes %" PRIu64 " pairs_dropped %" PRIu64 "\n"
+        ,vars.frees, vars.remote_frees, vars.remote_bytes, vars.pairs_dropped
+    );
+    log_write(fd, buf, s);
+
+    for ( uint32_t i = 0; i < MALLOC_STAT_SIZE_CLASSES; ++i ) {
+        if ( !vars.class_frees[i] ) {
+            continue;
+        }
+        s = snprintf(buf, sizeof(buf)
+            ,"# XTHREAD class %" PRIu64 " frees %" PRIu64 " remote %" PRIu64 "\n"
+            ,MALLOC_STAT_SIZE_CLASS_LIMIT(i), vars.class_frees[i], vars.class_remote_frees[i]
+        );
+        log_write(fd, buf, s);
+    }
+
+    malloc_stat_xthread_site top[32];
+    size_t num = malloc_stat_get_xthread_sites(top, sizeof(top) / sizeof(top[0]));
+    for ( size_t i = 0; i < num; ++i ) {
+        s = snprintf(buf, sizeof(buf)
+            ,"# XTHREAD site %p frees %" PRIu64 " remote %" PRIu64 " bytes %" PRIu64 " classes"
+            ,top[i].site, top[i].frees, top[i].remote_frees, top[i].remote_bytes
+        );
+        for ( uint32_t c = 0; c < MALLOC_STAT_SIZE_CLASSES; ++c ) {
+            if ( top[i].class_remote_frees[c] ) {
+                s += snprintf(buf + s, sizeof(buf) - s, " %" PRIu64 ":%" PRIu64
+                    ,MALLOC_STAT_SIZE_CLASS_LIMIT(c), top[i].class_remote_frees[c]);
+            }
+        }
+        s += snprintf(buf + s, sizeof(buf) - s, "\n");
+        s = symbol_append(buf, s, sizeof(buf), top[i].site);
+        log_write(fd, buf, s);
+    }
+
+    malloc_stat_xthread_pair pairs[32];
+    num = malloc_stat_get_xthread_pairs(pairs, sizeof(pairs) / sizeof(pairs[0]));
+    for ( size_t i = 0; i < num; ++i ) {
+        s = snprintf(buf, sizeof(buf)
+            ,"# XTHREAD pair %u %u frees %" PRIu64 " bytes %" PRIu64 "\n"
+            ,pairs[i].alloc_tid, pairs[i].free_tid, pairs[i].frees, pairs[i].bytes
+        );
+        log_write(fd, buf, s);
+    }
+}
+
+void malloc_stat_report(int fd) {
+    int prev = in_trace;
+    in_trace = 1;
+
+    if ( collectors & MALLOC_STAT_COLLECT_CHURN ) {
+        churn_report(fd);
+    }
+    if ( collectors & MALLOC_STAT_COLLECT_REALLOC ) {
+        realloc_report(fd);
+    }
+    if ( collectors & MALLOC_STAT_COLLECT_XTHREAD ) {
+        xthread_report(fd);
+    }
+    if ( collectors & MALLOC_STAT_COLLECT_FALSE_SHARING ) {
+        false_sharing_report(fd);
+    }
+    if ( collectors & MALLOC_STAT_COLLECT_RESIDENT ) {
+        resident_report(fd);
+    }
+    if ( collectors & MALLOC_STAT_COLLECT_SLACK ) {
+        slack_report(fd);
+    }
+    if ( collectors & MALLOC_STAT_COLLECT_NUMA ) {
+        numa_report(fd);
+    }
+    if ( collectors & MALLOC_STAT_COLLECT_LEAKS ) {
+        leak_report(fd);
+    }
+    if ( latency_rate ) {
+        latency_report(fd);
+    }
+    if ( slow_ticks ) {
+        slow_report(fd);
+    }
+    if ( modules_enabled ) {
+        modules_report(fd);
+    }
+    if ( __atomic_load_n(&budget_num, __ATOMIC_RELAXED) ) {
+        budget_report(fd);
+    }
+
+    in_trace = prev;
+}
+
+/* stat routine */
+malloc_stat_vars malloc_stat_get_stat(malloc_stat_operation op) {
+    malloc_stat_vars res;
+
+    /* just a compile-time test for lock-free ops on uint64_t */
+    char _[__atomic_always_lock_free(sizeof(res.allocations), &(res.allocations)) ? 1 : -1]; (void)_;
+
+    switch ( op ) {
+        case MALLOC_STAT_GET: break;
+        case MALLOC_STAT_RESET: {
+            MALLOC_STAT_ATOMIC_STORE(total_allocations, 0);
+            MALLOC_STAT_ATOMIC_STORE(total_allocated, 0);
+            MALLOC_STAT_ATOMIC_STORE(total_deallocations, 0);
+            MALLOC_STAT_ATOMIC_STORE(total_deallocated, 0);
+            MALLOC_STAT_ATOMIC_STORE(total_requested, 0);
+            MALLOC_STAT_ATOMIC_STORE(simult_in_use, 0);
+            MALLOC_STAT_ATOMIC_STORE(peak_in_use, 0);
+            for ( uint32_t i = 0; i < MALLOC_STAT_SIZE_CLASSES; ++i ) {
+                MALLOC_STAT_ATOMIC_STORE(class_allocations[i], 0);
+                MALLOC_STAT_ATOMIC_STORE(class_deallocations[i], 0);
+                MALLOC_STAT_ATOMIC_STORE(class_requested[i], 0);
+                MALLOC_STAT_ATOMIC_STORE(class_usable[i], 0);
+            }
+            if ( __atomic_load_n(&tables_state, __ATOMIC_ACQUIRE) == 2 ) {
+                sites_reset();
+                xthread_reset();
+                collect_start_ns = now_ns();
+            }
+            if ( __atomic_load_n(&latency_state, __ATOMIC_ACQUIRE) == 2 ) {
+                latency_reset();
+            }
+            slow_reset();
+            modules_reset();
+        } break;
+    }
+
+    res.allocations   = MALLOC_STAT_ATOMIC_LOAD(total_allocations);
+    res.allocated     = MALLOC_STAT_ATOMIC_LOAD(total_allocated);
+    res.deallocations = MALLOC_STAT_ATOMIC_LOAD(total_deallocations);
+    res.deallocated   = MALLOC_STAT_ATOMIC_LOAD(total_deallocated);
+    res.in_use        = in_use_bytes(MALLOC_STAT_ATOMIC_LOAD(simult_in_use));
+    res.peak_in_use   = in_use_bytes(MALLOC_STAT_ATOMIC_LOAD(peak_in_use));
+    res.requested     = MALLOC_STAT_ATOMIC_LOAD(total_requested);
+
+    return res;
+}
+
+size_t malloc_stat_get_size_classes(malloc_stat_size_class *out) {
+    for ( uint32_t i = 0; i < MALLOC_STAT_SIZE_CLASSES; ++i ) {
+        out[i].allocations = MALLOC_STAT_ATOMIC_LOAD(class_allocations[i]);
+        out[i].deallocations = MALLOC_STAT_ATOMIC_LOAD(class_deallocations[i]);
+        out[i].requested = MALLOC_STAT_ATOMIC_LOAD(class_requested[i]);
+        out[i].usable = MALLOC_STAT_ATOMIC_LOAD(class_usable[i]);
+    }
+
+    return MALLOC_STAT_SIZE_CLASSES;
+}
+
+void malloc_stat_change_log_state(int op) {
+    memlog_enabled = op;
+}
+
+void malloc_stat_set_log_fd(int fd) {
+    memlog_fd = fd;
+}
+
+int malloc_stat_set_passthrough(int on) {
+    int prev = passthrough;
+
+    /* the real functions must be resolved first */
+    if ( init_done != LOG_MALLOC_INIT_DONE ) {
+        return prev;
+    }
+    if ( prev && !on ) {
+        blocks_forget();
+    }
+    passthrough = (on != 0);
+
+    return prev;
+}
+
+/* the signal set by `toggle_signal` option */
+static int passthrough_signal = 0;
+static volatile sig_atomic_t passthrough_pending = 0;
+
+/* the monitor thread toggles the mode, leaving the handler with no sweep
+ * over the blocks table */
+static void passthrough_handler(int sig) {
+    int saved_errno = errno;
+    (void)sig;
+
+    passthrough_pending = 1;
+    monitor_wake();
+    errno = saved_errno;
+}
+
+uint32_t malloc_stat_get_version() {
+    return MALLOC_STAT_VERSION;
+}
+
+/* metrics part
+ *
+ * the metrics are rendered in the Prometheus text format into the
+ * caller's buffer without allocating and without taking any lock.
+ * the endpoint thread serves them over a unix socket or a localhost
+ * TCP port, all its calls are forwarded in the passthrough mode.
+ */
+
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t len;
+} malloc_stat_metrics_buf;
+
+static void metrics_printf(malloc_stat_metrics_buf *m, const char *fmt, ...) {
+    va_list args;
+
+    if ( m->len + 1 >= m->size ) {
+        return;
+    }
+    va_start(args, fmt);
+    int len = vsnprintf(m->buf + m->len, m->size - m->len, fmt, args);
+    va_end(args);
+
+    if ( len > 0 ) {
+        m->len = m->len + len < m->size ? m->len + len : m->size - 1;
+    }
+}
+
+static void metrics_header(malloc_stat_metrics_buf *m, const char *name, const char *type, const char *help) {
+    metrics_printf(m, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metrics_value(malloc_stat_metrics_buf *m, const char *name, const char *type, const char *help, uint64_t val) {
+    metrics_header(m, name, type, help);
+    metrics_printf(m, "%s %" PRIu64 "\n", name, val);
+}
+
+static uint64_t bytes_rank(const malloc_stat_site *s) {
+    return s->addr ? s->bytes : 0;
+}
+
+size_t malloc_stat_get_metrics(char *buf, size_t size) {
+    malloc_stat_metrics_buf m = {buf, size, 0};
+    malloc_stat_vars vars = malloc_stat_get_stat(MALLOC_STAT_GET);
+    malloc_stat_size_class classes[MALLOC_STAT_SIZE_CLASSES];
+
+    if ( !size ) {
+        return 0;
+    }
+    buf[0] = '\0';
+
+    metrics_value(&m, "malloc_stat_allocations_total", "counter", "Allocation calls.", vars.allocations);
+    metrics_value(&m, "malloc_stat_deallocations_total", "counter", "Deallocation calls.", vars.deallocations);
+    metrics_value(&m, "malloc_stat_allocated_bytes_total", "counter", "Usable bytes allocated.", vars.allocated);
+    metrics_value(&m, "malloc_stat_deallocated_bytes_total", "counter", "Usable bytes deallocated.", vars.deallocated);
+    metrics_value(&m, "malloc_stat_in_use_bytes", "gauge", "Usable bytes in use.", vars.in_use);
+    metrics_value(&m, "malloc_stat_peak_in_use_bytes", "gauge", "Peak of the usable bytes in use.", vars.peak_in_use);
+    metrics_value(&m, "malloc_stat_requested_bytes_total", "counter", "Bytes requested by the allocations.", vars.requested);
+
+    if ( collectors & MALLOC_STAT_COLLECT_CLASSES ) {
+        /* the last class holds all the bigger blocks, so it is the +Inf bucket */
+        malloc_stat_get_size_classes(classes);
+        uint64_t count = 0, sum = 0;
+        metrics_header(&m, "malloc_stat_allocation_size_bytes", "histogram", "Usable sizes of the allocated blocks.");
+        for ( uint32_t i = 0; i < MALLOC_STAT_SIZE_CLASSES; ++i ) {
+            count += classes[i].allocations;
+            sum += classes[i].usable;
+            if ( i + 1 < MALLOC_STAT_SIZE_CLASSES ) {
+                metrics_printf(&m, "malloc_stat_allocation_size_bytes_bucket{le=\"%" PRIu64 "\"} %" PRIu64 "\n"
+                    ,MALLOC_STAT_SIZE_CLASS_LIMIT(i), count);
+            } else {
+                metrics_printf(&m, "malloc_stat_allocation_size_bytes_bucket{le=\"+Inf\"} %" PRIu64 "\n", count);
+            }
+        }
+        metrics_printf(&m, "malloc_stat_allocation_size_bytes_sum %" PRIu64 "\n", sum);
+        metrics_printf(&m, "malloc_stat_allocation_size_bytes_count %" PRIu64 "\n", count);
+
+        metrics_header(&m, "malloc_stat_size_class_live_blocks", "gauge", "Live blocks by the size class upper limit.");
+        for ( uint32_t i = 0; i < MALLOC_STAT_SIZE_CLASSES; ++i ) {
+            /* the frees of the blocks allocated before a reset make it negative */
+            int64_t live = (int64_t)(classes[i].allocations - classes[i].deallocations);
+            metrics_printf(&m, "malloc_stat_size_class_live_blocks{class=\"%" PRIu64 "\"} %" PRId64 "\n"
+                ,MALLOC_STAT_SIZE_CLASS_LIMIT(i), live > 0 ? live : 0);
+        }
+
+        metrics_header(&m, "malloc_stat_size_class_slack_bytes_total", "counter", "Usable bytes over the requested ones by the size class upper limit.");
+        for ( uint32_t i = 0; i < MALLOC_STAT_SIZE_CLASSES; ++i ) {
+            metrics_printf(&m, "malloc_stat_size_class_slack_bytes_total{class=\"%" PRIu64 "\"} %" PRIu64 "\n"
+                ,MALLOC_STAT_SIZE_CLASS_LIMIT(i), classes[i].usable - classes[i].requested);
+        }
+    }
+
+    if ( latency_rate ) {
+        malloc_stat_latency latency[MALLOC_STAT_LATENCY_KINDS];
+        malloc_stat_get_latency(latency);
+        metrics_header(&m, "malloc_stat_call_latency_nanoseconds", "summary", "Time spent in the real functions, sampled.");
+        for ( uint32_t k = 0; k < MALLOC_STAT_LATENCY_KINDS; ++k ) {
+            if ( !latency[k].calls ) {
+                continue;
+            }
+            const char *name = latency_names[k];
+            metrics_printf(&m, "malloc_stat_call_latency_nanoseconds{call=\"%s\",quantile=\"0.5\"} %" PRIu64 "\n"
+                ,name, latency[k].p50_ns);
+            metrics_printf(&m, "malloc_stat_call_latency_nanoseconds{call=\"%s\",quantile=\"0.9\"} %" PRIu64 "\n"
+                ,name, latency[k].p90_ns);
+            metrics_printf(&m, "malloc_stat_call_latency_nanoseconds{call=\"%s\",quantile=\"0.99\"} %" PRIu64 "\n"
+                ,name, latency[k].p99_ns);
+            metrics_printf(&m, "malloc_stat_call_latency_nanoseconds{call=\"%s\",quantile=\"0.999\"} %" PRIu64 "\n"
+                ,name, latency[k].p999_ns);
+            metrics_printf(&m, "malloc_stat_call_latency_nanoseconds_count{call=\"%s\"} %" PRIu64 "\n"
+                ,name, latency[k].calls);
+        }
+    }
+    if ( slow_ticks ) {
+        malloc_stat_latency latency[MALLOC_STAT_LATENCY_KINDS];
+        malloc_stat_get_latency(latency);
+        metrics_header(&m, "malloc_stat_slow_calls_total", "counter", "Calls slower than the slow calls threshold.");
+        for ( uint32_t k = 0; k < MALLOC_STAT_LATENCY_KINDS; ++k ) {
+            metrics_printf(&m, "malloc_stat_slow_calls_total{call=\"%s\"} %" PRIu64 "\n"
+                ,latency_names[k], latency[k].slow_calls);
+        }
+    }
+
+    if ( collectors & MALLOC_STAT_COLLECT_RESIDENT ) {
+        malloc_stat_resident_site total, top[1];
+        malloc_stat_get_resident(&total, top, 0);
+        metrics_value(&m, "malloc_stat_resident_scan_virtual_bytes", "gauge", "Pages spanned by the large blocks at the last resident scan, sampled.", total.virtual_bytes);
+        metrics_value(&m, "malloc_stat_resident_scan_resident_bytes", "gauge", "Resident pages of the large blocks at the last resident scan, sampled.", total.resident_bytes);
+    }
+    if ( collectors & MALLOC_STAT_COLLECT_NUMA ) {
+        malloc_stat_numa_node nodes[MALLOC_STAT_NUMA_NODES];
+        size_t num = malloc_stat_get_numa_nodes(nodes);
+        metrics_header(&m, "malloc_stat_numa_node_allocated_bytes_total", "counter", "Usable bytes allocated on the CPUs of the node, sampled.");
+        for ( size_t i = 0; i < num; ++i ) {
+            metrics_printf(&m, "malloc_stat_numa_node_allocated_bytes_total{node=\"%zu\"} %" PRIu64 "\n"
+                ,i, nodes[i].allocated);
+        }
+    }
+    if ( collectors & MALLOC_STAT_COLLECT_LEAKS ) {
+        malloc_stat_leak_site top[MALLOC_STAT_METRICS_SITES];
+        size_t num = leak_copy(top, MALLOC_STAT_METRICS_SITES);
+        metrics_header(&m, "malloc_stat_leak_site_growth_bytes_per_second", "gauge", "Slope of the live bytes of the steadily growing sites, sampled.");
+        for ( size_t i = 0; i < num; ++i ) {
+            metrics_printf(&m, "malloc_stat_leak_site_growth_bytes_per_second{site=\"%p\"} %" PRIu64 "\n"
+                ,top[i].site, top[i].slope);
+        }
+        metrics_header(&m, "malloc_stat_leak_site_live_bytes", "gauge", "Requested bytes of the live blocks of the steadily growing sites, sampled.");
+        for ( size_t i = 0; i < num; ++i ) {
+            metrics_printf(&m, "malloc_stat_leak_site_live_bytes{site=\"%p\"} %" PRIu64 "\n"
+                ,top[i].site, top[i].live_bytes);
+        }
+    }
+    if ( modules_enabled ) {
+        malloc_stat_module top[MALLOC_STAT_METRICS_SITES];
+        size_t num = malloc_stat_get_modules(top, MALLOC_STAT_METRICS_SITES);
+        metrics_header(&m, "malloc_stat_module_allocated_bytes_total", "counter", "Usable bytes allocated by the top modules.");
+        for ( size_t i = 0; i < num; ++i ) {
+            metrics_printf(&m, "malloc_stat_module_allocated_bytes_total{module=\"%s\"} %" PRIu64 "\n"
+                ,top[i].path, top[i].stat.allocated);
+        }
+        metrics_header(&m, "malloc_stat_module_in_use_bytes", "gauge", "Usable bytes allocated minus the ones freed by the top modules.");
+        for ( size_t i = 0; i < num; ++i ) {
+            metrics_printf(&m, "malloc_stat_module_in_use_bytes{module=\"%s\"} %" PRIu64 "\n"
+                ,top[i].path, top[i].stat.in_use);
+        }
+    }
+
+    /* the sites are known for the sampled blocks of the enabled collectors only */
+    uint32_t idx[MALLOC_STAT_METRICS_SITES];
+    size_t num = sites_top(idx, MALLOC_STAT_METRICS_SITES, bytes_rank);
+    if ( num ) {
+        metrics_header(&m, "malloc_stat_site_allocations_total", "counter", "Allocations of the top sites, sampled.");
+        for ( size_t i = 0; i < num; ++i ) {
+            metrics_printf(&m, "malloc_stat_site_allocations_total{site=\"%p\"} %" PRIu64 "\n"
+                ,sites[idx[i]].addr, sites[idx[i]].calls * sample_rate);
+        }
+        metrics_header(&m, "malloc_stat_site_allocated_bytes_total", "counter", "Requested bytes of the top sites, sampled.");
+        for ( size_t i = 0; i < num; ++i ) {
+            metrics_printf(&m, "malloc_stat_site_allocated_bytes_total{site=\"%p\"} %" PRIu64 "\n"
+                ,sites[idx[i]].addr, sites[idx[i]].bytes * sample_rate);
+        }
+    }
+
+    return m.len;
+}
+
+/* the endpoint set by `metrics` option: a path of the unix socket or a TCP port */
+static char metrics_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static uint16_t metrics_port = 0;
+static int metrics_fd = -1;
+
+static void metrics_write(int fd, const char *buf, size_t len) {
+    while ( len ) {
+        ssize_t w = write(fd, buf, len);
+        if ( w == -1 && errno == EINTR ) {
+            continue;
+        }
+        if ( w <= 0 ) {
+            return;
+        }
+        buf += w;
+        len -= (size_t)w;
+    }
+}
+
+static void* metrics_thread(void *arg) {
+    static char buf[MALLOC_STAT_METRICS_BUFSIZE];
+    char head[256], req[1024];
+    struct timeval timeout = {1, 0};
+    (void)arg;
+
+    thread_passthrough = 1;
+
+    for ( ;; ) {
+        int conn = accept(metrics_fd, NULL, NULL);
+        if ( conn == -1 ) {
+            if ( errno == EINTR || errno == ECONNABORTED ) {
+                continue;
+            }
+            break;
+        }
+        /* a stuck client must not stop the endpoint */
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        /* any request gets the metrics, the request itself is not parsed */
+        if ( read(conn, req, sizeof(req)) >= 0 ) {
+            size_t len = malloc_stat_get_metrics(buf, sizeof(buf));
+            int hlen = snprintf(head, sizeof(head)
+                ,"HTTP/1.0 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Connection: close\r\n\r\n"
+                ,len
+            );
+            metrics_write(conn, head, (size_t)hlen);
+            metrics_write(conn, buf, len);
+        }
+        close(conn);
+    }
+
+    return NULL;
+}
+
+static void metrics_start(void) {
+    if ( metrics_path[0] ) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, metrics_path, sizeof(addr.sun_path) - 1);
+
+        metrics_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        unlink(metrics_path);
+        if ( metrics_fd != -1 && bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ) {
+            close(metrics_fd);
+            metrics_fd = -1;
+        }
+    } else {
+        struct sockaddr_in addr;
+        int one = 1;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(metrics_port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if ( metrics_fd != -1 ) {
+            setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if ( bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ) {
+                close(metrics_fd);
+                metrics_fd = -1;
+            }
+        }
+    }
+    if ( metrics_fd == -1 || listen(metrics_fd, 8) == -1 ) {
+        write(STDERR_FILENO, "malloc-stat: can't start the metrics endpoint\n", 46);
+        return;
+    }
+
+    /* the signals of the program are not delivered to the endpoint thread */
+    sigset_t all, prev;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &prev);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if ( pthread_create(&thread, &attr, metrics_thread, NULL) != 0 ) {
+        write(STDERR_FILENO, "malloc-stat: can't start the metrics thread\n", 44);
+    }
+    pthread_attr_destroy(&attr);
+
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* the monitor thread is woken up by the semaphore, see the monitor part */
+static sem_t monitor_sem;
+static pid_t monitor_pid = 0; /* the process running the monitor thread */
+static volatile sig_atomic_t dump_pending = 0;
+
+/* the signal set by `dump_signal` option */
+static int dump_signal = 0;
+
+/* shared counters part
+ *
+ * the counters of the processes of a tree are published into the POSIX
+ * shared memory set by the `shm` option, a slot per process, see
+ * malloc_stat_shm. the monitor thread copies them every `shm_interval`
+ * and a forked child claims its own slot at once, so a single reader sees
+ * the workers of a pre-fork server side by side. the hot path is not
+ * involved. a slot is written under a seqlock, readers retry on an odd or
+ * changed `seq`.
+ */
+
+static malloc_stat_shm *shm_area = NULL;
+static malloc_stat_shm_worker *shm_self = NULL;
+static uint64_t shm_interval_ns = MALLOC_STAT_SHM_INTERVAL_MS * 1000000ull;
+static int shm_lock = 0;
+
+static void shm_publish(void) {
+    malloc_stat_vars v = malloc_stat_get_stat(MALLOC_STAT_GET);
+
+    while ( __atomic_exchange_n(&shm_lock, 1, __ATOMIC_ACQUIRE) ) {
+        sched_yield();
+    }
+    /* detached meanwhile */
+    malloc_stat_shm_worker *w = shm_self;
+    if ( !w ) {
+        __atomic_store_n(&shm_lock, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    uint32_t seq = w->seq;
+    __atomic_store_n(&w->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    w->stat = v;
+    w->updated_ns = now_ns();
+    __atomic_store_n(&w->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&shm_lock, 0, __ATOMIC_RELEASE);
+}
+
+/* the slot of this process before exec(), a free one or the one of a process gone */
+static malloc_stat_shm_worker *shm_claim(void) {
+    uint32_t pid = (uint32_t)process_id();
+
+    for ( int pass = 0; pass < 3; ++pass ) {
+        for ( uint32_t i = 0; i < MALLOC_STAT_SHM_WORKERS; ++i ) {
+            malloc_stat_shm_worker *w = &shm_area->worker[i];
+            uint32_t cur = __atomic_load_n(&w->pid, __ATOMIC_ACQUIRE);
+            bool take = pass == 0 ? cur == pid
+                : pass == 1 ? cur == 0
+                : cur && (__atomic_load_n(&w->state, __ATOMIC_ACQUIRE) == MALLOC_STAT_SHM_EXITED
+                    || (kill((pid_t)cur, 0) == -1 && errno == ESRCH));
+            if ( !take ) {
+                continue;
+            }
+            if ( cur == pid || __atomic_compare_exchange_n(&w->pid, &cur, pid
+                ,false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) )
+            {
+                w->ppid = (uint32_t)getppid();
+                __atomic_store_n(&w->state, MALLOC_STAT_SHM_RUNNING, __ATOMIC_RELEASE);
+
+                return w;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* publishes the last counters and releases the slot, the monitor thread stops if it has nothing else to do */
+static void shm_detach(void) {
+    if ( !shm_area ) {
+        return;
+    }
+    shm_publish();
+
+    while ( __atomic_exchange_n(&shm_lock, 1, __ATOMIC_ACQUIRE) ) {
+        sched_yield();
+    }
+    if ( shm_self ) {
+        __atomic_store_n(&shm_self->state, MALLOC_STAT_SHM_EXITED, __ATOMIC_RELEASE);
+        shm_self = NULL;
+    }
+    malloc_stat_shm *area = shm_area;
+    shm_area = NULL;
+    __atomic_store_n(&shm_lock, 0, __ATOMIC_RELEASE);
+
+    munmap(area, sizeof(malloc_stat_shm));
+    monitor_wake();
+}
+
+int malloc_stat_set_shm(const char *name, uint64_t interval_ms) {
+    if ( !name ) {
+        shm_detach();
+
+        return 1;
+    }
+    if ( interval_ms ) {
+        __atomic_store_n(&shm_interval_ns, interval_ms * 1000000ull, __ATOMIC_RELAXED);
+    }
+    if ( shm_area ) {
+        monitor_wake();
+
+        return shm_self != NULL;
+    }
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if ( fd == -1 ) {
+        return 0;
+    }
+    struct stat st;
+    if ( fstat(fd, &st) == -1 || ((size_t)st.st_size < sizeof(malloc_stat_shm)
+        && ftruncate(fd, sizeof(malloc_stat_shm)) == -1) )
+    {
+        close(fd);
+        return 0;
+    }
+    void *p = mmap(NULL, sizeof(malloc_stat_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( p == MAP_FAILED ) {
+        return 0;
+    }
+
+    /* the first process of the tree fills the header */
+    malloc_stat_shm *area = (malloc_stat_shm *)p;
+    if ( __atomic_load_n(&area->magic, __ATOMIC_ACQUIRE) != MALLOC_STAT_SHM_MAGIC ) {
+        area->workers = MALLOC_STAT_SHM_WORKERS;
+        area->pid = (uint32_t)process_id();
+        __atomic_store_n(&area->magic, MALLOC_STAT_SHM_MAGIC, __ATOMIC_RELEASE);
+    }
+    shm_area = area;
+    shm_self = shm_claim();
+    if ( !shm_self ) {
+        return 0;
+    }
+    shm_publish();
+
+    return monitor_start();
+}
+
+/* fork part
+ *
+ * a forked child inherits the counters and the tables of the parent, with
+ * MALLOC_STAT_FORK_RESET it zeroes its counters. it logs into its own
+ * `<log_path>.<pid>` or ring `<log_ring>.<pid>` starting with its own
+ * header, the position of the ring is not shared with the parent. a log
+ * written into the inherited fd only is kept, the entries carry the pid.
+ * the threads of the library do not exist in the child, so the monitor
+ * thread is started again and the locks they could hold are released.
+ */
+
+static uint32_t fork_flags = 0;
+
+uint32_t malloc_stat_set_fork(uint32_t flags) {
+    uint32_t prev = fork_flags;
+    fork_flags = flags;
+
+    return prev;
+}
+
+/* switches the log of the child to its own file or ring */
+static int fork_log(void) {
+    if ( memlog_fd == MALLOC_STAT_RING_FD ) {
+        for ( uint32_t i = 0; i < ring_count; ++i ) {
+            munmap(ring_segments[i], MALLOC_STAT_RING_HEADER + ring_size);
+            ring_segments[i] = NULL;
+        }
+        munmap(ring_head, ring_size / 2);
+        ring_pos = 0;
+        ring_last = 0;
+
+        char path[sizeof(ring_path)];
+        if ( snprintf(path, sizeof(path), "%s.%u", ring_path, (unsigned)process_id()) >= (int)sizeof(path) ) {
+            return 0;
+        }
+        memcpy(ring_path, path, sizeof(ring_path));
+
+        return ring_setup(getppid());
+    }
+    if ( log_path[0] ) {
+        char path[sizeof(log_path)];
+        if ( snprintf(path, sizeof(path), "%s.%u", log_path, (unsigned)process_id()) >= (int)sizeof(path) ) {
+            return 0;
+        }
+        memcpy(log_path, path, sizeof(log_path));
+
+        int fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if ( fd == -1 ) {
+            return 0;
+        }
+        close(memlog_fd);
+        memlog_fd = fd;
+    }
+
+    return 1;
 }
 
-/**
- * Copy data from file to the log.
- */
-static inline void copyfile(const char *head, const char *path, int outfd) {
-    int fd = -1;
-    char buf[BUFSIZ];
-    ssize_t len = 0;
-    size_t head_len = myStrlen(head);
-    // no warning here, it will be simply missing in log
-    if ( (fd = open(path, 0)) == -1 ) {
-        return;
+static void atfork_child(void) {
+    process_pid = 0;
+    thread_tid = 0;
+    /* held by the threads of the parent missing in the child, released
+     * before anything below takes them */
+    shm_lock = 0;
+    slow_lock = 0;
+    module_lock = 0;
+    if ( module_seq & 1 ) {
+        module_seq = module_seq + 1;
+    }
+    pthread_mutex_init(&sym_mutex, NULL);
+    pthread_mutex_init(&leak_tick_mutex, NULL);
+    pthread_mutex_init(&leak_mutex, NULL);
+    pthread_mutex_init(&budget_mutex, NULL);
+    pthread_mutex_init(&resident_mutex, NULL);
+    pthread_cond_init(&resident_cond, NULL);
+    resident_requested = resident_done = 0;
+    sem_init(&monitor_sem, 0, 0);
+    leak_ticks = 0;
+
+    if ( fork_flags & MALLOC_STAT_FORK_RESET ) {
+        malloc_stat_get_stat(MALLOC_STAT_RESET);
     }
 
-    write(outfd, head, head_len);
-    // ignoring EINTR here, use SA_RESTART to fix if problem
-    while ( (len = read(fd, buf, sizeof(buf))) > 0 ) {
-        write(outfd, buf, len);
+    if ( memlog_enabled ) {
+        memlog_enabled = fork_log();
+        /* the ring gets the header by ring_setup() */
+        if ( memlog_enabled && memlog_fd != MALLOC_STAT_RING_FD && log_path[0] ) {
+            log_header(memlog_fd, getppid());
+        }
     }
-    close(fd);
 
-    return;
+    if ( shm_area ) {
+        shm_self = shm_claim();
+        shm_publish();
+    }
+    if ( !monitor_idle() ) {
+        monitor_start();
+    }
 }
 
-/* During initialization while the real_* pointer are being set up we can not pass malloc calls to the real
- * malloc.
- * During this time malloc calls allocate memory in this area.
- * After initialization is done this buffer is no longer used.
+/* monitor part
+ *
+ * the background thread sampling the leak trend, publishing the shared
+ * counters and checking the memory budgets. it also writes the summary and the reports on the
+ * `dump_signal` and toggles the passthrough mode on the `toggle_signal`,
+ * the handlers only post the semaphore waking it up.
  */
-#define STATIC_SIZE 1024
-static char static_buffer[STATIC_SIZE];
-static int static_pointer = 0;
 
-/* stat variables */
-static uint64_t total_allocations = 0;
-static uint64_t total_deallocations = 0;
-// static uint64_t simult_allocations = 0; // WIP
-// static uint64_t peak_allocations = 0;
+/* true if the monitor thread has nothing to do */
+static bool monitor_idle(void) {
+    return !(collectors & MALLOC_STAT_COLLECT_LEAKS)
+        && !__atomic_load_n(&shm_self, __ATOMIC_RELAXED)
+        && !__atomic_load_n(&budget_num, __ATOMIC_RELAXED)
+        && !dump_signal
+        && !passthrough_signal;
+}
 
-static uint64_t total_allocated = 0;
-static uint64_t total_deallocated = 0;
-static uint64_t simult_in_use = 0;
-static uint64_t peak_in_use = 0;
+/* gives up monitor_pid, false if a work came meanwhile and the thread goes on */
+static bool monitor_stop(void) {
+    pid_t self = process_id();
+    __atomic_store_n(&monitor_pid, 0, __ATOMIC_SEQ_CST);
+    if ( monitor_idle() ) {
+        return true;
+    }
 
-/* helpers */
-#ifndef MALLOC_STAT_ATOMICS_DISABLED
-#   define MALLOC_STAT_ATOMIC_LOAD(var) \
-        __atomic_load_n(&var, __ATOMIC_SEQ_CST)
+    /* monitor_start() could have seen the thread running before the store */
+    pid_t none = 0;
+    return !__atomic_compare_exchange_n(&monitor_pid, &none, self, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
 
-#   define MALLOC_STAT_ATOMIC_STORE(var, val) \
-        __atomic_store_n(&var, val, __ATOMIC_RELAXED)
+static void* monitor_thread(void *arg) {
+    (void)arg;
 
-#   define MALLOC_STAT_INC_ALLOCATIONS() \
-        __atomic_add_fetch(&total_allocations, 1, __ATOMIC_RELAXED)
+    thread_passthrough = 1;
+    pthread_setname_np(pthread_self(), "malloc-stat-mon");
 
-#   define MALLOC_STAT_INC_DEALLOCATIONS() \
-        __atomic_add_fetch(&total_deallocations, 1, __ATOMIC_RELAXED)
+    uint64_t leak_next = 0, shm_next = 0, budget_next = 0;
+    for ( ;; ) {
+        uint64_t now = now_ns(), wake = UINT64_MAX;
 
-#   define MALLOC_STAT_ADD_ALLOCATED(size) \
-        __atomic_add_fetch(&total_allocated, size, __ATOMIC_RELAXED)
+        if ( collectors & MALLOC_STAT_COLLECT_LEAKS ) {
+            uint64_t interval = __atomic_load_n(&leak_interval_ns, __ATOMIC_RELAXED);
+            /* the interval could be shortened meanwhile */
+            if ( now >= leak_next || leak_next - now > interval ) {
+                leak_sample(now);
+                leak_next = now + interval;
+            }
+            wake = leak_next;
+        }
+        if ( shm_self ) {
+            uint64_t interval = __atomic_load_n(&shm_interval_ns, __ATOMIC_RELAXED);
+            if ( now >= shm_next || shm_next - now > interval ) {
+                shm_publish();
+                shm_next = now + interval;
+            }
+            wake = shm_next < wake ? shm_next : wake;
+        }
+        if ( __atomic_load_n(&budget_num, __ATOMIC_RELAXED) ) {
+            uint64_t interval = __atomic_load_n(&budget_interval_ns, __ATOMIC_RELAXED);
+            if ( now >= budget_next || budget_next - now > interval ) {
+                budget_tick();
+                budget_next = now + interval;
+            }
+            wake = budget_next < wake ? budget_next : wake;
+        }
 
-#   define MALLOC_STAT_ADD_DEALLOCATED(size) \
-        __atomic_add_fetch(&total_deallocated, size, __ATOMIC_RELAXED)
+        if ( wake == UINT64_MAX && !dump_signal && !passthrough_signal ) {
+            if ( monitor_stop() ) {
+                break;
+            }
+            continue;
+        }
+        if ( wake == UINT64_MAX ) {
+            sem_wait(&monitor_sem);
+        } else {
+            struct timespec ts = {(time_t)(wake / 1000000000u), (long)(wake % 1000000000u)};
+            sem_clockwait(&monitor_sem, CLOCK_MONOTONIC, &ts);
+        }
 
-#   define MALLOC_STAT_ADD_IN_USE(size) \
-        __atomic_add_fetch(&simult_in_use, size, __ATOMIC_RELAXED)
+        if ( passthrough_pending ) {
+            passthrough_pending = 0;
+            malloc_stat_set_passthrough(!passthrough);
+        }
+        if ( dump_pending ) {
+            dump_pending = 0;
+            stat_dump(memlog_enabled ? memlog_fd : STDERR_FILENO);
+        }
+    }
 
-#   define MALLOC_STAT_SUB_IN_USE(size) \
-        __atomic_sub_fetch(&simult_in_use, size, __ATOMIC_RELAXED)
+    return NULL;
+}
 
-#   define MALLOC_STAT_UPDATE_PEAK() \
-        for ( uint64_t peak = __atomic_load_n(&peak_in_use, __ATOMIC_SEQ_CST) \
-             ,in_use = __atomic_load_n(&simult_in_use, __ATOMIC_SEQ_CST) \
-            ; \
-              peak < in_use \
-            ; \
-              peak = __atomic_load_n(&peak_in_use, __ATOMIC_SEQ_CST) \
-             ,in_use = __atomic_load_n(&simult_in_use, __ATOMIC_SEQ_CST) \
-        ) { \
-            if ( __atomic_compare_exchange_n( \
-                 &peak_in_use \
-                ,&peak \
-                ,in_use \
-                ,false \
-                ,__ATOMIC_SEQ_CST \
-                ,__ATOMIC_RELAXED \
-            ) ) { \
-                break; \
-            }\
-        }
-#else // MALLOC_STAT_ATOMICS_DISABLED
-#   define MALLOC_STAT_ATOMIC_LOAD(var) \
-        var
+/* starts the monitor thread once per process or wakes it up. the thread
+ * of the parent does not exist in the forked child, so it is started again
+ * there, and it exits once it has nothing to do. monitor_pid is claimed by
+ * a CAS, so the concurrent callers start one thread only.
+ */
+static int monitor_start(void) {
+    pid_t self = process_id();
+    /* pairs with monitor_stop(), the work is published before the load */
+    pid_t pid = __atomic_load_n(&monitor_pid, __ATOMIC_SEQ_CST);
+    if ( pid == self
+        || !__atomic_compare_exchange_n(&monitor_pid, &pid, self, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) )
+    {
+        sem_post(&monitor_sem);
 
-#   define MALLOC_STAT_ATOMIC_STORE(var, val) \
-        var = val
+        return 1;
+    }
 
-#   define MALLOC_STAT_INC_ALLOCATIONS() \
-        total_allocations += 1
+    sigset_t all, prev;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &prev);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, monitor_thread, NULL);
+    pthread_attr_destroy(&attr);
+
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+    if ( err ) {
+        __atomic_store_n(&monitor_pid, 0, __ATOMIC_RELEASE);
+        return 0;
+    }
 
-#   define MALLOC_STAT_INC_DEALLOCATIONS() \
-        total_deallocations += 1
+    return 1;
+}
 
-#   define MALLOC_STAT_ADD_ALLOCATED(size) \
-        total_allocated += size
+static void monitor_wake(void) {
+    if ( __atomic_load_n(&monitor_pid, __ATOMIC_ACQUIRE) == process_id() ) {
+        sem_post(&monitor_sem);
+    }
+}
 
-#   define MALLOC_STAT_ADD_DEALLOCATED(size) \
-        total_deallocated += size
+static void dump_handler(int sig) {
+    int saved_errno = errno;
+    (void)sig;
 
-#   define MALLOC_STAT_ADD_IN_USE(size) \
-        simult_in_use += size
+    dump_pending = 1;
+    monitor_wake();
+    errno = saved_errno;
+}
 
-#   define MALLOC_STAT_SUB_IN_USE(size) \
-        simult_in_use -= size
+/* options part
+ *
+ * MALLOC_STAT_OPTIONS holds `name=value` pairs separated by `:`, e.g.
+ * MALLOC_STAT_OPTIONS=log_path=/tmp/app.log:sample=16:collect=churn,xthread
+ * it's parsed in place because malloc() is not available yet.
+ */
 
-#   define MALLOC_STAT_UPDATE_PEAK() \
-        peak_in_use = (peak_in_use < simult_in_use) \
-            ? simult_in_use \
-            : peak_in_use
+typedef struct {
+    const char *name;
+    uint32_t mask;
+} malloc_stat_collector_name;
+
+static const malloc_stat_collector_name collector_names[] = {
+     {"churn", MALLOC_STAT_COLLECT_CHURN}
+    ,{"realloc", MALLOC_STAT_COLLECT_REALLOC}
+    ,{"xthread", MALLOC_STAT_COLLECT_XTHREAD}
+    ,{"false_sharing", MALLOC_STAT_COLLECT_FALSE_SHARING}
+    ,{"slack", MALLOC_STAT_COLLECT_SLACK}
+    ,{"resident", MALLOC_STAT_COLLECT_RESIDENT}
+    ,{"leaks", MALLOC_STAT_COLLECT_LEAKS}
+    ,{"numa", MALLOC_STAT_COLLECT_NUMA}
+    ,{"classes", MALLOC_STAT_COLLECT_CLASSES}
+    ,{"all", UINT32_MAX}
+};
+
+static const malloc_stat_collector_name fork_names[] = {
+     {"reset", MALLOC_STAT_FORK_RESET}
+};
+
+/* the collectors set by the options, enabled at the end of the init */
+static uint32_t options_collectors = 0;
+
+/* the latency sample rate set by the options, enabled at the end of the init */
+static uint32_t options_latency = 0;
+
+/* the slow calls threshold set by the options, enabled at the end of the init */
+static uint64_t options_slow_ns = 0;
+
+/* the per module accounting set by the options, enabled at the end of the init */
+static int options_modules = 0;
+
+/* start in the passthrough mode */
+static int options_passthrough = 0;
+
+/* the memory budget of the process set by the options, set at the end of the init */
+static uint64_t options_budget[2] = {0, 0};
+
+/* the shared counters set by the options, attached at the end of the init */
+static char options_shm[256];
+
+/* compares the token [begin, end) with the name */
+static bool token_is(const char *begin, const char *end, const char *name) {
+    for ( ; begin < end && *name; ++begin, ++name ) {
+        if ( *begin != *name ) {
+            return false;
+        }
+    }
 
-#endif // MALLOC_STAT_ATOMICS_DISABLED
+    return begin == end && !*name;
+}
 
-/* backtrace part
- */
+static uint64_t token_uint(const char *begin, const char *end) {
+    uint64_t res = 0;
+    for ( ; begin < end && *begin >= '0' && *begin <= '9'; ++begin ) {
+        res = res * 10 + (*begin - '0');
+    }
 
-#define MALLOC_STAT_BACKTRACE_SIZE 20
+    return res;
+}
 
-typedef struct {
-    int nptrs;
-    void* ptrs[MALLOC_STAT_BACKTRACE_SIZE + 1];
-} backtrace_stack;
+/* rounds up to a power of two, at least 64 */
+static uint32_t token_pow2(const char *begin, const char *end) {
+    uint64_t val = token_uint(begin, end);
+    uint32_t res = 64;
+    for ( ; res < val && res < (1u << 30); res <<= 1 )
+    {}
 
-/* stat routine */
-malloc_stat_vars malloc_stat_get_stat(malloc_stat_operation op) {
-    malloc_stat_vars res;
+    return res;
+}
 
-    /* just a compile-time test for lock-free ops on uint64_t */
-    char _[__atomic_always_lock_free(sizeof(res.allocations), &(res.allocations)) ? 1 : -1]; (void)_;
+static void option_warn(const char *what, const char *begin, const char *end) {
+    write(STDERR_FILENO, "malloc-stat: ", 13);
+    write(STDERR_FILENO, what, myStrlen(what));
+    write(STDERR_FILENO, begin, end - begin);
+    write(STDERR_FILENO, "\n", 1);
+}
 
-    switch ( op ) {
-        case MALLOC_STAT_GET: break;
-        case MALLOC_STAT_RESET: {
-            MALLOC_STAT_ATOMIC_STORE(total_allocations, 0);
-            MALLOC_STAT_ATOMIC_STORE(total_allocated, 0);
-            MALLOC_STAT_ATOMIC_STORE(total_deallocations, 0);
-            MALLOC_STAT_ATOMIC_STORE(total_deallocated, 0);
-            MALLOC_STAT_ATOMIC_STORE(simult_in_use, 0);
-            MALLOC_STAT_ATOMIC_STORE(peak_in_use, 0);
-        } break;
+/* the mask of the names separated by `,` */
+static uint32_t option_mask(const malloc_stat_collector_name *names, size_t n, const char *what
+    ,const char *begin, const char *end)
+{
+    uint32_t mask = 0;
+    while ( begin < end ) {
+        const char *sep = begin;
+        for ( ; sep < end && *sep != ','; ++sep )
+        {}
+
+        size_t i = 0;
+        for ( ; i < n && !token_is(begin, sep, names[i].name); ++i )
+        {}
+        if ( i < n ) {
+            mask |= names[i].mask;
+        } else {
+            option_warn(what, begin, sep);
+        }
+
+        begin = sep < end ? sep + 1 : sep;
     }
 
-    res.allocations   = MALLOC_STAT_ATOMIC_LOAD(total_allocations);
-    res.allocated     = MALLOC_STAT_ATOMIC_LOAD(total_allocated);
-    res.deallocations = MALLOC_STAT_ATOMIC_LOAD(total_deallocations);
-    res.deallocated   = MALLOC_STAT_ATOMIC_LOAD(total_deallocated);
-    res.in_use        = MALLOC_STAT_ATOMIC_LOAD(simult_in_use);
-    res.peak_in_use   = MALLOC_STAT_ATOMIC_LOAD(peak_in_use);
+    return mask;
+}
 
-    return res;
+static uint32_t option_collectors(const char *begin, const char *end) {
+    return option_mask(collector_names, sizeof(collector_names) / sizeof(collector_names[0])
+        ,"unknown collector: ", begin, end);
 }
 
-void malloc_stat_change_log_state(int op) {
-    memlog_enabled = op;
+static uint32_t option_fork(const char *begin, const char *end) {
+    return option_mask(fork_names, sizeof(fork_names) / sizeof(fork_names[0])
+        ,"unknown fork mode: ", begin, end);
 }
 
-void malloc_stat_set_log_fd(int fd) {
-    memlog_fd = fd;
+static void option_apply(const char *name, const char *name_end, const char *val, const char *end) {
+    if ( token_is(name, name_end, "log") ) {
+        memlog_enabled = token_uint(val, end) != 0;
+    } else if ( token_is(name, name_end, "log_fd") ) {
+        memlog_fd = (int)token_uint(val, end);
+        memlog_enabled = true;
+    } else if ( token_is(name, name_end, "log_path") ) {
+        size_t len = end - val < (ptrdiff_t)sizeof(log_path) ? (size_t)(end - val) : sizeof(log_path) - 1;
+        memcpy(log_path, val, len);
+        log_path[len] = '\0';
+
+        int fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if ( fd == -1 ) {
+            option_warn("can't open the log: ", val, end);
+            log_path[0] = '\0';
+            return;
+        }
+        memlog_fd = fd;
+        memlog_enabled = true;
+    } else if ( token_is(name, name_end, "log_ring") ) {
+        size_t len = end - val < (ptrdiff_t)sizeof(ring_path) ? (size_t)(end - val) : sizeof(ring_path) - 1;
+        memcpy(ring_path, val, len);
+        ring_path[len] = '\0';
+    } else if ( token_is(name, name_end, "ring_size") ) {
+        ring_size = token_uint(val, end);
+    } else if ( token_is(name, name_end, "ring_segments") ) {
+        ring_count = (uint32_t)token_uint(val, end);
+    } else if ( token_is(name, name_end, "log_format") ) {
+        if ( token_is(val, end, "text") ) {
+            memlog_format = MALLOC_STAT_LOG_TEXT;
+        } else if ( token_is(val, end, "timed") ) {
+            memlog_format = MALLOC_STAT_LOG_TIMED;
+        } else {
+            option_warn("unknown log format: ", val, end);
+        }
+    } else if ( token_is(name, name_end, "bt_depth") ) {
+        uint64_t depth = token_uint(val, end);
+        backtrace_depth = depth < MALLOC_STAT_BACKTRACE_SIZE ? (int)depth : MALLOC_STAT_BACKTRACE_SIZE;
+    } else if ( token_is(name, name_end, "sample") ) {
+        malloc_stat_set_sample_rate((uint32_t)token_uint(val, end));
+    } else if ( token_is(name, name_end, "collect") ) {
+        options_collectors = option_collectors(val, end);
+    } else if ( token_is(name, name_end, "blocks") ) {
+        blocks_size = token_pow2(val, end);
+    } else if ( token_is(name, name_end, "sites") ) {
+        sites_size = token_pow2(val, end);
+    } else if ( token_is(name, name_end, "latency") ) {
+        options_latency = (uint32_t)token_uint(val, end);
+    } else if ( token_is(name, name_end, "slow_ns") ) {
+        options_slow_ns = token_uint(val, end);
+    } else if ( token_is(name, name_end, "module_blocks") ) {
+        module_blocks_size = token_pow2(val, end);
+    } else if ( token_is(name, name_end, "modules") ) {
+        options_modules = token_uint(val, end) != 0;
+    } else if ( token_is(name, name_end, "symbolize") ) {
+        symbolize_enabled = token_uint(val, end) != 0;
+    } else if ( token_is(name, name_end, "passthrough") ) {
+        options_passthrough = token_uint(val, end) != 0;
+    } else if ( token_is(name, name_end, "toggle_signal") ) {
+        passthrough_signal = (int)token_uint(val, end);
+    } else if ( token_is(name, name_end, "metrics") ) {
+        if ( val < end && *val == '/' ) {
+            size_t len = end - val < (ptrdiff_t)sizeof(metrics_path) ? (size_t)(end - val) : sizeof(metrics_path) - 1;
+            memcpy(metrics_path, val, len);
+            metrics_path[len] = '\0';
+        } else {
+            metrics_port = (uint16_t)token_uint(val, end);
+        }
+    } else if ( token_is(name, name_end, "fork") ) {
+        fork_flags = option_fork(val, end);
+    } else if ( token_is(name, name_end, "shm") ) {
+        size_t len = end - val < (ptrdiff_t)sizeof(options_shm) ? (size_t)(end - val) : sizeof(options_shm) - 1;
+        memcpy(options_shm, val, len);
+        options_shm[len] = '\0';
+    } else if ( token_is(name, name_end, "shm_interval") ) {
+        shm_interval_ns = token_uint(val, end) * 1000000ull;
+    } else if ( token_is(name, name_end, "budget") ) {
+        const char *sep = val;
+        for ( ; sep < end && *sep != ','; ++sep )
+        {}
+        options_budget[MALLOC_STAT_BUDGET_SOFT] = token_uint(val, sep);
+        options_budget[MALLOC_STAT_BUDGET_HARD] = sep < end ? token_uint(sep + 1, end) : 0;
+    } else if ( token_is(name, name_end, "budget_interval") ) {
+        malloc_stat_set_budget_interval(token_uint(val, end));
+    } else if ( token_is(name, name_end, "dump_signal") ) {
+        dump_signal = (int)token_uint(val, end);
+    } else if ( token_is(name, name_end, "leak_interval") ) {
+        malloc_stat_set_leak_interval(token_uint(val, end));
+    } else if ( token_is(name, name_end, "resident_min") ) {
+        resident_min = token_uint(val, end);
+    } else if ( token_is(name, name_end, "churn_ns") ) {
+        churn_window_ns = token_uint(val, end);
+    } else if ( token_is(name, name_end, "churn_events") ) {
+        churn_window_events = token_uint(val, end);
+    } else {
+        option_warn("unknown option: ", name, name_end);
+    }
 }
 
-uint32_t malloc_stat_get_version() {
-    return MALLOC_STAT_VERSION;
+static void options_parse(const char *opts) {
+    if ( !opts ) {
+        return;
+    }
+
+    while ( *opts ) {
+        const char *name = opts, *name_end = opts;
+        for ( ; *name_end && *name_end != '=' && *name_end != ':'; ++name_end )
+        {}
+
+        const char *val = *name_end == '=' ? name_end + 1 : name_end;
+        const char *end = val;
+        for ( ; *end && *end != ':'; ++end )
+        {}
+
+        if ( name_end != name ) {
+            option_apply(name, name_end, val, end);
+        }
+        opts = *end ? end + 1 : end;
+    }
 }
 
 /*
  *  LIBRARY INIT/FINI FUNCTIONS
  */
 
+/* the process information starting the log, `ppid` is given by the forked child */
+static void log_header(int fd, pid_t ppid) {
+    int s;
+    char path[256];
+    char buf[LOG_BUFSIZE + sizeof(path)];
+
+    s = snprintf(buf, sizeof(buf), "# PID %u\n", process_id());
+    log_write(fd, buf, s);
+
+    if ( ppid ) {
+        s = snprintf(buf, sizeof(buf), "# PARENT %u\n", ppid);
+        log_write(fd, buf, s);
+    }
+
+    s = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if ( s > 1 ) {
+        path[s] = '\0';
+        s = snprintf(buf, sizeof(buf), "# EXE %s\n", path);
+        log_write(fd, buf, s);
+    }
+
+    s = readlink("/proc/self/cwd", path, sizeof(path) - 1);
+    if ( s > 1 ) {
+        path[s] = '\0';
+        s = snprintf(buf, sizeof(buf), "# CWD %s\n", path);
+        log_write(fd, buf, s);
+    }
+    copyfile("# MAPS\n", "/proc/self/maps", fd);
+}
+
 int malloc_stat_init_lib(void) {
     /* check already initialized */
     if ( !__sync_bool_compare_and_swap(&init_done,
@@ -342,8 +5684,19 @@ int malloc_stat_init_lib(void) {
         return 1;
     }
 
+    sem_init(&monitor_sem, 0, 0);
+    options_parse(getenv(MALLOC_STAT_OPTIONS_ENV));
+    if ( ring_path[0] ) {
+        if ( ring_setup(0) ) {
+            memlog_fd = MALLOC_STAT_RING_FD;
+            memlog_enabled = true;
+        } else {
+            option_warn("can't map the log ring: ", ring_path, ring_path + myStrlen(ring_path));
+        }
+    }
+
     if ( memlog_enabled ) {
-        int w = write(memlog_fd, "INIT\n", 5);
+        int w = log_write(memlog_fd, "INIT\n", 5);
         /* auto-disable trace if file is not open  */
         if ( w == -1 && errno == EBADF ) {
             write(STDERR_FILENO, "1022_CLOSED\n", 12);
@@ -365,43 +5718,94 @@ int malloc_stat_init_lib(void) {
     DL_RESOLVE(pvalloc);
     DL_RESOLVE(aligned_alloc);
 
+    pthread_atfork(NULL, NULL, atfork_child);
+    self_range_init();
+
     __sync_bool_compare_and_swap(&init_done,
         LOG_MALLOC_INIT_STARTED, LOG_MALLOC_INIT_DONE);
 
-    //TODO: call backtrace here to init itself
+    /* the first call of backtrace() loads libgcc_s which calls malloc() */
+    if ( backtrace_depth ) {
+        void *frames[1];
+        in_trace = 1;
+        backtrace(frames, 1);
+        in_trace = 0;
+    }
+
+    if ( options_collectors ) {
+        malloc_stat_set_collectors(options_collectors);
+    }
+    if ( options_latency ) {
+        malloc_stat_set_latency_sample(options_latency);
+    }
+    if ( options_slow_ns ) {
+        malloc_stat_set_slow_threshold(options_slow_ns);
+    }
+    if ( options_modules ) {
+        malloc_stat_set_modules(1);
+    }
+    if ( options_passthrough ) {
+        malloc_stat_set_passthrough(1);
+    }
+    if ( passthrough_signal && monitor_start() ) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = passthrough_handler;
+        sa.sa_flags = SA_RESTART;
+        sigaction(passthrough_signal, &sa, NULL);
+    }
+    if ( options_shm[0] && !malloc_stat_set_shm(options_shm, 0) ) {
+        option_warn("can't attach the shared counters: ", options_shm, options_shm + myStrlen(options_shm));
+    }
+    if ( (options_budget[MALLOC_STAT_BUDGET_SOFT] || options_budget[MALLOC_STAT_BUDGET_HARD])
+        && !malloc_stat_set_budget(NULL, options_budget[MALLOC_STAT_BUDGET_SOFT]
+            ,options_budget[MALLOC_STAT_BUDGET_HARD], MALLOC_STAT_BUDGET_DUMP, NULL, NULL) )
+    {
+        write(STDERR_FILENO, "malloc-stat: can't watch the memory budget\n", 43);
+    }
+    if ( dump_signal && monitor_start() ) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = dump_handler;
+        sa.sa_flags = SA_RESTART;
+        sigaction(dump_signal, &sa, NULL);
+    }
+    if ( metrics_path[0] || metrics_port ) {
+        metrics_start();
+    }
 
     /* post-init status */
     if( memlog_enabled ) {
-        int s;
-        char path[256];
-        char buf[LOG_BUFSIZE + sizeof(path)];
-
-        s = snprintf(buf, sizeof(buf), "# PID %u\n", getpid());
-        MALLOC_STAT_WRITE_LOG(buf, s);
-
-        s = readlink("/proc/self/exe", path, sizeof(path));
-        if ( s > 1 ) {
-            path[s] = '\0';
-            s = snprintf(buf, sizeof(buf), "# EXE %s\n", path);
-            MALLOC_STAT_WRITE_LOG(buf, s);
+        /* the ring got the header at the setup */
+        if ( memlog_fd != MALLOC_STAT_RING_FD ) {
+            log_header(memlog_fd, 0);
         }
-
-        s = readlink("/proc/self/cwd", path, sizeof(path));
-        if ( s > 1 ) {
-            path[s] = '\0';
-            s = snprintf(buf, sizeof(buf), "# CWD %s\n", path);
-            MALLOC_STAT_WRITE_LOG(buf, s);
-        }
-        copyfile("# MAPS\n", "/proc/self/maps", memlog_fd);
-
-        s = snprintf(buf, sizeof(buf), "+ INIT \n-\n");
-        log_mem("INIT", &static_buffer, static_pointer);
-        // MALLOC_STAT_WRITE_LOG(buf, s);
+        log_mem("INIT", &static_buffer, static_pointer, NULL);
     }
 
     return 0;
 }
 
+/* the summary followed by the reports, written at the FINI stage and on the `dump_signal` */
+static void stat_dump(int fd) {
+    char buf[LOG_BUFSIZE];
+
+    int s = snprintf(
+         buf, sizeof(buf)
+        ,"+==========================================================================+\n"
+         "| allocs  : %-14" PRIu64 "| deallocs: %-14" PRIu64 "| inuse: %-14" PRIu64 "|\n"
+         "| AL bytes: %-14" PRIu64 "| DE bytes: %-14" PRIu64 "| peak : %-14" PRIu64 "|\n"
+         "| RQ bytes: %-14" PRIu64 "| slack   : %-14" PRIu64 "|                      |\n"
+         "+==========================================================================+\n"
+        ,total_allocations, total_deallocations, in_use_bytes(simult_in_use)
+        ,total_allocated, total_deallocated, in_use_bytes(peak_in_use)
+        ,total_requested, total_allocated - total_requested
+    );
+
+    log_write(fd, buf, s);
+    malloc_stat_report(fd);
+}
+
 void malloc_stat_fini_lib(void) {
     /* check already finalized */
     if ( !__sync_bool_compare_and_swap(&init_done,
@@ -414,18 +5818,24 @@ void malloc_stat_fini_lib(void) {
         int s;
         char buf[LOG_BUFSIZE];
 
-        s = snprintf(
-             buf, sizeof(buf)
-            ,"+==========================================================================+\n"
-             "| allocs  : %-14" PRIu64 "| deallocs: %-14" PRIu64 "| inuse: %-14" PRIu64 "|\n"
-             "| AL bytes: %-14" PRIu64 "| DE bytes: %-14" PRIu64 "| peak : %-14" PRIu64 "|\n"
-             "+==========================================================================+\n"
-            ,total_allocations, total_deallocations, simult_in_use
-            ,total_allocated, total_deallocated, peak_in_use
-        );
+        stat_dump(memlog_fd);
 
-        s += snprintf(buf + s, sizeof(buf) - s, "+ FINI\n");
+        s = snprintf(buf, sizeof(buf), "+ FINI\n");
         MALLOC_STAT_WRITE_LOG(buf, s);
+
+        if ( memlog_fd == MALLOC_STAT_RING_FD ) {
+            ring_close();
+            memlog_enabled = false;
+        }
+    }
+
+    if ( shm_self ) {
+        shm_publish();
+        __atomic_store_n(&shm_self->state, MALLOC_STAT_SHM_EXITED, __ATOMIC_RELEASE);
+    }
+
+    if ( metrics_fd != -1 && metrics_path[0] ) {
+        unlink(metrics_path);
     }
 
     return;
@@ -468,44 +5878,60 @@ static inline void * calloc_static(size_t nmemb, size_t size) {
  */
 
 void* malloc(size_t size) {
+    MALLOC_STAT_PASSTHROUGH(real_malloc(size));
+
     if ( !DL_RESOLVE_CHECK(malloc) ) {
         return calloc_static(size, 1);
     }
 
     MALLOC_STAT_INC_ALLOCATIONS();
 
+    uint64_t start = MALLOC_STAT_LATENCY_BEGIN();
     void *ret = real_malloc(size);
+    MALLOC_STAT_LATENCY_END(MALLOC_STAT_LATENCY_MALLOC, start, size);
     size_t allocated = malloc_usable_size(ret);
 
-    MALLOC_STAT_ADD_ALLOCATED(allocated);
+    MALLOC_STAT_ADD_ALLOCATED(allocated, ret ? size : 0);
     MALLOC_STAT_ADD_IN_USE(allocated);
     MALLOC_STAT_UPDATE_PEAK();
 
+    MALLOC_STAT_MODULE_ALLOC(allocated, ret ? size : 0, __builtin_return_address(0), ret);
+
     MALLOC_STAT_TRACE("malloc", ret, allocated);
+    MALLOC_STAT_COLLECT_ALLOC(ret, size, __builtin_return_address(0));
 
     return ret;
 }
 
 void* calloc(size_t nmemb, size_t size) {
+    MALLOC_STAT_PASSTHROUGH(real_calloc(nmemb, size));
+
     if ( !DL_RESOLVE_CHECK(calloc) ) {
         return calloc_static(nmemb, size);
     }
 
     MALLOC_STAT_INC_ALLOCATIONS();
 
+    uint64_t start = MALLOC_STAT_LATENCY_BEGIN();
     void *ret = real_calloc(nmemb, size);
+    MALLOC_STAT_LATENCY_END(MALLOC_STAT_LATENCY_CALLOC, start, nmemb * size);
     size_t allocated = malloc_usable_size(ret);
 
-    MALLOC_STAT_ADD_ALLOCATED(allocated);
+    MALLOC_STAT_ADD_ALLOCATED(allocated, ret ? nmemb * size : 0);
     MALLOC_STAT_ADD_IN_USE(allocated);
     MALLOC_STAT_UPDATE_PEAK();
 
+    MALLOC_STAT_MODULE_ALLOC(allocated, ret ? nmemb * size : 0, __builtin_return_address(0), ret);
+
     MALLOC_STAT_TRACE("calloc", ret, allocated);
+    MALLOC_STAT_COLLECT_ALLOC(ret, nmemb * size, __builtin_return_address(0));
 
     return ret;
 }
 
 void* realloc(void *ptr, size_t size) {
+    MALLOC_STAT_PASSTHROUGH(real_realloc(ptr, size));
+
     if ( !DL_RESOLVE_CHECK(realloc) ) {
         return NULL;
     }
@@ -515,7 +5941,12 @@ void* realloc(void *ptr, size_t size) {
         MALLOC_STAT_SUB_IN_USE(old_size);
 
         if ( size ) { // realloc case
+            MALLOC_STAT_MODULE_FREE(old_size, ptr, __builtin_return_address(0));
+            uint32_t slot = collect_realloc_begin(ptr);
+            uint64_t start = MALLOC_STAT_LATENCY_BEGIN();
             void *ret = real_realloc(ptr, size);
+            MALLOC_STAT_LATENCY_END(MALLOC_STAT_LATENCY_REALLOC, start, size);
+            collect_realloc_end(slot, ptr, ret, size, old_size);
             size_t new_size = malloc_usable_size(ret);
 
             MALLOC_STAT_ADD_IN_USE(new_size);
@@ -525,32 +5956,48 @@ void* realloc(void *ptr, size_t size) {
             MALLOC_STAT_INC_ALLOCATIONS();
 
             MALLOC_STAT_ADD_DEALLOCATED(old_size);
-            MALLOC_STAT_ADD_ALLOCATED(new_size);
+            MALLOC_STAT_ADD_ALLOCATED(new_size, ret ? size : 0);
 
-            MALLOC_STAT_TRACE((ptr != ret ? "realloc-realloc" : "realloc-inplace"), ret, new_size);
+            MALLOC_STAT_MODULE_ALLOC(new_size, ret ? size : 0, __builtin_return_address(0), ret);
+
+            if ( ptr != ret ) {
+                MALLOC_STAT_TRACE_MOVE("realloc-realloc", ret, new_size, ptr);
+            } else {
+                MALLOC_STAT_TRACE("realloc-inplace", ret, new_size);
+            }
 
             return ret;
         } else { // free case
             MALLOC_STAT_INC_DEALLOCATIONS();
             MALLOC_STAT_ADD_DEALLOCATED(old_size);
+            MALLOC_STAT_MODULE_FREE(old_size, ptr, __builtin_return_address(0));
 
             MALLOC_STAT_TRACE("realloc-free", ptr, old_size);
+            MALLOC_STAT_COLLECT_FREE(ptr);
+
+            uint64_t start = MALLOC_STAT_LATENCY_BEGIN();
+            void *ret = real_realloc(ptr, 0);
+            MALLOC_STAT_LATENCY_END(MALLOC_STAT_LATENCY_REALLOC, start, old_size);
 
-            return real_realloc(ptr, 0);
+            return ret;
         }
     }
 
     if ( size ) { // malloc case
+        uint64_t start = MALLOC_STAT_LATENCY_BEGIN();
         void *ret = real_realloc(NULL, size);
+        MALLOC_STAT_LATENCY_END(MALLOC_STAT_LATENCY_REALLOC, start, size);
         size_t allocated = malloc_usable_size(ret);
         
         MALLOC_STAT_INC_ALLOCATIONS();
         MALLOC_STAT_ADD_IN_USE(allocated);
         MALLOC_STAT_UPDATE_PEAK();
 
-        MALLOC_STAT_ADD_ALLOCATED(allocated);
+        MALLOC_STAT_ADD_ALLOCATED(allocated, ret ? size : 0);
+        MALLOC_STAT_MODULE_ALLOC(allocated, ret ? size : 0, __builtin_return_address(0), ret);
 
         MALLOC_STAT_TRACE("realloc-alloc", ret, allocated);
+        MALLOC_STAT_COLLECT_ALLOC(ret, size, __builtin_return_address(0));
 
         return ret;
     }
@@ -559,101 +6006,143 @@ void* realloc(void *ptr, size_t size) {
 }
 
 void* memalign(size_t alignment, size_t size) {
+    MALLOC_STAT_PASSTHROUGH(real_memalign(alignment, size));
+
     if ( !DL_RESOLVE_CHECK(memalign) ) {
         return NULL;
     }
 
     MALLOC_STAT_INC_ALLOCATIONS();
 
+    uint64_t start = MALLOC_STAT_LATENCY_BEGIN();
     void *ret = real_memalign(alignment, size);
+    MALLOC_STAT_LATENCY_END(MALLOC_STAT_LATENCY_MEMALIGN, start, size);
     size_t allocated = malloc_usable_size(ret);
 
-    MALLOC_STAT_ADD_ALLOCATED(allocated);
+    MALLOC_STAT_ADD_ALLOCATED(allocated, ret ? size : 0);
     MALLOC_STAT_ADD_IN_USE(allocated);
     MALLOC_STAT_UPDATE_PEAK();
 
+    MALLOC_STAT_MODULE_ALLOC(allocated, ret ? size : 0, __builtin_return_address(0), ret);
+
     MALLOC_STAT_TRACE("memalign", ret, allocated);
+    MALLOC_STAT_COLLECT_ALLOC(ret, size, __builtin_return_address(0));
 
     return ret;
 }
 
 int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    MALLOC_STAT_PASSTHROUGH(real_posix_memalign(ptr, alignment, size));
+
     if ( !DL_RESOLVE_CHECK(posix_memalign) ) {
         return ENOMEM;
     }
 
     MALLOC_STAT_INC_ALLOCATIONS();
 
+    uint64_t start = MALLOC_STAT_LATENCY_BEGIN();
     int ret = real_posix_memalign(ptr, alignment, size);
+    MALLOC_STAT_LATENCY_END(MALLOC_STAT_LATENCY_POSIX_MEMALIGN, start, size);
     size_t allocated = malloc_usable_size(*ptr);
 
-    MALLOC_STAT_ADD_ALLOCATED(allocated);
+    MALLOC_STAT_ADD_ALLOCATED(allocated, ret ? 0 : size);
     MALLOC_STAT_ADD_IN_USE(allocated);
     MALLOC_STAT_UPDATE_PEAK();
 
+    MALLOC_STAT_MODULE_ALLOC(allocated, ret ? 0 : size, __builtin_return_address(0), ret ? NULL : *ptr);
+
     MALLOC_STAT_TRACE("posix_memalign", *ptr, allocated);
+    if ( !ret ) {
+        MALLOC_STAT_COLLECT_ALLOC(*ptr, size, __builtin_return_address(0));
+    }
 
     return ret;
 }
 
 void* valloc(size_t size) {
+    MALLOC_STAT_PASSTHROUGH(real_valloc(size));
+
     if ( !DL_RESOLVE_CHECK(valloc) ) {
        return NULL;
     }
 
     MALLOC_STAT_INC_ALLOCATIONS();
 
+    uint64_t start = MALLOC_STAT_LATENCY_BEGIN();
     void *ret = real_valloc(size);
+    MALLOC_STAT_LATENCY_END(MALLOC_STAT_LATENCY_VALLOC, start, size);
     size_t allocated = malloc_usable_size(ret);
 
-    MALLOC_STAT_ADD_ALLOCATED(allocated);
+    MALLOC_STAT_ADD_ALLOCATED(allocated, ret ? size : 0);
     MALLOC_STAT_ADD_IN_USE(allocated);
     MALLOC_STAT_UPDATE_PEAK();
 
+    MALLOC_STAT_MODULE_ALLOC(allocated, ret ? size : 0, __builtin_return_address(0), ret);
+
     MALLOC_STAT_TRACE("valloc", ret, allocated);
+    MALLOC_STAT_COLLECT_ALLOC(ret, size, __builtin_return_address(0));
 
     return ret;
 }
 
 void* pvalloc(size_t size) {
+    MALLOC_STAT_PASSTHROUGH(real_pvalloc(size));
+
     if( !DL_RESOLVE_CHECK(pvalloc) ) {
         return NULL;
     }
 
     MALLOC_STAT_INC_ALLOCATIONS();
 
+    uint64_t start = MALLOC_STAT_LATENCY_BEGIN();
     void *ret = real_pvalloc(size);
+    MALLOC_STAT_LATENCY_END(MALLOC_STAT_LATENCY_PVALLOC, start, size);
     size_t allocated = malloc_usable_size(ret);
 
-    MALLOC_STAT_ADD_ALLOCATED(allocated);
+    MALLOC_STAT_ADD_ALLOCATED(allocated, ret ? size : 0);
     MALLOC_STAT_ADD_IN_USE(allocated);
     MALLOC_STAT_UPDATE_PEAK();
 
+    MALLOC_STAT_MODULE_ALLOC(allocated, ret ? size : 0, __builtin_return_address(0), ret);
+
     MALLOC_STAT_TRACE("pvalloc", ret, allocated);
+    MALLOC_STAT_COLLECT_ALLOC(ret, size, __builtin_return_address(0));
 
     return ret;
 }
 
 void* aligned_alloc(size_t alignment, size_t size) {
+    MALLOC_STAT_PASSTHROUGH(real_aligned_alloc(alignment, size));
+
     if ( !DL_RESOLVE_CHECK(aligned_alloc) ) {
         return NULL;
     }
 
     MALLOC_STAT_INC_ALLOCATIONS();
 
+    uint64_t start = MALLOC_STAT_LATENCY_BEGIN();
     void *ret = real_aligned_alloc(alignment, size);
+    MALLOC_STAT_LATENCY_END(MALLOC_STAT_LATENCY_ALIGNED_ALLOC, start, size);
     size_t allocated = malloc_usable_size(ret);
 
-    MALLOC_STAT_ADD_ALLOCATED(allocated);
+    MALLOC_STAT_ADD_ALLOCATED(allocated, ret ? size : 0);
     MALLOC_STAT_ADD_IN_USE(allocated);
     MALLOC_STAT_UPDATE_PEAK();
 
+    MALLOC_STAT_MODULE_ALLOC(allocated, ret ? size : 0, __builtin_return_address(0), ret);
+
     MALLOC_STAT_TRACE("aligned_alloc", ret, allocated);
+    MALLOC_STAT_COLLECT_ALLOC(ret, size, __builtin_return_address(0));
 
     return ret;
 }
 
 void free(void *ptr) {
+    if ( passthrough || thread_passthrough ) {
+        real_free(ptr);
+        return;
+    }
+
     if ( !DL_RESOLVE_CHECK(free) ) {
         // We can not log anything here because the log message would result another free call and it would fall into an endless loop
         return;
@@ -666,15 +6155,55 @@ void free(void *ptr) {
 
         MALLOC_STAT_ADD_DEALLOCATED(allocated);
         MALLOC_STAT_SUB_IN_USE(allocated);
+        MALLOC_STAT_MODULE_FREE(allocated, ptr, __builtin_return_address(0));
 
         MALLOC_STAT_TRACE("free", ptr, allocated);
+        MALLOC_STAT_COLLECT_FREE(ptr);
 
+        uint64_t start = MALLOC_STAT_LATENCY_BEGIN();
         real_free(ptr);
+        MALLOC_STAT_LATENCY_END(MALLOC_STAT_LATENCY_FREE, start, allocated);
 
         return;
     }
 
+    MALLOC_STAT_MODULE_FREE(0, NULL, __builtin_return_address(0));
     MALLOC_STAT_TRACE("free(NULL)", NULL, 0);
 }
 
+void *dlopen(const char *file, int mode) {
+    if ( !real_dlopen ) {
+        real_dlopen = dlsym(RTLD_NEXT, "dlopen");
+    }
+
+    /* a sibling call, so the loader looks the library up by the RPATH and
+     * the RUNPATH of the caller */
+    if ( !modules_enabled ) {
+        return real_dlopen(file, mode);
+    }
+
+    void *ret = real_dlopen(file, mode);
+    /* the new modules and their dependencies are added to the table */
+    if ( ret ) {
+        modules_refresh();
+    }
+
+    return ret;
+}
+
+int dlclose(void *handle) {
+    if ( !real_dlclose ) {
+        real_dlclose = dlsym(RTLD_NEXT, "dlclose");
+    }
+
+    int ret = real_dlclose(handle);
+    /* the ranges of the unloaded modules may be reused by the next ones */
+    if ( modules_enabled ) {
+        modules_refresh();
+    }
+    __atomic_add_fetch(&sym_generation, 1, __ATOMIC_RELEASE);
+
+    return ret;
+}
+
 /* EOF */